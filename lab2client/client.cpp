@@ -21,6 +21,14 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <iterator>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "protocol.h"
 
 #define CMD_LOGIN      "/login"
 #define CMD_LOGOUT     "/logout"
@@ -29,46 +37,28 @@
 #define CMD_CREATESESS "/createsession"
 #define CMD_DIRMESSAGE "/directmessage" 
 #define CMD_LIST       "/list"
+#define CMD_SENDFILE   "/sendfile"
+#define CMD_STATS      "/stats"
 #define CMD_QUIT       "/quit"
 
 #define SESSION_NOT_FOUND "NoSessionFound"
 
-#define MAXDATASIZE 1380 // max number of bytes we can get at once
+#define TRANSFER_CHUNK 65536 // Bytes of a file sent or received at once
 
 using namespace std;
 
 
-// Defines control packet types
-enum msgType {
-    LOGIN,
-    LO_ACK,
-    LO_NAK,
-    EXIT,
-    JOIN,
-    JN_ACK,
-    JN_NAK,
-    LEAVE_SESS,
-    LS_ACK,
-    LS_NAK,
-    NEW_SESS,
-    NS_ACK,
-    NS_NAK,
-    MESSAGE,
-    QUERY,
-    QU_ACK,
-    DIRMESSAGE,
-    DMESS_ACK,
-    DMESS_NAK
-};
-
-
-// Message structure to be serialized when sending messages
-// Note: when message is stringified, the delimiter between fields is " "
-struct message {
-    unsigned int type;
-    unsigned int size;
-    string source;
-    string data;
+// File sent or received over a data connection of its own, so the chat
+// goes on meanwhile
+struct fileTransfer {
+    int sockfd;     // Data connection to the server
+    int filefd;
+    bool sending;
+    string name;
+    string peer;    // Who the file goes to or comes from
+    off_t size;
+    off_t done;     // Bytes sent or received so far
+    int pipefd[2];  // Moves received bytes from the socket to the file
 };
 
 
@@ -86,6 +76,8 @@ int sockfd = -1;                // Socket used to communicate with server
 struct connectionDetails login; // Holds login details pertaining to this client
 bool loggedIn = false;          // Keep track of if this client is logged in
 bool inSession = false;         // Keep track of it this client is in a session
+struct protocolState server;    // What was received and negotiated on the connection to the server
+vector<struct fileTransfer> transfers; // Files being sent or received
 
 
 // Get sockaddr, IPv4 or IPv6:
@@ -99,44 +91,108 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 
-// Create a packet string from a message structure
-string stringifyMessage(const struct message* data)
-{
-    string dataStr = to_string(data->type) + " " + to_string(data->size) 
-                     + " " + data->source + " " + data->data;
-    return dataStr;
-}
-
-
-// Sends a message to server in the following format:
-//   message = "<type> <data_size> <source> <data>"
+// Sends a message to server, in frames as described in protocol.cpp
 // Returns true if message is successfully sent
 bool sendToServer(struct message *data)
 {
     int numBytes;
-    string dataStr = stringifyMessage(data);
+    string frame;
+    if(!encodeMessage(server, data, frame)) return false;
     
-    if(dataStr.length() + 1 > MAXDATASIZE) return false;
-    if((numBytes = send(sockfd, dataStr.c_str(), dataStr.length() + 1, 0)) == -1)
+    for(size_t sent = 0; sent < frame.length(); sent += numBytes)
     {
-        perror("send");
-        return false;
+        if((numBytes = send(sockfd, frame.data() + sent, frame.length() - sent, 0)) == -1)
+        {
+            perror("send");
+            return false;
+        }
     }
     return true;
 }
 
 
+// Reads whatever the server sent into the receive buffer
+// Returns the number of bytes read, 0 if the server closed the connection
+// or -1 on error
+int recvFromServer()
+{
+    char buffer[MAXDATASIZE];
+    int numBytes = recv(sockfd, buffer, MAXDATASIZE, 0);
+    
+    if(numBytes > 0) server.inBuf.append(buffer, numBytes);
+    return numBytes;
+}
+
+
+void receiveFile(const struct message& packet);
+
+// Prints a message other clients sent to this client, or starts receiving
+// the file they offered
+// Returns false if the packet isn't a message
+bool displayMessage(const struct message& packet)
+{
+    if(packet.type == FILE_OFFER)
+        receiveFile(packet);
+    else if(packet.type == MESSAGE)
+        cout << packet.source << ": " << packet.data << endl;
+    else if(packet.type == DIRMESSAGE)
+        cout << packet.source << "(DM): " << packet.data << endl;
+    else
+        return false;
+    return true;
+}
+
+
+// Handles a packet that arrived without a request: a message, or the
+// session the server put this client back in after it restarted
+void handleUnsolicited(const struct message& packet)
+{
+    if(displayMessage(packet)) return;
+    
+    if(packet.type == JN_ACK)
+    {
+        inSession = true;
+        cout << "Rejoined session '" << packet.data << "'" << endl;
+    }
+}
+
+
+// Waits for the server's response to a request. Messages from other clients
+// that arrive in the meantime are printed.
+// Returns true if a response was received
+bool recvResponse(struct message& packet)
+{
+    while(1)
+    {
+        while(nextPacket(server, packet))
+        {
+            if(!displayMessage(packet)) return true;
+        }
+        
+        int numBytes = recvFromServer();
+        if(numBytes == -1)
+        {
+            perror("recv");
+            return false;
+        }
+        if(numBytes == 0)
+        {
+            cout << "Server closed the connection" << endl;
+            return false;
+        }
+    }
+}
+
+
 // Sends login info to server and checks server's response
 // Returns true if login is successful
 bool requestLogin(struct connectionDetails login)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
     struct message info;
     info.type = LOGIN;
     info.size = login.clientPassword.length() + 1;
     info.source = login.clientID;
-    info.data = login.clientPassword;
+    info.data = login.clientPassword + " " + PROTOCOL_VERSION; // Older servers ignore the version
         
     // Sends login request to server
     if(!sendToServer(&info)){
@@ -144,29 +200,19 @@ bool requestLogin(struct connectionDetails login)
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    struct message response;
+    if(!recvResponse(response)) return false;
     
-    // Checking packet type
-    string s(buffer), temp, data;
-    stringstream ss(s);
-    ss >> response >> temp >> temp >> data;
-    
-    if(response == LO_NAK)
+    if(response.type == LO_NAK)
     {
-        // Get the rest of the error message
-        string restOfData;
-        getline(ss, restOfData);
-        data += restOfData;
-        
-        cout << "Error: " << data << endl;
+        cout << "Error: " << response.data << endl;
         return false;
     }
-    else if(response == LO_ACK) 
+    else if(response.type == LO_ACK) 
     {
+        // Everything after the acknowledgement uses binary frames
+        if(response.data == PROTOCOL_VERSION) server.binaryFraming = true;
+        
         cout << "Login successful!" << endl;
         return true;
     } 
@@ -195,8 +241,6 @@ void logout()
 // Returns true if session is joined
 bool requestJoinSession(string sessionID, string sessionPassword)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
     struct message joinSession;
     joinSession.type = JOIN;
     joinSession.size = sessionID.length() + 1;
@@ -209,30 +253,17 @@ bool requestJoinSession(string sessionID, string sessionPassword)
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    struct message response;
+    if(!recvResponse(response)) return false;
     
-    // Checking packet type
-    string s(buffer), temp, data;
-    stringstream ss(s);
-    ss >> response >> temp >> temp >> data;
-    
-    if(response == JN_NAK) 
+    if(response.type == JN_NAK) 
     {
-        // Get the rest of the error message
-        string restOfData;
-        getline(ss, restOfData);
-        data += restOfData;
-        
-        cout << "Error: " << data << endl;
+        cout << "Error: " << response.data << endl;
         return false;
     }
-    else if(response == JN_ACK)
+    else if(response.type == JN_ACK)
     {
-        cout << "Session '" << data << "' joined!" << endl;
+        cout << "Session '" << response.data << "' joined!" << endl;
         return true;
     }
     else
@@ -247,8 +278,6 @@ bool requestJoinSession(string sessionID, string sessionPassword)
 // Returns true if session is exited
 bool requestLeaveSession()
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
     struct message leaveSession;
     leaveSession.type = LEAVE_SESS;
     leaveSession.size = 0;
@@ -261,30 +290,17 @@ bool requestLeaveSession()
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
-        
-    string s(buffer), temp, data;
-    stringstream ss(s);
-    ss >> response >> temp >> temp >> data;
-
+    struct message response;
+    if(!recvResponse(response)) return false;
     
-    if (response == LS_NAK)
+    if (response.type == LS_NAK)
     {
-        // Get the rest of the error message
-        string restOfData;
-        getline(ss, restOfData);
-        data += restOfData;
-        
-        cout << "Error: " << data << endl;
+        cout << "Error: " << response.data << endl;
         return false;
     }
-    else if (response == LS_ACK)
+    else if (response.type == LS_ACK)
     {
-        cout << "Exited session '" << data << "'!" << endl;
+        cout << "Exited session '" << response.data << "'!" << endl;
         return true;
     }
     else
@@ -299,8 +315,6 @@ bool requestLeaveSession()
 // Returns true if session was successfully created
 bool requestNewSession(string sessionID, string sessionPassword)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
     struct message newSession;
     newSession.type = NEW_SESS;
     newSession.size = sessionID.length() + 1;
@@ -313,32 +327,19 @@ bool requestNewSession(string sessionID, string sessionPassword)
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
-        
-    // Checking packet type
-    string s(buffer), temp, data;
-    stringstream ss(s);
-    ss >> response >> temp >> temp >> data;
-
-    if(response == NS_NAK) 
+    struct message response;
+    if(!recvResponse(response)) return false;
+    
+    if(response.type == NS_NAK) 
     {
-        // Get the rest of the error message
-        string restOfData;
-        getline(ss, restOfData);
-        data += restOfData;
-        
-        cout << "Error: " << data << endl;
+        cout << "Error: " << response.data << endl;
         return false;
     }
     
-    else if(response == NS_ACK)
+    else if(response.type == NS_ACK)
     {
         
-        cout << "Session '" << data << "' created!" << endl;
+        cout << "Session '" << response.data << "' created!" << endl;
         return true;
     }
     else
@@ -352,10 +353,7 @@ bool requestNewSession(string sessionID, string sessionPassword)
 // Prints out list of connected clients and available sessions
 void printClientSessionList(string buffer)
 {
-    // Get rid of type, data_size, and source, leaving just the list of clients and sessions
     stringstream ss(buffer);
-    string temp;
-    ss >> temp >> temp >> temp;
 
     // Printing list of clients and sessions
     string data;
@@ -379,8 +377,6 @@ void printClientSessionList(string buffer)
 // Returns session list if bool is true
 pair<bool, string> requestClientSessionList()
 {
-    int numBytes, response;
-    char buffer[MAXDATASIZE];
     
     // Prepare message
     struct message info;
@@ -395,18 +391,10 @@ pair<bool, string> requestClientSessionList()
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return make_pair(false, "NoList");
-    }
+    struct message response;
+    if(!recvResponse(response)) return make_pair(false, "NoList");
     
-    // Checking packet type
-    string s(buffer);
-    stringstream ss(s);
-    ss >> response;
-    
-    if(response != QU_ACK)
+    if(response.type != QU_ACK)
     {
         cout << "List unavailable!" << endl;
         return make_pair(false, "NoList");
@@ -414,14 +402,33 @@ pair<bool, string> requestClientSessionList()
     // List received, return it
     else
     {
-        return make_pair(true, s);
+        return make_pair(true, response.data);
     }
 }
 
 
-// Creates connection with server and returns socket file descriptor that
-// describes the connection
-int createConnection()
+// Asks the server for its counters and prints them
+void requestStats()
+{
+    struct message info;
+    info.type = STATS;
+    info.size = 0;
+    info.source = login.clientID;
+    info.data = "";
+    
+    struct message response;
+    if(!sendToServer(&info) || !recvResponse(response) || response.type != STATS)
+    {
+        cout << "Statistics unavailable!" << endl;
+        return;
+    }
+    cout << response.data << endl;
+}
+
+
+// Creates connection with server on the given port and returns socket file
+// descriptor that describes the connection
+int createConnection(const string& port)
 {
     int newSockFD, rv;
     struct addrinfo hints, *servinfo, *p;
@@ -438,7 +445,7 @@ int createConnection()
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    if ((rv = getaddrinfo(login.serverIP.c_str(), login.serverPort.c_str(), &hints, &servinfo)) != 0)
+    if ((rv = getaddrinfo(login.serverIP.c_str(), port.c_str(), &hints, &servinfo)) != 0)
     {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return -1;
@@ -471,7 +478,7 @@ int createConnection()
     //Retrieves IP address from the server that is currently being connected to
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *) p->ai_addr),
             s, sizeof s);
-    printf("Trying to connect to server at %s\n", s);
+    if(port == login.serverPort) printf("Trying to connect to server at %s\n", s);
 
     return newSockFD;
 }
@@ -499,38 +506,36 @@ unsigned int countNumArguments(std::string const& str)
 
 bool sendDirectMessage(string receiverID, string message)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
     struct message dirMessage;
     dirMessage.type = DIRMESSAGE;
     dirMessage.source = login.clientID;
     dirMessage.data = receiverID + " " + message;
     dirMessage.size = dirMessage.data.length() + 1;
     
-    if(!sendToServer(&dirMessage)) cout << "Message not sent!" << endl;
-    
-    // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
+    if(!sendToServer(&dirMessage))
     {
-        perror("recv");
+        cout << "Message not sent!" << endl;
         return false;
     }
-        
-    string s(buffer), temp, data;
-    stringstream ss(s);
-    ss >> response >> temp >> temp >> data;
     
-    if (response == DMESS_NAK)
+    // Server response
+    struct message response;
+    if(!recvResponse(response)) return false;
+    
+    if (response.type == DMESS_NAK)
     {
-        // Get the rest of the error message
-        string restOfData;
-        getline(ss, restOfData);
-        data += restOfData;
-        
-        cout << "Error: " << data << endl;
+        cout << "Error: " << response.data << endl;
         return false;
     }
-    else if (response == DMESS_ACK) return true;
+    else if (response.type == DMESS_ACK)
+    {
+        // Kept by the server until the receiver logs in
+        if(response.data == receiverID + " queued")
+        {
+            cout << receiverID << " is offline and will get the message when they log in" << endl;
+        }
+        return true;
+    }
     else
     {
         cout << "directmessage: unknown message type received" << endl;
@@ -538,6 +543,202 @@ bool sendDirectMessage(string receiverID, string message)
     }
 }
 
+// Opens a data connection for a file transfer and presents its token
+// Returns the non-blocking socket, or -1 on error
+int openDataConnection(const string& port, uint64_t token)
+{
+    int fd = createConnection(port);
+    if(fd == -1) return -1;
+    
+    token = htobe64(token);
+    if(send(fd, &token, sizeof token, 0) != sizeof token ||
+       fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1)
+    {
+        perror("send");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// Offers a file to a user or to the session, and starts sending it once the
+// server tells where to
+// Returns true if the transfer started
+bool sendFile(string target, string path)
+{
+    int filefd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(filefd == -1 || fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        cout << "Can't send '" << path << "'!" << endl;
+        if(filefd != -1) close(filefd);
+        return false;
+    }
+    
+    struct fileTransfer t;
+    t.filefd = filefd;
+    t.sending = true;
+    t.name = path.substr(path.find_last_of('/') + 1);
+    t.peer = target;
+    t.size = st.st_size;
+    t.done = 0;
+    
+    struct message offer;
+    offer.type = FILE_OFFER;
+    offer.source = login.clientID;
+    offer.data = target + " " + to_string(t.size) + " " + t.name;
+    offer.size = offer.data.length() + 1;
+    
+    // Server response
+    struct message response;
+    if(!sendToServer(&offer) || !recvResponse(response))
+    {
+        cout << "File not sent!" << endl;
+        close(filefd);
+        return false;
+    }
+    
+    if(response.type == FILE_NAK)
+    {
+        cout << "Error: " << response.data << endl;
+        close(filefd);
+        return false;
+    }
+    else if(response.type != FILE_ACK)
+    {
+        cout << "sendfile: unknown message type received" << endl;
+        close(filefd);
+        return false;
+    }
+    
+    string port;
+    uint64_t token;
+    stringstream(response.data) >> port >> token;
+    if((t.sockfd = openDataConnection(port, token)) == -1)
+    {
+        close(filefd);
+        return false;
+    }
+    
+    cout << "Sending '" << t.name << "' (" << t.size << " bytes) to " << target << endl;
+    transfers.push_back(t);
+    return true;
+}
+
+
+// Starts receiving a file another client offered, saved under its name in
+// the current directory, or with a number appended if that name is taken
+void receiveFile(const struct message& packet)
+{
+    struct fileTransfer t;
+    string port, name;
+    uint64_t token;
+    stringstream ss(packet.data);
+    ss >> port >> token >> t.size;
+    ss.get();
+    getline(ss, name);
+    
+    // Nothing but the base name, so the sender can't pick the directory
+    name = name.substr(name.find_last_of('/') + 1);
+    if(name.empty() || name == "." || name == ".." || t.size <= 0) return;
+    
+    t.name = name;
+    for(int i = 1; (t.filefd = open(t.name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1; i++)
+    {
+        if(errno != EEXIST)
+        {
+            perror("open");
+            return;
+        }
+        t.name = name + "." + to_string(i);
+    }
+    
+    if(pipe(t.pipefd) == -1 || (t.sockfd = openDataConnection(port, token)) == -1)
+    {
+        cout << "Can't receive '" << name << "' from " << packet.source << "!" << endl;
+        close(t.filefd);
+        unlink(t.name.c_str());
+        return;
+    }
+    
+    t.sending = false;
+    t.peer = packet.source;
+    t.done = 0;
+    cout << "Receiving '" << t.name << "' (" << t.size << " bytes) from " << t.peer << endl;
+    transfers.push_back(t);
+}
+
+
+// Moves the next chunk of a file between the disk and its data connection,
+// without copying it into the client. Chunks are received through a pipe
+// with splice() and sent with sendfile().
+// Returns false once the transfer is over
+bool pumpTransfer(struct fileTransfer& t)
+{
+    ssize_t n;
+    if(t.sending)
+    {
+        n = sendfile(t.sockfd, t.filefd, NULL, min((off_t) TRANSFER_CHUNK, t.size - t.done));
+        if(n == -1 && errno == EAGAIN) return true;
+        if(n > 0) t.done += n;
+    }
+    else
+    {
+        n = splice(t.sockfd, NULL, t.pipefd[1], NULL, TRANSFER_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n == -1 && errno == EAGAIN) return true;
+        
+        for(ssize_t left = n; left > 0; )
+        {
+            ssize_t written = splice(t.pipefd[0], NULL, t.filefd, NULL, left, SPLICE_F_MOVE);
+            if(written <= 0)
+            {
+                perror("splice");
+                n = -1;
+                break;
+            }
+            left -= written;
+        }
+        if(n > 0) t.done += n;
+    }
+    
+    if(n > 0 && t.done < t.size) return true;
+    
+    close(t.sockfd);
+    close(t.filefd);
+    if(!t.sending)
+    {
+        close(t.pipefd[0]);
+        close(t.pipefd[1]);
+    }
+    
+    if(t.done == t.size && t.sending) cout << "Sent '" << t.name << "' to " << t.peer << endl;
+    else if(t.done == t.size) cout << "Received '" << t.name << "' from " << t.peer << endl;
+    else
+    {
+        cout << "Transfer of '" << t.name << "' failed after " << t.done << " bytes" << endl;
+        if(!t.sending) unlink(t.name.c_str());
+    }
+    return false;
+}
+
+
+// Moves every file whose data connection is ready along
+void pumpTransfers(fd_set *readFds, fd_set *writeFds)
+{
+    for(size_t i = 0; i < transfers.size(); )
+    {
+        struct fileTransfer& t = transfers[i];
+        if(!FD_ISSET(t.sockfd, t.sending ? writeFds : readFds) || pumpTransfer(t))
+        {
+            i++;
+            continue;
+        }
+        transfers.erase(transfers.begin() + i);
+    }
+}
+
+
 int main(int argc, char** argv)
 {
     if (argc != 1)
@@ -547,6 +748,7 @@ int main(int argc, char** argv)
     }
     
     fd_set master, read_fds; // WIll hold descriptors for connection and stdin
+    fd_set write_fds;        // Data connections of files being sent
     int fdmax;
     
     FD_ZERO(&master);
@@ -562,12 +764,27 @@ int main(int argc, char** argv)
 
     while(1)
     {        
+        // Print messages that arrived while waiting for a response
+        struct message packet;
+        while(nextPacket(server, packet)) handleUnsolicited(packet);
+        
         read_fds = master; // copy master list
-        if (select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1)
+        FD_ZERO(&write_fds);
+        
+        // Data connections of file transfers come on top
+        int maxfd = fdmax;
+        for(auto const & t : transfers)
+        {
+            FD_SET(t.sockfd, t.sending ? &write_fds : &read_fds);
+            if(t.sockfd > maxfd) maxfd = t.sockfd;
+        }
+        
+        if (select(maxfd+1, &read_fds, &write_fds, NULL, NULL) == -1)
         {
             perror("select");
             exit(4);
         }
+        pumpTransfers(&read_fds, &write_fds);
 
         for(int i = 0; i <= fdmax; i++)
         {
@@ -576,10 +793,9 @@ int main(int argc, char** argv)
                 if(i == sockfd) // Message from the server
                 {
                     int nbytes;
-                    char buf[MAXDATASIZE];
 
                     // Got error or connection closed by server
-                    if ((nbytes = recv(i, buf, MAXDATASIZE, 0)) <= 0)
+                    if ((nbytes = recvFromServer()) <= 0)
                     {
                         if (nbytes == 0) // Connection closed
                         {
@@ -591,23 +807,13 @@ int main(int argc, char** argv)
                         FD_CLR(i, &master); // remove from master set
                         return 0;
                     }
-                    else // Received data
+                    else // Received data, print every complete packet
                     {
-                        string received(buf), size, source, message;
-                        int type;
-                        stringstream ss(received);
-                        ss >> type >> size >> source;
-                        
-                        getline(ss, message);
-                        message.erase(0, 1); // Remove extra space from getline
-
-                        if(type == MESSAGE)
-                            cout << source << ": " << message << endl;
-                        else if(type == DIRMESSAGE)
-                            cout << source << "(DM): " << message << endl;
+                        struct message packet;
+                        while(nextPacket(server, packet)) handleUnsolicited(packet);
                     }
                 }
-                else // Only 2 descriptors in set, so this is stdin
+                else if(i == STDIN_FILENO)
                 {
                     // Create stringstream to extract login input from user
                     string input, command;
@@ -630,7 +836,7 @@ int main(int argc, char** argv)
                                >> login.serverIP >> login.serverPort;
                             
                             // Create connection and get file descriptor
-                            sockfd = createConnection();
+                            sockfd = createConnection(login.serverPort);
 
                             // If connection created and login info sent successfully
                             if(sockfd != -1 && requestLogin(login))
@@ -642,6 +848,7 @@ int main(int argc, char** argv)
                             else
                             {
                                 close(sockfd);
+                                resetConnection(server);
                                 sockfd = -1;
                             }
                         }
@@ -666,6 +873,7 @@ int main(int argc, char** argv)
 
                             cout << "Closing connection" << endl;
                             close(sockfd);
+                            resetConnection(server);
                             FD_CLR(sockfd, &master); // remove from master set
                         }
                         else cout << "Please login" << endl;
@@ -689,6 +897,7 @@ int main(int argc, char** argv)
 
                             cout << "Closing connection" << endl;
                             close(sockfd);
+                            resetConnection(server);
                             FD_CLR(sockfd, &master); // remove from master set
 
                         }
@@ -807,6 +1016,32 @@ int main(int argc, char** argv)
                         }
                         cout << endl;
                     }
+                    else if(command == CMD_SENDFILE)
+                    {
+                        string target, path;
+                        ss >> target;
+                        getline(ss, path);
+                        
+                        // The path is the rest of the line, spaces included
+                        size_t start = path.find_first_not_of(" \t");
+                        size_t end = path.find_last_not_of(" \t\r\n");
+                        if(target.empty() || start == string::npos)
+                        {
+                            cout << "Usage: /sendfile <user|session> <path>" << endl;
+                        }
+                        else sendFile(target, path.substr(start, end - start + 1));
+                        cout << endl;
+                    }
+                    else if(command == CMD_STATS)
+                    {
+                        unsigned int numArguments = countNumArguments(input) - 1;
+                        if(numArguments != 0)
+                        {
+                            cout << "Usage: /stats" << endl;
+                        }
+                        else requestStats();
+                        cout << endl;
+                    }
                     else
                     {
                         if(!inSession)
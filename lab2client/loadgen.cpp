@@ -0,0 +1,839 @@
+/*
+ * File:   loadgen.cpp
+ *
+ * Load generator: logs thousands of users in to the server, puts them in
+ * sessions, has them send messages at a target rate and measures how long
+ * the messages take to reach the other members of the session
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "protocol.h"
+
+#define LOGIN_WINDOW 256        // Logins waiting for an answer at once, well below the server's queue
+#define RETRY_DELAY 100000000UL // Nanoseconds before retrying a login the server was too busy for
+#define SETUP_TIMEOUT 30000     // Milliseconds without an answer after which setting up fails
+#define DRAIN_IDLE 200000000UL  // Nanoseconds without deliveries after which a worker stops
+#define DRAIN_TIMEOUT 2000000000UL // Longest wait for deliveries after the last message was sent
+#define MAX_BACKLOG (1 << 20)   // Bytes a user can have waiting to be written before it stops sending
+#define MAX_EVENTS 256          // Events handled per epoll_wait()
+#define READ_SIZE 65536         // Bytes read from a socket at once
+#define SESSION_PASSWORD "load"
+
+#define HIST_SUB_BITS 4            // Log2 of the buckets per power of two of a histogram
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS) // Buckets per power of two, 6% apart
+#define HIST_BUCKETS 608           // Buckets of a histogram, enough for values up to 2^40
+
+using namespace std;
+
+
+// Counts of latencies in nanoseconds, bucketed like the server's histograms
+struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long sum;
+    unsigned long max;
+};
+
+// Simulated user and its connection to the server
+struct user {
+    int fd;
+    string name;
+    struct protocolState proto;
+    string out;         // Frames the socket didn't take yet
+    size_t session;     // Index of its session
+    size_t recipients;  // Other members of its session, who get each message it sends
+    bool writeWaiting;  // Waiting for room in the socket to write out
+    bool dirty;         // Got frames during the current loop iteration
+};
+
+struct session {
+    string name;
+    vector<size_t> members; // The first one creates the session
+};
+
+// Thread that drives a share of the users once they are in their sessions
+struct worker {
+    int id;
+    vector<struct user*> users;
+    int epfd;
+    int timerfd;            // Fires when the next message is due
+    struct histogram latency;
+    unsigned long sent;      // Messages measured, by when they were due
+    unsigned long expected;  // Deliveries of the measured messages
+    unsigned long delivered; // Deliveries of measured messages received
+    unsigned long unsent;    // Messages not sent because the server wasn't reading
+    unsigned long disconnected;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+};
+
+
+// GLOBAL VARIABLES
+string serverIP, serverPort;
+struct addrinfo *serverAddress = NULL;
+size_t numUsers = 100;
+int numThreads = 1;
+double rate = 1000;         // Messages per second sent by all users together
+size_t messageSize = 64;
+double warmup = 1;          // Seconds sent before measuring starts
+double duration = 10;       // Seconds measured
+string fanoutSpec = "9";    // Recipients of each message: "<n>", "<min>-<max>" or "zipf:<min>-<max>"
+string userPrefix = "load";
+vector<struct user> users;
+vector<struct session> sessions;
+uint64_t sendStart, measureStart, measureEnd; // Monotonic nanoseconds
+
+
+uint64_t monotonicNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+size_t histogramBucket(unsigned long value)
+{
+    if(value < HIST_SUB_BUCKETS) return value;
+    
+    int exponent = 63 - __builtin_clzl(value);
+    size_t bucket = (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+                    ((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+
+// Returns the highest value counted in a histogram bucket
+unsigned long bucketLimit(size_t bucket)
+{
+    if(bucket < HIST_SUB_BUCKETS) return bucket;
+    
+    int exponent = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    unsigned long sub = bucket % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+
+void recordValue(struct histogram *h, unsigned long value)
+{
+    h->counts[histogramBucket(value)]++;
+    h->total++;
+    h->sum += value;
+    if(value > h->max) h->max = value;
+}
+
+
+void addHistogram(struct histogram *sum, const struct histogram *h)
+{
+    for(size_t i = 0; i < HIST_BUCKETS; i++) sum->counts[i] += h->counts[i];
+    sum->total += h->total;
+    sum->sum += h->sum;
+    sum->max = max(sum->max, h->max);
+}
+
+
+// Returns the value below which the given fraction of the counted values are,
+// to the precision of the buckets
+unsigned long percentile(const struct histogram *h, double fraction)
+{
+    unsigned long rank = (unsigned long) (fraction * h->total + 0.5), seen = 0;
+    if(rank == 0) rank = 1;
+    for(size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if(seen >= rank) return min(bucketLimit(i), h->max);
+    }
+    return h->max;
+}
+
+
+// Parses the fan-out distribution: a fixed number of recipients, a uniform
+// range, or a range where n recipients are 1/n as likely as one
+// Returns false if it isn't one of those
+bool parseFanout(const string& spec, bool& zipf, size_t& low, size_t& high)
+{
+    const char *p = spec.c_str();
+    zipf = strncmp(p, "zipf:", 5) == 0;
+    if(zipf) p += 5;
+    
+    char *end;
+    low = high = strtoul(p, &end, 10);
+    if(end == p) return false;
+    if(*end == '-')
+    {
+        p = end + 1;
+        high = strtoul(p, &end, 10);
+        if(end == p) return false;
+    }
+    return *end == '\0' && low <= high;
+}
+
+
+// Splits the users into sessions whose sizes follow the fan-out distribution
+bool createSessions()
+{
+    bool zipf;
+    size_t low, high;
+    if(!parseFanout(fanoutSpec, zipf, low, high)) return false;
+    
+    // The seed is fixed so every run with the same options has the same sessions
+    mt19937 random(1);
+    vector<double> weights;
+    for(size_t n = low; n <= high; n++) weights.push_back(zipf ? 1.0 / max(n, (size_t) 1) : 1.0);
+    discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    
+    string prefix = userPrefix + to_string(getpid()) + "-";
+    for(size_t next = 0; next < numUsers; )
+    {
+        size_t size = min(low + pick(random) + 1, numUsers - next);
+        struct session s;
+        s.name = prefix + to_string(sessions.size());
+        for(size_t i = 0; i < size; i++)
+        {
+            users[next].session = sessions.size();
+            users[next].recipients = size - 1;
+            s.members.push_back(next++);
+        }
+        sessions.push_back(s);
+    }
+    return true;
+}
+
+
+// Writes out as much of what was queued for the server as the socket takes
+// Returns false if the connection failed
+bool flushUser(struct user& u, unsigned long *bytesOut)
+{
+    size_t sent = 0;
+    while(sent < u.out.length())
+    {
+        ssize_t n = send(u.fd, u.out.data() + sent, u.out.length() - sent, MSG_NOSIGNAL);
+        if(n == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        sent += n;
+    }
+    u.out.erase(0, sent);
+    if(bytesOut != NULL) *bytesOut += sent;
+    return true;
+}
+
+
+// Queues a packet for the server
+// Returns false if it can't be sent
+bool queuePacket(struct user& u, unsigned int type, const string& data)
+{
+    struct message m;
+    m.type = type;
+    m.size = data.length() + 1;
+    m.source = u.name;
+    m.data = data;
+    return encodeMessage(u.proto, &m, u.out);
+}
+
+
+// Reads whatever the server sent a user into its receive buffer
+// Returns the number of bytes read, 0 if there was nothing to read or -1 if
+// the connection was closed
+ssize_t readUser(struct user& u)
+{
+    char buffer[READ_SIZE];
+    ssize_t n = recv(u.fd, buffer, sizeof buffer, 0);
+    if(n > 0)
+    {
+        u.proto.inBuf.append(buffer, n);
+        return n;
+    }
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+}
+
+
+// Opens a non-blocking connection to the server for a user
+// Returns false if it can't be opened
+bool connectUser(struct user& u, int epfd)
+{
+    u.fd = socket(serverAddress->ai_family, serverAddress->ai_socktype, serverAddress->ai_protocol);
+    if(u.fd == -1)
+    {
+        perror("loadgen: socket");
+        return false;
+    }
+    if(connect(u.fd, serverAddress->ai_addr, serverAddress->ai_addrlen) == -1)
+    {
+        perror("loadgen: connect");
+        close(u.fd);
+        return false;
+    }
+    
+    // Latency is measured per message, so none waits for the one before
+    int one = 1;
+    setsockopt(u.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    fcntl(u.fd, F_SETFL, fcntl(u.fd, F_GETFL, 0) | O_NONBLOCK);
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = &u - users.data();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, u.fd, &ev);
+    return true;
+}
+
+
+// Waits for answers from the server while setting up, and hands every
+// packet to handle along with the index of the user it came to
+// Returns false if the server closed a connection or stopped answering
+template <class Handler>
+bool awaitPackets(int epfd, Handler handle)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, SETUP_TIMEOUT);
+    if(n <= 0)
+    {
+        fprintf(stderr, "loadgen: the server stopped answering\n");
+        return false;
+    }
+    
+    for(int i = 0; i < n; i++)
+    {
+        struct user& u = users[events[i].data.u64];
+        if(u.fd == -1) continue; // Closed while handling an earlier event
+        if(readUser(u) == -1)
+        {
+            fprintf(stderr, "loadgen: the server closed the connection of %s\n", u.name.c_str());
+            return false;
+        }
+        
+        struct message packet;
+        while(u.fd != -1 && nextPacket(u.proto, packet)) handle(events[i].data.u64, packet);
+    }
+    return true;
+}
+
+
+// Logs every user in, LOGIN_WINDOW at a time, so the server never has more
+// passwords to check than it queues
+// Returns false if a login failed
+bool loginUsers(int epfd)
+{
+    size_t next = 0, waiting = 0, loggedIn = 0;
+    deque<pair<uint64_t, size_t>> retries; // Logins the server was too busy for, by when to retry
+    bool failed = false;
+    
+    while(loggedIn < numUsers && !failed)
+    {
+        uint64_t now = monotonicNanos();
+        while(waiting < LOGIN_WINDOW && (next < numUsers || (!retries.empty() && retries.front().first <= now)))
+        {
+            size_t i;
+            if(!retries.empty() && retries.front().first <= now)
+            {
+                i = retries.front().second;
+                retries.pop_front();
+            }
+            else i = next++;
+            
+            // The password is the username, as in the list written with -g
+            struct user& u = users[i];
+            if(!connectUser(u, epfd) || !queuePacket(u, LOGIN, u.name + " " + PROTOCOL_VERSION) ||
+               !flushUser(u, NULL))
+            {
+                return false;
+            }
+            waiting++;
+        }
+        
+        // Only retries left to start: wait for the first one to be due
+        if(waiting == 0)
+        {
+            usleep((retries.front().first - now) / 1000 + 1);
+            continue;
+        }
+        
+        bool answered = awaitPackets(epfd, [&](size_t i, struct message& packet)
+        {
+            struct user& u = users[i];
+            if(packet.type == LO_ACK)
+            {
+                u.proto.binaryFraming = packet.data == PROTOCOL_VERSION;
+                loggedIn++;
+            }
+            else if(packet.type == LO_NAK && packet.data.find("busy") != string::npos)
+            {
+                close(u.fd);
+                u.fd = -1;
+                resetConnection(u.proto);
+                retries.push_back(make_pair(monotonicNanos() + RETRY_DELAY, i));
+            }
+            else
+            {
+                fprintf(stderr, "loadgen: login of %s refused: %s\n", u.name.c_str(), packet.data.c_str());
+                failed = true;
+                return;
+            }
+            waiting--;
+        });
+        if(!answered) return false;
+    }
+    return !failed;
+}
+
+
+// Has the given users send the same request, and waits for every answer
+// Returns false if one was refused
+bool requestAll(int epfd, const vector<size_t>& who, unsigned int type, unsigned int ackType)
+{
+    for(auto const & i : who)
+    {
+        struct user& u = users[i];
+        const string& name = sessions[u.session].name;
+        if(!queuePacket(u, type, name + " " + SESSION_PASSWORD) || !flushUser(u, NULL)) return false;
+    }
+    
+    size_t waiting = who.size();
+    bool failed = false;
+    while(waiting > 0 && !failed)
+    {
+        bool answered = awaitPackets(epfd, [&](size_t i, struct message& packet)
+        {
+            if(packet.type == ackType)
+            {
+                waiting--;
+            }
+            else if(packet.type == ackType + 1) // The NAK follows the ACK of every request
+            {
+                fprintf(stderr, "loadgen: %s: %s\n", users[i].name.c_str(), packet.data.c_str());
+                failed = true;
+            }
+        });
+        if(!answered) return false;
+    }
+    return !failed;
+}
+
+
+// Sends the messages that are due and measures those delivered to the
+// worker's users, until everything sent was delivered or stopped coming
+void runWorker(struct worker *w)
+{
+    // Wakeups for the next message shouldn't come late on top of the latency
+    prctl(PR_SET_TIMERSLACK, 1UL);
+    
+    // Messages are due at fixed intervals, whether or not the earlier ones
+    // got through, so a slow server doesn't slow down what it is sent. Each
+    // worker sends its share of them, offset from the others.
+    double interval = 1e9 * numThreads / rate;
+    double due = sendStart + interval * w->id / numThreads;
+    size_t nextSender = 0;
+    
+    vector<struct user*> dirty;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t lastDelivery = 0;
+    string padding(messageSize, 'x');
+    
+    while(1)
+    {
+        uint64_t now = monotonicNanos();
+        if(due < measureEnd)
+        {
+            struct itimerspec when = {};
+            when.it_value.tv_sec = (uint64_t) due / 1000000000;
+            when.it_value.tv_nsec = (uint64_t) due % 1000000000;
+            timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &when, NULL);
+        }
+        else
+        {
+            // Everything was sent, wait for what is still on its way
+            if(now >= measureEnd + DRAIN_TIMEOUT) break;
+            if(now >= max(measureEnd, lastDelivery) + DRAIN_IDLE) break;
+        }
+        
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, due < measureEnd ? -1 : 10);
+        if(n == -1 && errno != EINTR)
+        {
+            perror("loadgen: epoll_wait");
+            break;
+        }
+        
+        for(int i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == NULL)
+            {
+                uint64_t expirations;
+                if(read(w->timerfd, &expirations, sizeof expirations) == -1) {}
+                continue;
+            }
+            
+            struct user *u = (struct user*) events[i].data.ptr;
+            if(u->fd == -1) continue;
+            if(events[i].events & EPOLLOUT && !u->dirty)
+            {
+                u->dirty = true;
+                dirty.push_back(u);
+            }
+            if(!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+            
+            ssize_t bytes = readUser(*u);
+            uint64_t received = monotonicNanos();
+            if(bytes == -1)
+            {
+                w->disconnected++;
+                close(u->fd);
+                u->fd = -1;
+                continue;
+            }
+            w->bytesIn += bytes;
+            
+            // Every message starts with when it was due to be sent
+            struct message packet;
+            while(nextPacket(u->proto, packet))
+            {
+                if(packet.type != MESSAGE) continue;
+                
+                uint64_t sent = strtoull(packet.data.c_str(), NULL, 10);
+                if(sent < measureStart || sent >= measureEnd) continue;
+                recordValue(&w->latency, received - sent);
+                w->delivered++;
+                lastDelivery = received;
+            }
+        }
+        
+        // Send every message due by now, round robin over the worker's users
+        now = monotonicNanos();
+        while(due <= now && due < measureEnd && !w->users.empty())
+        {
+            uint64_t scheduled = (uint64_t) due;
+            due += interval;
+            
+            struct user *u = w->users[nextSender++ % w->users.size()];
+            bool measured = scheduled >= measureStart;
+            if(u->fd == -1 || u->out.length() >= MAX_BACKLOG)
+            {
+                if(measured) w->unsent++;
+                continue;
+            }
+            
+            string data = to_string(scheduled) + " ";
+            data.append(padding, 0, messageSize > data.length() ? messageSize - data.length() : 0);
+            queuePacket(*u, MESSAGE, data);
+            if(measured)
+            {
+                w->sent++;
+                w->expected += u->recipients;
+            }
+            if(!u->dirty)
+            {
+                u->dirty = true;
+                dirty.push_back(u);
+            }
+        }
+        
+        // Write out everything queued in this iteration, one call per user
+        for(auto const & u : dirty)
+        {
+            u->dirty = false;
+            if(u->fd == -1) continue;
+            if(!flushUser(*u, &w->bytesOut))
+            {
+                w->disconnected++;
+                close(u->fd);
+                u->fd = -1;
+                continue;
+            }
+            
+            bool waiting = !u->out.empty();
+            if(waiting == u->writeWaiting) continue;
+            u->writeWaiting = waiting;
+            
+            struct epoll_event ev;
+            ev.events = EPOLLIN | (waiting ? (uint32_t) EPOLLOUT : 0);
+            ev.data.ptr = u;
+            epoll_ctl(w->epfd, EPOLL_CTL_MOD, u->fd, &ev);
+        }
+        dirty.clear();
+    }
+}
+
+
+// Writes a list of the users that the server's -g turns into a credential file
+int writeUserList(const string& path)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if(f == NULL)
+    {
+        perror(path.c_str());
+        return 1;
+    }
+    for(size_t i = 0; i < numUsers; i++)
+    {
+        string name = userPrefix + to_string(i);
+        fprintf(f, "%s %s\n", name.c_str(), name.c_str());
+    }
+    if(fclose(f) != 0)
+    {
+        perror(path.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+
+void appendFormat(string& out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void appendFormat(string& out, const char *format, ...)
+{
+    char text[512];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(text, sizeof text, format, ap);
+    va_end(ap);
+    if(len > 0) out.append(text, min(len, (int) sizeof text - 1));
+}
+
+
+// Adds up what the workers measured and prints it, as text on stdout and, if
+// a path was given, as JSON in that file ("-" for stdout as well)
+void report(const vector<struct worker*>& workers, double setupSeconds, const string& jsonPath)
+{
+    struct histogram latency = {};
+    unsigned long sent = 0, expected = 0, delivered = 0, unsent = 0, disconnected = 0;
+    unsigned long bytesIn = 0, bytesOut = 0;
+    for(auto const & w : workers)
+    {
+        addHistogram(&latency, &w->latency);
+        sent += w->sent;
+        expected += w->expected;
+        delivered += w->delivered;
+        unsent += w->unsent;
+        disconnected += w->disconnected;
+        bytesIn += w->bytesIn;
+        bytesOut += w->bytesOut;
+    }
+    
+    unsigned long recipients = 0;
+    for(auto const & s : sessions) recipients += s.members.size() * (s.members.size() - 1);
+    double meanFanout = (double) recipients / numUsers;
+    unsigned long lost = expected > delivered ? expected - delivered : 0;
+    double mean = latency.total > 0 ? (double) latency.sum / latency.total : 0;
+    
+    printf("%zu users in %zu sessions, %.2f recipients per message on average, set up in %.2f s\n"
+           "%lu messages sent in %.1f s (%.0f/s), %lu deliveries (%.0f/s), %lu lost, %lu not sent\n"
+           "latency (us): mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           numUsers, sessions.size(), meanFanout, setupSeconds,
+           sent, duration, sent / duration, delivered, delivered / duration, lost, unsent,
+           mean / 1000, percentile(&latency, 0.5) / 1000.0, percentile(&latency, 0.9) / 1000.0,
+           percentile(&latency, 0.99) / 1000.0, percentile(&latency, 0.999) / 1000.0,
+           latency.max / 1000.0);
+    if(disconnected > 0) printf("%lu users were disconnected\n", disconnected);
+    if(jsonPath.empty()) return;
+    
+    string out;
+    appendFormat(out, "{\"users\":%zu,\"threads\":%d,\"sessions\":%zu,\"fanout\":\"%s\",\"mean_fanout\":%.3f,"
+                 "\"rate\":%.1f,\"message_size\":%zu,\"warmup_s\":%.1f,\"duration_s\":%.1f,\"setup_s\":%.3f,",
+                 numUsers, numThreads, sessions.size(), fanoutSpec.c_str(), meanFanout,
+                 rate, messageSize, warmup, duration, setupSeconds);
+    appendFormat(out, "\"sent\":%lu,\"expected\":%lu,\"delivered\":%lu,\"lost\":%lu,\"unsent\":%lu,"
+                 "\"disconnected\":%lu,\"send_rate\":%.1f,\"delivery_rate\":%.1f,"
+                 "\"bytes_in\":%lu,\"bytes_out\":%lu,",
+                 sent, expected, delivered, lost, unsent, disconnected,
+                 sent / duration, delivered / duration, bytesIn, bytesOut);
+    appendFormat(out, "\"latency_ns\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,"
+                 "\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+                 latency.total, mean, percentile(&latency, 0.5), percentile(&latency, 0.9),
+                 percentile(&latency, 0.99), percentile(&latency, 0.999), latency.max);
+    
+    FILE *f = jsonPath == "-" ? stdout : fopen(jsonPath.c_str(), "w");
+    if(f == NULL)
+    {
+        perror(jsonPath.c_str());
+        return;
+    }
+    fputs(out.c_str(), f);
+    if(f != stdout) fclose(f);
+}
+
+
+int main(int argc, char** argv)
+{
+    string userList, jsonPath;
+    int opt;
+    
+    while((opt = getopt(argc, argv, "n:t:r:f:s:w:d:x:j:g:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                numUsers = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'f':
+                fanoutSpec = optarg;
+                break;
+            case 's':
+                messageSize = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                warmup = atof(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'x':
+                userPrefix = optarg;
+                break;
+            case 'j':
+                jsonPath = optarg;
+                break;
+            case 'g':
+                userList = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: loadgen <server IP> <server port> [-n users] [-t threads] "
+                                "[-r messages_per_second] [-f fanout|min-max|zipf:min-max] "
+                                "[-s message_size] [-w warmup_seconds] [-d duration_seconds] "
+                                "[-x user_prefix] [-j json_file]\n"
+                                "       loadgen -n users [-x user_prefix] -g user_list\n");
+                exit(1);
+        }
+    }
+    
+    if(!userList.empty()) return writeUserList(userList);
+    
+    if(optind + 2 != argc)
+    {
+        fprintf(stderr, "Choose the server's IP and port!\n");
+        return 1;
+    }
+    serverIP = argv[optind];
+    serverPort = argv[optind + 1];
+    
+    if(numUsers == 0 || numThreads < 1 || rate <= 0 || duration <= 0 || warmup < 0)
+    {
+        fprintf(stderr, "Choose at least one user and thread, and a positive rate and duration!\n");
+        return 1;
+    }
+    
+    users.resize(numUsers);
+    for(size_t i = 0; i < numUsers; i++)
+    {
+        users[i].fd = -1;
+        users[i].name = userPrefix + to_string(i);
+        users[i].writeWaiting = users[i].dirty = false;
+    }
+    if(!createSessions())
+    {
+        fprintf(stderr, "Choose the fan-out as <n>, <min>-<max> or zipf:<min>-<max>!\n");
+        return 1;
+    }
+    
+    // Every user needs a socket
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if(limit.rlim_cur < numUsers + 64)
+    {
+        fprintf(stderr, "Only %lu files can be open, raise the limit with ulimit -n!\n",
+                (unsigned long) limit.rlim_cur);
+        return 1;
+    }
+    
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rv = getaddrinfo(serverIP.c_str(), serverPort.c_str(), &hints, &serverAddress);
+    if(rv != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return 1;
+    }
+    
+    /***************************** SET UP SESSIONS ****************************/
+    
+    uint64_t setupStart = monotonicNanos();
+    int epfd = epoll_create1(0);
+    vector<size_t> creators, joiners;
+    for(auto const & s : sessions)
+    {
+        creators.push_back(s.members[0]);
+        joiners.insert(joiners.end(), s.members.begin() + 1, s.members.end());
+    }
+    
+    if(!loginUsers(epfd) || !requestAll(epfd, creators, NEW_SESS, NS_ACK) ||
+       !requestAll(epfd, joiners, JOIN, JN_ACK))
+    {
+        return 2;
+    }
+    close(epfd);
+    double setupSeconds = (monotonicNanos() - setupStart) / 1e9;
+    
+    /******************************* SEND MESSAGES ****************************/
+    
+    vector<struct worker*> workers;
+    for(int i = 0; i < numThreads; i++)
+    {
+        struct worker *w = new struct worker();
+        w->id = i;
+        w->epfd = epoll_create1(0);
+        w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timerfd, &ev);
+        workers.push_back(w);
+    }
+    
+    // Members of a session are spread over the workers, so most deliveries
+    // cross threads like they would cross machines
+    for(size_t i = 0; i < numUsers; i++)
+    {
+        struct worker *w = workers[i % numThreads];
+        w->users.push_back(&users[i]);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &users[i];
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, users[i].fd, &ev);
+    }
+    
+    sendStart = monotonicNanos() + 10000000; // Lets every worker start before the first message is due
+    measureStart = sendStart + (uint64_t) (warmup * 1e9);
+    measureEnd = measureStart + (uint64_t) (duration * 1e9);
+    
+    vector<thread> threads;
+    for(auto const & w : workers) threads.push_back(thread(runWorker, w));
+    for(auto & t : threads) t.join();
+    
+    report(workers, setupSeconds, jsonPath);
+    return 0;
+}
@@ -35,7 +35,13 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 
 # Object Files
 OBJECTFILES= \
-	${OBJECTDIR}/client.o
+	${OBJECTDIR}/client.o \
+	${OBJECTDIR}/protocol.o
+
+# Object Files of the load generator
+LOADGEN_OBJECTFILES= \
+	${OBJECTDIR}/loadgen.o \
+	${OBJECTDIR}/protocol.o
 
 
 # C Compiler Flags
@@ -53,10 +59,12 @@ ASFLAGS=
 
 # Link Libraries and Options
 LDLIBSOPTIONS=
+LOADGEN_LDLIBSOPTIONS=-lpthread
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
 	"${MAKE}"  -f nbproject/Makefile-${CND_CONF}.mk ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/client
+	"${MAKE}"  -f nbproject/Makefile-${CND_CONF}.mk ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/loadgen
 
 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/client: ${OBJECTFILES}
 	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
@@ -67,6 +75,20 @@ ${OBJECTDIR}/client.o: client.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -O2 -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/client.o client.cpp
 
+${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/loadgen: ${LOADGEN_OBJECTFILES}
+	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
+	${LINK.cc} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/loadgen ${LOADGEN_OBJECTFILES} ${LOADGEN_LDLIBSOPTIONS}
+
+${OBJECTDIR}/loadgen.o: loadgen.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/loadgen.o loadgen.cpp
+
+${OBJECTDIR}/protocol.o: protocol.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/protocol.o protocol.cpp
+
 # Subprojects
 .build-subprojects:
 
@@ -74,6 +96,7 @@ ${OBJECTDIR}/client.o: client.cpp
 .clean-conf: ${CLEAN_SUBPROJECTS}
 	${RM} -r ${CND_BUILDDIR}/${CND_CONF}
 	${RM} ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/client
+	${RM} ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/loadgen
 
 # Subprojects
 .clean-subprojects:
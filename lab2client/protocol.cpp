@@ -0,0 +1,210 @@
+/*
+ * File:   protocol.cpp
+ *
+ * Encodes packets into frames for the server and decodes the frames it sends
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+using namespace std;
+
+
+// Create a packet string from a message structure
+string stringifyMessage(const struct message* data)
+{
+    string dataStr = to_string(data->type) + " " + to_string(data->size)
+                     + " " + data->source + " " + data->data;
+    return dataStr;
+}
+
+
+// Reads an unsigned decimal number followed by a space from a text packet
+// Returns false if there is none
+static bool readTextField(const char *&p, const char *end, unsigned int& value)
+{
+    const char *start = p;
+    value = 0;
+    while(p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    
+    if(p == start || p == end || *p != ' ') return false;
+    p++;
+    return true;
+}
+
+
+// Creates a message structure from a text packet "<type> <size> <source> <data>"
+// Returns false if the packet is malformed
+bool messageFromPacket(const char *buffer, size_t len, struct message& packet)
+{
+    const char *p = buffer, *end = buffer + len;
+    if(!readTextField(p, end, packet.type) || !readTextField(p, end, packet.size)) return false;
+    
+    const char *space = (const char*) memchr(p, ' ', end - p);
+    if(space == NULL)
+    {
+        packet.source.assign(p, end - p);
+        packet.data.clear();
+        return true;
+    }
+    packet.source.assign(p, space - p);
+    packet.data.assign(space + 1, end - space - 1);
+    return true;
+}
+
+
+// Appends a binary frame with the given part of a message's data
+static void appendBinaryFrame(string& frame, unsigned int type, unsigned int flags,
+                              const char *data, size_t len)
+{
+    char header[BINHEADERSIZE];
+    uint32_t length = htonl(len), source = 0;
+    uint16_t fields[] = {htons(type), htons(flags)};
+    memcpy(header, &length, 4);
+    memcpy(header + 4, fields, 4);
+    memcpy(header + 8, &source, 4);
+    
+    frame.append(header, BINHEADERSIZE);
+    frame.append(data, len);
+}
+
+
+// Appends the frames of a message to the server to frame, in the following format:
+//   frame = <4 byte big-endian length of message><message>
+//   message = "<type> <data_size> <source> <data>"
+// or, once binary frames were negotiated at login:
+//   frame = <4 byte data length><2 byte type><2 byte flags><4 byte source ID><data>
+// with every field big-endian and the source ID 0, the server knows who we are
+// Binary messages too long for one frame are split into fragments of
+// FRAGMENTSIZE bytes, which all have FLAG_MORE set but the last, and
+// FLAG_CONTINUED but the first
+// Returns false if the message is too long to be sent
+bool encodeMessage(const struct protocolState& state, const struct message *data,
+                   string& frame)
+{
+    string dataStr = stringifyMessage(data);
+    
+    // Binary frames are bounded like text ones, so they can be relayed to any client
+    bool fragmented = dataStr.length() + 1 > MAXDATASIZE;
+    if(fragmented && (!state.binaryFraming || data->data.length() > MAXMESSAGESIZE)) return false;
+    
+    if(state.binaryFraming && fragmented)
+    {
+        const string& d = data->data;
+        for(size_t offset = 0; offset < d.length(); offset += FRAGMENTSIZE)
+        {
+            size_t len = min((size_t) FRAGMENTSIZE, d.length() - offset);
+            unsigned int flags = (offset > 0 ? FLAG_CONTINUED : 0) |
+                                 (offset + len < d.length() ? FLAG_MORE : 0);
+            appendBinaryFrame(frame, data->type, flags, d.data() + offset, len);
+        }
+    }
+    else if(state.binaryFraming)
+    {
+        appendBinaryFrame(frame, data->type, 0, data->data.data(), data->data.length());
+    }
+    else
+    {
+        uint32_t length = htonl(dataStr.length());
+        frame.append((const char*) &length, FRAMEHEADERSIZE);
+        frame += dataStr;
+    }
+    return true;
+}
+
+
+// Takes the next complete packet out of the bytes received from the server
+// Source definitions of binary frames are recorded rather than returned, and
+// fragments are put together into the message they belong to
+// Returns false if no complete packet has been received yet
+bool nextPacket(struct protocolState& state, struct message& packet)
+{
+    string& inBuf = state.inBuf;
+    while(1)
+    {
+        // Packets taken out are erased all at once, when no whole one is left
+        size_t headerSize = state.binaryFraming ? BINHEADERSIZE : FRAMEHEADERSIZE;
+        size_t available = inBuf.length() - state.inHead;
+        const char *head = inBuf.data() + state.inHead;
+        
+        // Both headers start with the length of what follows them
+        uint32_t length = 0;
+        if(available >= headerSize)
+        {
+            memcpy(&length, head, 4);
+            length = ntohl(length);
+        }
+        if(available < headerSize || available - headerSize < length)
+        {
+            inBuf.erase(0, state.inHead);
+            state.inHead = 0;
+            return false;
+        }
+        state.inHead += headerSize + length;
+        
+        if(!state.binaryFraming)
+        {
+            if(messageFromPacket(head + FRAMEHEADERSIZE, length, packet)) return true;
+            continue;
+        }
+        
+        uint16_t type, flags;
+        uint32_t source;
+        memcpy(&type, head + 4, 2);
+        memcpy(&flags, head + 6, 2);
+        memcpy(&source, head + 8, 4);
+        source = ntohl(source);
+        
+        packet.type = ntohs(type);
+        packet.flags = ntohs(flags);
+        packet.data.assign(head + BINHEADERSIZE, length);
+        
+        if(packet.type == SOURCE_DEF)
+        {
+            state.sourceNames[source] = packet.data;
+            continue;
+        }
+        
+        // A message from a source replaces whatever it left unfinished. Its
+        // fragments are dropped if the start was missed or it grows too long.
+        if(packet.flags & FLAG_CONTINUED)
+        {
+            auto partial = state.partialMessages.find(source);
+            if(partial == state.partialMessages.end()) continue;
+            
+            partial->second += packet.data;
+            if(partial->second.length() > MAXMESSAGESIZE)
+            {
+                state.partialMessages.erase(partial);
+                continue;
+            }
+            if(packet.flags & FLAG_MORE) continue;
+            
+            packet.data.swap(partial->second);
+            state.partialMessages.erase(partial);
+        }
+        else if(packet.flags & FLAG_MORE)
+        {
+            state.partialMessages[source] = packet.data;
+            continue;
+        }
+        else state.partialMessages.erase(source);
+        
+        packet.size = packet.data.length() + 1;
+        packet.source = source == SERVER_SOURCE ? "SERVER" : state.sourceNames[source];
+        return true;
+    }
+}
+
+
+// Forgets what was received on a connection to the server once it is closed
+void resetConnection(struct protocolState& state)
+{
+    state.inBuf.clear();
+    state.inHead = 0;
+    state.binaryFraming = false;
+    state.sourceNames.clear();
+    state.partialMessages.clear();
+}
@@ -0,0 +1,84 @@
+/*
+ * File:   protocol.h
+ *
+ * Packets exchanged with the server and the frames carrying them, shared by
+ * the client and the load generator
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAXDATASIZE 1380 // max number of bytes we can get at once
+#define FRAMEHEADERSIZE 4 // Length prefix of a frame
+#define BINHEADERSIZE 12  // Header of a binary frame
+#define PROTOCOL_VERSION "2" // Version asked for at login, servers that know it switch to binary frames
+#define SERVER_SOURCE 1   // Source ID of packets generated by the server
+#define FLAG_MORE 1       // Binary frame flag: more fragments of the message follow
+#define FLAG_CONTINUED 2  // Binary frame flag: the frame continues the sender's previous fragment
+#define FRAGMENTSIZE 1024 // Data bytes per fragment of a message too long for one frame
+#define MAXMESSAGESIZE (4 << 20) // Longest message sent or reassembled from fragments
+
+
+// Defines control packet types
+enum msgType {
+    LOGIN,
+    LO_ACK,
+    LO_NAK,
+    EXIT,
+    JOIN,
+    JN_ACK,
+    JN_NAK,
+    LEAVE_SESS,
+    LS_ACK,
+    LS_NAK,
+    NEW_SESS,
+    NS_ACK,
+    NS_NAK,
+    MESSAGE,
+    QUERY,
+    QU_ACK,
+    DIRMESSAGE,
+    DMESS_ACK,
+    DMESS_NAK,
+    SOURCE_DEF, // Binary frames only, binds the source ID of the frame to the name in its data
+    FILE_OFFER, // "<target> <size> <name>" to the server, "<port> <token> <size> <name>" from it
+    FILE_ACK,   // "<port> <token>", where to connect to send the file
+    FILE_NAK,
+    STATS       // Empty to the server, its counters as text from it
+};
+
+
+// Message structure to be serialized when sending messages
+// Note: when message is stringified, the delimiter between fields is " "
+struct message {
+    unsigned int type;
+    unsigned int size;
+    std::string source;
+    unsigned int flags = 0; // Fragment flags of a binary frame
+    std::string data;
+};
+
+
+// What was received and negotiated on one connection to the server
+struct protocolState {
+    std::string inBuf;          // Bytes received and not taken out as packets yet
+    size_t inHead = 0;          // Start of the first packet not taken out of inBuf
+    bool binaryFraming = false; // Frames in both directions use the binary header, negotiated at login
+    std::unordered_map<uint32_t, std::string> sourceNames; // Names behind the source IDs the server defined
+    std::unordered_map<uint32_t, std::string> partialMessages; // Fragments received so far, by source ID
+};
+
+
+std::string stringifyMessage(const struct message* data);
+bool messageFromPacket(const char *buffer, size_t len, struct message& packet);
+bool encodeMessage(const struct protocolState& state, const struct message *data,
+                   std::string& frame);
+bool nextPacket(struct protocolState& state, struct message& packet);
+void resetConnection(struct protocolState& state);
+
+#endif /* PROTOCOL_H */
@@ -21,14 +21,110 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <pthread.h>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <limits.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/un.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <time.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #define SESSION_NOT_FOUND "No session found!"
 #define ACK_DATA "NoData"
 
-#define BACKLOG 10       // How many pending connections queue will hold
+#define BACKLOG SOMAXCONN // How many pending connections queue will hold
 #define MAXDATASIZE 1380 // Max number of bytes we can get at once 
+#define MAXEVENTS 256    // Max number of events returned by one epoll_wait()
+#define READBUFSIZE 65536 // Bytes read from a socket at once, may hold many frames
+#define READS_PER_EVENT 4  // Reads from one socket before the other events get a turn
+#define FRAMEHEADERSIZE 4 // Length prefix of a frame
+#define BINHEADERSIZE 12  // Header of a binary frame
+#define PROTOCOL_VERSION "2" // Version a client asks for at LOGIN to switch to binary frames
+#define SERVER_SOURCE 1   // Source ID of packets generated by the server, known to every client
+#define FLAG_MORE 1       // Binary frame flag: more fragments of the message follow
+#define FLAG_CONTINUED 2  // Binary frame flag: the frame continues the sender's previous fragment
+#define MAX_MESSAGE_SIZE (4 << 20) // Default bytes a message split into fragments may have
+#define TRANSFER_CHUNK 65536   // Bytes of a file relayed at once, the capacity of a pipe
+#define TRANSFER_TIMEOUT 10    // Seconds everyone in a file transfer has to connect
+#define TRANSFER_NICE 10       // Scheduling priority of the transfer thread below the workers
+#define LOG_SEGMENT_SIZE (1 << 20) // Bytes of a session log segment file
+#define LOG_SEGMENTS_KEPT 4        // Segments of a session log kept on disk
+#define LOG_RECORD_HEADER 12       // Header of a record in a session log
+#define LOG_COMMIT_INTERVAL 10     // Milliseconds the appends of a group commit have to pile up
+#define LOG_PASSWORD_MAGIC "CHP1"  // First bytes of the password file of a session log
+#define REPLAY_COUNT 20            // Default number of logged messages replayed to a joining client
+#define INBOX_RECORD_HEADER 7      // Header of a record in an inbox
+#define JOURNAL_RECORD_HEADER 8    // Header of a record in the journal of the session tables
+#define SNAPSHOT_MAGIC "CHS1"      // First bytes of a snapshot of the session tables
+#define SNAPSHOT_INTERVAL 100000   // Journal records between snapshots
+#define RESTORE_GRACE 60           // Seconds the members of restored sessions have to log back in
+#define BENCH_MEMBERS 4            // Members of every session of the restart benchmark
+#define CREDENTIAL_MAGIC "CHC1"    // First bytes of a credential file
+#define CREDENTIAL_HEADER 16       // Magic, iterations, slots and users of a credential file
+#define CREDENTIAL_ITERATIONS 10000 // PBKDF2 rounds of the password hashes written with -g
+#define CREDENTIAL_SALT_SIZE 16
+#define CREDENTIAL_HASH_SIZE 32
+#define PASSWORD_HASH_SIZE (4 + CREDENTIAL_SALT_SIZE + CREDENTIAL_HASH_SIZE) // Encoded session password hash
+#define MAX_USERNAME 31            // Longest username a credential file holds
+#define HASH_THREADS 2             // Default number of threads checking passwords
+#define HASH_NICE 10               // Scheduling priority of the hashing threads below the workers
+#define HASH_QUEUE_MAX 1024        // Password checks waiting before further logins are refused
+#define VERIFIED_TTL 300           // Seconds a checked password lets its user log in without hashing it
+#define VERIFIED_CACHE_MAX 65536   // Users whose checked passwords are remembered
+#define EVENT_RECORD_SIZE 128      // Bytes of a record in a thread's event log ring
+#define EVENT_RING_SLOTS 4096      // Records a thread's event log ring holds, a power of two
+#define EVENT_RATE_LIMIT 1000      // Records of one kind a thread logs per second
+#define EVENT_BATCH_INTERVAL 1     // Milliseconds the events that woke the writer have to pile up
+#define EVENT_IDLE_WAIT 100        // Milliseconds the event log writer sleeps when nothing wakes it
+#define EVENT_BUFFER_SIZE 65536    // Bytes of formatted events the writer collects per write()
+#define HIST_SUB_BITS 4            // Log2 of the buckets per power of two of a histogram
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS) // Buckets per power of two, 6% apart
+#define HIST_BUCKETS 608           // Buckets of a histogram, enough for values up to 2^40
+#define ADMIN_TIMEOUT 1            // Seconds an admin socket client has to send its command
+#define TRACE_MAGIC "CHT1"         // First bytes of a trace file
+#define TRACE_RING_EVENTS (1 << 18) // Stages a thread's trace ring holds, a power of two
+#define TRACE_FLUSH_INTERVAL 50    // Milliseconds between writes to the trace file
+#define TRACE_NAME_SIZE 16         // Bytes of a thread name in the trace file
+#define LOGIN_TIMEOUT 5  // Default number of seconds a new connection has to log in
+#define HIGH_WATERMARK (1 << 20) // Default bytes queued for a client before it counts as slow
+#define LOW_WATERMARK (1 << 18)  // Default bytes queued for a client once it caught up again
+#define CONN_SLAB_SIZE 64 // Connection contexts allocated at once
+#define ARENA_BLOCK_SIZE 65536 // Size of the blocks of a loop iteration's scratch memory
+#define FRAME_POOL_MAX 4096    // Free frames a worker keeps per size class
+#define MAIL_POOL_MAX 256      // Free mailbox items a worker keeps
+
+#define URING_ENTRIES 256    // Submission queue size of the io_uring backend
+#define URING_NUM_BUFS 1024  // Number of provided receive buffers shared by all sockets
+#define URING_BUF_SIZE 4096  // Size of each provided receive buffer
+#define URING_BUF_GROUP 0    // Buffer group ID of the provided receive buffers
 
 using namespace std;
 
@@ -52,704 +148,7400 @@ enum msgType {
     QU_ACK,
     DIRMESSAGE,
     DMESS_ACK,
-    DMESS_NAK
+    DMESS_NAK,
+    SOURCE_DEF, // Binary framing only, binds the source ID of the frame to the name in its data
+    FILE_OFFER, // "<target> <size> <name>" from the sender, "<port> <token> <size> <name>" to recipients
+    FILE_ACK,   // "<port> <token>", where the sender connects to send the file
+    FILE_NAK,
+    STATS       // Empty from the client, the server's counters as text in the reply
 };
 
+#define NUM_MSG_TYPES (STATS + 1)
+
 
 // Message structure to be serialized when sending messages
 struct message {
     unsigned int type;
     unsigned int size;
     string source;
+    uint32_t sourceID = 0; // Interned ID of the source, looked up from its name if 0
+    unsigned int flags = 0; // Fragment flags of a binary frame
     string data;
 };
 
-// Keeps a list of all users that are permitted to login
-unordered_map<string, string> permittedClientList({
-    {"sadman", "ahmed"},
-    {"eliano", "anile"},
-    {"chris", "pua"},
-    {"username", "password"},
-    {"hamid", "timorabadi"},
-    {"john", "smith"}
-}); 
+struct shard;
+struct sessionLog;
 
-// Key is file descriptor, value is client username and password
-unordered_map<int, pair<string, string>> clientList;
+// Salted PBKDF2-HMAC-SHA256 hash of a session password, hashed as many rounds
+// as the credential file. Sessions, their logs, snapshots and the journal
+// only ever keep this, never the password.
+struct passwordHash {
+    uint32_t iterations;
+    unsigned char salt[CREDENTIAL_SALT_SIZE];
+    unsigned char hash[CREDENTIAL_HASH_SIZE];
+};
 
-// Key is session name, value is set of file descriptors describing clients
-// connected to the session
-unordered_map<string, unordered_set<int>> sessionList;
+// A chat session and the clients in it
+struct session {
+    uint32_t id;         // Interned ID of the session name
+    struct passwordHash password; // Set by the client that created the session
+    struct sessionLog *log; // History of the session, NULL if it isn't logged
+    vector<uint32_t> absent; // Users in it when the server went down, until they log back in
+    
+    // Sockets of the clients in the session, in no particular order. Changed
+    // with stateLock held for writing, or held for reading and the session's
+    // lock for writing, so a broadcast, which holds both for reading,
+    // iterates it in place. Clients that disconnect or are dropped during a
+    // broadcast stay in it until their removal is applied at the end of the
+    // loop iteration, and are skipped until then.
+    vector<int> members;
+    pthread_rwlock_t lock; // Lets joins and leaves of one session go on while others broadcast
+};
 
-// Key is session name, value is set to the be the password set by the client
-// making the session
-unordered_map<string, string> sessionPasswordList;
+// How packets are delimited on a connection, detected from its first byte
+//   FRAMING_LENGTH: <4 byte big-endian length><packet>
+//   FRAMING_LEGACY: <packet>\0, as sent by clients predating length prefixes
+//   FRAMING_BINARY: <12 byte header><data>, negotiated at LOGIN (version 2)
+// The first two carry the text packet "<type> <size> <source> <data>". The
+// binary header holds, big-endian, the data length (4 bytes), the packet
+// type (2), flags (2: FLAG_MORE and FLAG_CONTINUED mark the fragments of a
+// message too long for one frame) and the source ID (4). Clients send
+// source ID 0, the server knows who they are.
+enum framing {
+    FRAMING_UNKNOWN,
+    FRAMING_LENGTH,
+    FRAMING_LEGACY,
+    FRAMING_BINARY
+};
 
-// Get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa)
-{
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*) sa)->sin_addr);
-    }
+#define NUM_FRAMINGS 4
 
-    return &(((struct sockaddr_in6*) sa)->sin6_addr);
-}
 
+// Stages of a client's connection
+enum connState {
+    HANDSHAKE, // Accepted, waiting for the LOGIN packet
+    VERIFYING, // Sent its LOGIN, paused while the hashing threads check the password
+    ACTIVE,    // Logged in, packets go to the command dispatch
+    CLOSING    // Closed by the server once the bytes queued for it are sent
+};
 
-// Creates socket that listens for new connections and returns the file descriptor
-int createListenerSocket(const char* portNum)
-{
-    int listener;     // listening socket descriptor
-    int yes=1;        // for setsockopt() SO_REUSEADDR, below
-    int rv;
-    
-    struct addrinfo hints, *ai, *p;
-    
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+// What the server does with a client whose output queue passes the high watermark
+enum slowConsumerPolicy {
+    POLICY_DROP_OLDEST, // Discard its oldest queued frames down to the low watermark
+    POLICY_DISCONNECT,  // Close its connection
+    POLICY_PAUSE        // Stop reading from the clients sending to it until it catches up
+};
+
+// Refers to a connection from any worker thread. The ID tells whether the
+// socket still belongs to the same client.
+struct connectionRef {
+    int sockfd;
+    unsigned long id;
+    struct shard *owner; // NULL if there is no connection
+};
+
+// Open-addressing hash map from interned IDs to values, probed linearly.
+// Key 0 marks an empty slot. The slots are one flat array, so a lookup
+// touches a single cache line in the common case.
+template <typename V>
+struct idMap {
+    vector<pair<uint32_t, V>> slots; // Power of two in size
+    size_t count = 0;
     
-    if ((rv = getaddrinfo(NULL, portNum, &hints, &ai)) != 0)
+    size_t slotOf(uint32_t key) const
     {
-        fprintf(stderr, "server: %s\n", gai_strerror(rv));
-        exit(1);
+        return (key * 2654435761u) & (slots.size() - 1);
     }
     
-    for(p = ai; p != NULL; p = p->ai_next)
+    // Returns the slot holding a key, the size of the table if there is none
+    size_t findSlot(uint32_t key) const
     {
-        listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (listener < 0) continue;
+        if(slots.empty()) return 0;
         
-        // lose the pesky "address already in use" error message
-        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-
-        if (bind(listener, p->ai_addr, p->ai_addrlen) < 0)
+        for(size_t i = slotOf(key); slots[i].first != 0; i = (i + 1) & (slots.size() - 1))
         {
-            close(listener);
-            continue;
+            if(slots[i].first == key) return i;
         }
-
-        break;
-    }
-
-    // if we got here, it means we didn't get bound
-    if (p == NULL) {
-        fprintf(stderr, "server: failed to bind\n");
-        exit(2);
-    }
-
-    freeaddrinfo(ai); // all done with this
-
-    // listen
-    if (listen(listener, BACKLOG) == -1) {
-        perror("listen");
-        exit(3);
+        return slots.size();
     }
     
-    return listener;
-}
-
-
-// Create a packet string from a message structure
-string stringifyMessage(const struct message* data)
-{   
-    string dataStr = to_string(data->type) + " " + to_string(data->size) 
-                     + " " + data->source + " " + data->data;
-    return dataStr;
-}
-
-
-// Creates a message structure from a packet (string)
-struct message messageFromPacket(const char* buf)
-{
-    string buffer(buf);
-    stringstream ss(buffer);
-    struct message packet;
-    ss >> packet.type >> packet.size >> packet.source;
-    if(!getline(ss, packet.data)) packet.data = ACK_DATA;
-    return packet;
-}
-
-
-// Return the sessionID that the sockfd is connected to
-// Returns "NoSessionFound" if session could not be found
-string clientSockfdToSessionID (int sockfd)
-{
-    for (auto session = sessionList.begin(); session != sessionList.end(); session++)
+    // Returns the value of a key, NULL if it isn't in the map
+    V *find(uint32_t key)
     {
-        // Check if the given client is connected to this session
-        auto client = session->second.find(sockfd);
-        if(client != session->second.end()) return session->first;
+        size_t i = findSlot(key);
+        return i == slots.size() ? NULL : &slots[i].second;
     }
-
-    // Session could not be found 
-    return SESSION_NOT_FOUND;
-}
-
-
-// Sends a message to client in the following format:
-//   message = "<type> <data_size> <source> <data>"
-// Returns true if message is successfully sent
-bool sendToClient(struct message *data, int sockfd)
-{
-    int numBytes;
-    string dataStr = stringifyMessage(data);
-
-    if(dataStr.length() + 1 > MAXDATASIZE) return false;
-    if((numBytes = send(sockfd, dataStr.c_str(), dataStr.length() + 1, 0)) == -1)
+    
+    // Returns false if the key is in the map already
+    bool insert(uint32_t key, const V& value)
     {
-        perror("send");
-        return false;
+        if(find(key) != NULL) return false;
+        reserve(count + 1);
+        
+        size_t i = slotOf(key);
+        while(slots[i].first != 0) i = (i + 1) & (slots.size() - 1);
+        slots[i] = make_pair(key, value);
+        count++;
+        return true;
     }
-    return true;
-}
-
-
-// Send an acknowledge to a client if their login is successful
-void acknowledgeLogin(int sockfd)
-{
-    struct message loginAck;
-    loginAck.type = LO_ACK;
-    loginAck.size = 0;
-    loginAck.source = "SERVER";
-    loginAck.data = "";
     
-    sendToClient(&loginAck, sockfd);
-}
-
-// Checks if the user can login to the server
-// If not, string returned is reason for error
-pair<bool, string> canUserConnect(string userID, string password)
-{
-    // Checks if the user is on the list of permitted clients
-    if(permittedClientList.find(userID) != permittedClientList.end())
+    // Makes room for a number of keys, keeping the load under 3/4 so probe
+    // sequences stay short. Keys inserted in the order of their slots, as
+    // from another table, pile up into one run unless the room is made first.
+    void reserve(size_t keys)
     {
-        // Checks if the user is already logged in 
-        for (auto client = clientList.begin(); client != clientList.end(); client++)
+        size_t size = max((size_t) 16, slots.size());
+        while(keys * 4 > size * 3) size *= 2;
+        if(size == slots.size()) return;
+        
+        vector<pair<uint32_t, V>> old(size);
+        old.swap(slots);
+        count = 0;
+        for(auto const & slot : old)
         {
-            if(client->second.first == userID)
-            {
-                return make_pair(false, "User is already logged in!");
-            }
+            if(slot.first != 0) insert(slot.first, slot.second);
         }
+    }
+    
+    // Removes a key, moving back the entries that probed past its slot
+    void erase(uint32_t key)
+    {
+        size_t hole = findSlot(key);
+        if(hole == slots.size()) return;
         
-        // Check if password is correct
-        if(password != permittedClientList.find(userID)->second)
+        size_t mask = slots.size() - 1;
+        for(size_t i = (hole + 1) & mask; slots[i].first != 0; i = (i + 1) & mask)
         {
-            return make_pair(false, "Password is incorrect!");
+            // Entries whose home slot lies cyclically in (hole, i] stay put
+            size_t home = slotOf(slots[i].first);
+            if(((i - home) & mask) < ((i - hole) & mask)) continue;
+            
+            slots[hole] = slots[i];
+            hole = i;
         }
-        return make_pair(true, ACK_DATA); 
+        slots[hole].first = 0;
+        count--;
     }
-    return make_pair(false, "Username does not exist!");
-}
+};
+
+// Encoded packet, shared by every output queue and mailbox item holding it
+// so a broadcast is encoded once however many clients it goes to. Immutable
+// once encoded and freed when the last holder releases it.
+struct frame {
+    atomic<int> refs;
+    size_t len;
+    struct shard *home; // Worker whose pool the frame goes back to, if any
+    int sizeClass;      // Pool the allocation goes back to, NUM_FRAME_CLASSES if none
+    struct frame *next; // Next frame handed back to the home worker
+    struct logSegment *segment; // Log segment the data points into, if any
+    bool attached;      // Continues the frame ahead of it, dropped along with it
+    char *data;         // Follows the structure in the same allocation, unless in a log segment
+};
 
+// Allocation sizes of the pooled frames, large enough for any packet
+const size_t frameClasses[] = {128, 512, 2048};
+#define NUM_FRAME_CLASSES 3
 
-// Logs a client described by a file descriptor into the server
-// Returns true if successful
-// TODO Check if the client is double logging in
-bool loginClient(int sockfd)
-{
-    char buffer[MAXDATASIZE];
-    int numBytes;
-    struct message loginInfo;
-    struct message ack;
-    ack.size = 0;
-    ack.source = "SERVER";
-    ack.data = ACK_DATA;
+// Bump allocator for scratch memory that only lives during one loop
+// iteration. Everything is released at once when the iteration ends, and the
+// blocks are kept for the next one.
+struct arena {
+    vector<char*> blocks; // ARENA_BLOCK_SIZE bytes each
+    size_t block = 0;     // Block being filled
+    size_t used = 0;      // Bytes used in it
+    vector<char*> large;  // Allocations too big for a block, freed at the end
+};
+
+// Per-connection context, registered with epoll as the event's data pointer.
+// Indexed by socket in connTable and carved out of per-worker slabs, so the
+// client's state, buffers and counters sit in one record.
+struct connection {
+    int sockfd;
+    unsigned long id;     // Unique for the lifetime of the server, detects reused sockets
+    struct shard *owner;  // Worker thread that reads from and writes to the socket
+    enum connState state;
+    bool closed;          // Socket closed, context is freed once nothing refers to it
+    bool dropPending;     // Dropped by the server, removed at the end of the loop iteration
+    enum framing format;  // Framing used in both directions
+    vector<bool> knownSources; // Source IDs whose name a binary client was told
     
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
-    else
-    {
-        string s(buffer);
-        stringstream ss(s);
-        ss >> loginInfo.type >> loginInfo.size
-           >> loginInfo.source >> loginInfo.data;
-    }
+    // Message the client is sending in fragments, see acceptFragment()
+    bool fragmenting;               // The last fragment had FLAG_MORE set
+    unsigned int fragType;          // Type of the fragments
+    size_t fragBytes;               // Data bytes received so far
+    struct connectionRef fragTarget; // Recipient of a direct message, owner NULL if none
+    struct inbox *fragInbox;         // Inbox a direct message goes to, NULL if none
     
-    // Check if user is permitted to connect to the server
-    pair<bool, string> userConnectReq = canUserConnect(loginInfo.source, loginInfo.data);
-    if (userConnectReq.first == false)
-    {
-        // Send back reason for error
-        ack.type = LO_NAK;
-        ack.data = userConnectReq.second;
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;
-    }
+    // Changed with stateLock held for writing
+    uint32_t userID;          // Source ID of the username, 0 until logged in
+    struct session *session;  // Session the client is in, NULL if none
+    size_t memberIndex;       // Position among the session's members
     
-    else
-    {
-        // Client can login, add it to the list of active clients
-        clientList.insert(make_pair(sockfd, make_pair(loginInfo.source, loginInfo.data)));
-        
-        // No data sent back
-        ack.type = LO_ACK;
-        
-        sendToClient(&ack, sockfd);
-        return true;
-    }
-}
+    unsigned long packetsIn;  // Packets received from the client
+    unsigned long bytesIn;    // Bytes received from the client
+    unsigned long framesOut;  // Frames fully sent to the client
+    unsigned long bytesOut;   // Bytes sent to the client
+    string inBuf;         // Received bytes that weren't processed yet
+    
+    deque<struct frame*> outQueue; // Frames waiting for the socket to become writable
+    size_t outHead;         // Bytes of the first queued frame already sent
+    size_t outBytes;        // Bytes queued in total
+    bool flushPending;      // Queued for the flush at the end of the loop iteration
+    bool outBlocked;        // The socket stopped taking bytes during the last flush
+    
+    int pauseCount;         // Number of clients whose full queues stop reads from this one
+    struct connectionRef lastSender; // Client the most recently queued frame came from
+    vector<struct connectionRef> pausedSenders; // Clients paused because of this one's queue
+#ifdef USE_IO_URING
+    bool recvArmed;     // A receive for this connection is in the ring
+    bool sendInFlight;  // A send for this connection has been submitted to the ring
+    size_t sendFrames;  // Number of queued frames the in-flight send covers
+    size_t sendBytes;   // Number of bytes the in-flight send covers
+    struct msghdr sendMsg;          // Gathers the queued frames of the in-flight send
+    vector<struct iovec> sendIov;
+    unsigned long sendIteration; // Loop iteration the in-flight send was queued in
+#endif
+};
 
-// Checks if the password corresponds with the session being attempted to join
-bool checkSessionPassword (string sessionID, string sessionPassword)
-{
-    auto currentSession = sessionPasswordList.find(sessionID);
+// Kinds of items passed between worker threads
+enum mailKind {
+    MAIL_DELIVER, // Send a frame to the recipients
+    MAIL_PAUSE,   // Stop reading from the recipient
+    MAIL_RESUME   // Undo an earlier MAIL_PAUSE
+};
 
-    if (currentSession -> second == sessionPassword) return true;
-    else return false; 
+// Packet forwarded to clients owned by another worker thread
+struct mailItem {
+    atomic<struct mailItem*> next;
+    struct shard *home;                          // Worker that allocated the item
+    enum mailKind kind;
+    struct frame *data;                          // Frame to deliver
+    uint32_t sourceID;                           // Source of the frame, for binary recipients
+    struct connectionRef sender;                 // Client the frame came from, if any
+    vector<pair<int, unsigned long>> recipients; // Socket and connection ID of each recipient
+};
 
-}
+// Connection that has to send its LOGIN packet before the deadline
+struct pendingLogin {
+    int sockfd;
+    unsigned long id;
+    unsigned long deadline; // Monotonic clock, in milliseconds
+};
 
-// Adds client to the specified session
-// If the session exists and they aren't already in a session, it sends back the
-// session they were added to
-// Otherwise, it sends back the reason they couldn't be added to the specified session
-// Returns true if successful
-bool joinSession (int sockfd, string sessionData)
-{
-    struct message ack;
-    ack.source = "SERVER";
+// Distribution of values recorded by one thread, in buckets that widen with
+// the values as in HDR histograms: values below HIST_SUB_BUCKETS get one each,
+// and every power of two above is split in HIST_SUB_BUCKETS. Only the owner
+// writes it, but anyone asking for the statistics reads it meanwhile.
+struct histogram {
+    atomic<unsigned long> counts[HIST_BUCKETS];
+    atomic<unsigned long> total;
+    atomic<unsigned long> sum;
+    atomic<unsigned long> max;
+};
 
-    string sessionID, sessionPassword;  
-    stringstream ss(sessionData);
-    ss >> sessionID >> sessionPassword;
+// Counters of a worker thread
+struct metrics {
+    atomic<unsigned long> packetsIn;
+    atomic<unsigned long> bytesIn;
+    atomic<unsigned long> framesOut;
+    atomic<unsigned long> bytesOut;
+    atomic<unsigned long> connections;        // Open connections owned by the worker
+    struct histogram latency[NUM_MSG_TYPES]; // Nanoseconds taken to handle a packet, by type
+    struct histogram fanout;                 // Recipients of each session message
+    struct histogram queueDepth;             // Bytes queued for a client when it is flushed
+};
+
+// A worker thread running its own event loop over a shard of the connections.
+// Other workers hand it packets through a lock-free multi-producer mailbox
+// and wake it up through an eventfd.
+struct shard {
+    int id;
+    int listener;                       // SO_REUSEPORT listener of this worker
+    int wakefd;                         // eventfd signalled when mail arrives
+    atomic<bool> wakePending;           // Set while a wakeup is on its way
+    atomic<struct mailItem*> mailHead;  // Most recently posted item
+    struct mailItem *mailTail;          // Oldest item, only touched by the owner
+    struct mailItem mailStub;
     
-    // Find list of clients connected to the given session name
-    auto session = sessionList.find(sessionID);
+    // All logins share one timeout, so pending logins are queued in deadline
+    // order and a single timerfd fires for the oldest one
+    int timerfd;
+    deque<struct pendingLogin> pendingLogins;
     
-    // Find session the client is connected to (if any)
-    string currentSessionID = clientSockfdToSessionID(sockfd);
+    // Connections closed during the current loop iteration
+    vector<struct connection*> closedConns;
     
-    // Checking that session exists and client is not already in a session
-    if (sessionID != ACK_DATA &&
-        currentSessionID == SESSION_NOT_FOUND &&
-        session != sessionList.end() && 
-        checkSessionPassword(sessionID, sessionPassword))
-    {        
-        
-        // Add client to the session
-        session->second.insert(sockfd);
+    // Connections dropped by the server during the current loop iteration.
+    // Dropping takes the write lock, so it can't happen while a packet is
+    // being handled.
+    vector<struct connection*> droppedConns;
+    
+    // Socket and connection ID of the clients whose pause ended, or that
+    // used up their reads, during the current loop iteration. Reading from
+    // them continues in the next one.
+    vector<pair<int, unsigned long>> resumedConns;
+    
+    unsigned long loopIteration; // Number of io_uring loop iterations so far
+    
+    // Socket and connection ID of the clients that got frames during the
+    // current loop iteration, flushed together at its end
+    vector<pair<int, unsigned long>> dirtyConns;
+    
+    // Unused connection contexts of this worker, allocated CONN_SLAB_SIZE at
+    // a time and never given back to the system
+    vector<struct connection*> freeConns;
+    
+    // Scratch memory of the current loop iteration
+    struct arena scratch;
+    
+    // Freed frames by size class and freed mailbox items, kept for reuse.
+    // Other workers hand back the ones they free through a lock-free stack,
+    // which only the owner empties, taking all of it at once.
+    vector<struct frame*> framePool[NUM_FRAME_CLASSES];
+    vector<struct mailItem*> mailPool;
+    atomic<struct frame*> returnedFrames[NUM_FRAME_CLASSES];
+    atomic<struct mailItem*> returnedItems;
+    
+    // Packet being handled and the reply to it, reused so their buffers
+    // don't go back to the heap after every packet
+    struct message packet;
+    struct message reply;
+    
+    // Password checks the hashing threads are done with, handed back under
+    // jobLock and signalled through wakefd
+    pthread_mutex_t jobLock;
+    vector<struct passwordJob*> checkedJobs;
+    
+    // Counters reported by STATS and the admin socket
+    struct metrics *metrics;
+    
+    // Output counters, printed on SIGUSR1
+    atomic<bool> statsRequested;
+    unsigned long flushes;       // Flushes that had frames to write
+    unsigned long framesFlushed; // Frames fully written
+    unsigned long writeCalls;    // writev() calls or io_uring sends
+    unsigned long framesReused;  // Frames taken from the pool
+    unsigned long itemsReused;   // Mailbox items taken from the pool
+};
 
-        // Send response with the data as the sessionID
-        ack.type = JN_ACK;
-        ack.data = sessionID;
-        ack.size = ack.data.length() + 1;
+// Recipient of a file transfer and the pipe holding the chunk it is sent
+struct transferSink {
+    int sockfd;     // Data connection of the recipient, -1 once it is gone
+    int pipefd[2];
+    size_t pending; // Bytes of the current chunk still in the pipe
+};
 
-        sendToClient(&ack, sockfd);
-        return true;
-        
-    }
-    
-    // Session does not exist or client is already in a session
-    else 
-    {
-        ack.type = JN_NAK;
-        
-        if (sessionID == ACK_DATA) ack.data = "No session ID was provided!";
-        else if(currentSessionID != SESSION_NOT_FOUND) ack.data = "Already in a session!";
-        else if (session == sessionList.end()) ack.data = "Session not found!";
-        else if (checkSessionPassword(sessionID, sessionPassword) == false) ack.data = "Password is incorrect!";
+// File relayed from the sender's data connection to those of its recipients.
+// The bytes go from socket to pipe to socket with splice(), and tee() copies
+// them into every recipient's pipe, so they never reach user space. Created
+// by the worker the file is offered to and run by the transfer thread.
+struct transfer {
+    uint64_t sendToken;     // Sent by the sender's data connection to claim it
+    uint64_t recvToken;     // Sent by the data connections of the recipients
+    uint64_t size;          // Bytes of the file
+    uint64_t moved;         // Bytes taken from the sender so far
+    size_t expected;        // Recipients the file was offered to
+    unsigned long deadline; // Monotonic clock, in milliseconds, by which everyone has to connect
+    bool started;           // Everyone connected, or the deadline passed with enough of them
+    bool closed;            // Finished or aborted, freed at the end of the loop iteration
+    bool ready;             // Queued to be pumped in the next loop iteration
+    int sender;             // Data connection of the sender, -1 until it connects
+    int pipefd[2];          // Chunk taken from the sender, copied to every recipient
+    vector<struct transferSink> sinks;
+    string name;
+};
 
+// Data connection of a file transfer, waiting for its token until it has a transfer
+struct dataConnection {
+    struct transfer *t;
+    int sink;               // Index among the transfer's sinks, -1 for the sender
+    unsigned char token[8]; // Big-endian
+    size_t tokenBytes;      // Bytes of the token received so far
+    unsigned long deadline; // Monotonic clock, in milliseconds, to send the token by
+};
 
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;
-    }
-}
+// Segment of a session log, a file of LOG_SEGMENT_SIZE bytes mapped in
+// full. Records are only ever written past its tail, so the bytes before it
+// never change and replayed frames point straight into the mapping.
+struct logSegment {
+    atomic<int> refs;  // The log, the committer and every frame pointing into the segment
+    char *base;
+    size_t tail;       // Bytes of records written
+    size_t committed;  // Bytes of records handed to the committer
+    string path;
+};
 
+// Append-only log of the messages sent to a session, kept as numbered
+// segment files in a directory of its own. Outlives the session, so a session
+// created again under the same name and password carries on with its history.
+struct sessionLog {
+    pthread_mutex_t lock;          // Held to append, replay and commit
+    string directory;
+    struct passwordHash password;  // Of the session the log was created for
+    unsigned long nextSegment;     // Number of the segment after the newest one and the spare
+    deque<struct logSegment*> segments; // Oldest first
+    struct logSegment *spare;      // Next segment, mapped ahead by the committer, NULL if none
+    deque<pair<struct logSegment*, size_t>> recent; // Segment and offset where the last messages start
+    bool dirty;                    // Queued for the committer
+};
 
-// Removes client from their current session.
-// If they're in a session, it sends back the session they were removed from
-// Otherwise, it sends back the reason they couldn't leave the specified session
-// Returns true if successful
-bool leaveSession (int sockfd)
-{
-    struct message ack;
-    ack.source = "SERVER";
-\
-    string currentSessionID = clientSockfdToSessionID(sockfd);
-    
-    // Check if client is in a session
-    if (currentSessionID != SESSION_NOT_FOUND)
-    {
-        // Remove client from session
-        auto currentSession = sessionList.find(currentSessionID);
-        currentSession->second.erase(sockfd);
-        
-        // No more clients in the session
-        if(currentSession->second.empty()) 
-        {
-            sessionList.erase(currentSessionID);
-            sessionPasswordList.erase(currentSessionID);
-        }
-        
-        ack.type = LS_ACK;
-        ack.data = currentSessionID;
-        ack.size = ack.data.length() + 1;
+// Direct messages waiting for a user who isn't logged in, appended to a file
+// of its own and sent in one burst when the user logs in. Records are
+//   <data length:4> <flags:2> <source length:1> <source> <data>
+// with the numbers big-endian, and the committer empties the file once they
+// are sent.
+struct inbox {
+    pthread_mutex_t lock; // Held to append, deliver and commit
+    int fd;
+    size_t size;          // Bytes of whole records in the file
+    size_t delivered;     // Bytes of them at the front sent already
+    bool dirty;           // Queued for the committer
+};
 
-        sendToClient(&ack, sockfd);
-        return true;
-    }
-    else
-    {
-        ack.type = LS_NAK;
-        ack.data = "Not in a session!";
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;
-    }
-}
+// Changes of the session tables, as journaled
+enum journalOp {
+    JOURNAL_CREATE = 1, // Session created with the hash of its password
+    JOURNAL_JOIN,       // User entered the session
+    JOURNAL_LEAVE       // User left the session, which ends once it is empty
+};
 
+// Snapshot of the session tables on its way to the disk, and the journal it
+// makes obsolete
+struct snapshotJob {
+    string data;
+    unsigned long generation; // Of the first journal the snapshot doesn't cover
+    int journal;              // Journal before that one, closed once synced, -1 if none
+};
 
-// Create a new session in the session list and add the requesting client to it
-// If the session doesn't exist, it creates it and adds the client to it, and
-// sends back the sessionID
-// Otherwise, it sends back the reason why it couldn't be created
-// Returns true if successful
-bool createSession(int sockfd, string sessionData)
-{   
-    struct message ack;
-    ack.source = "SERVER";
-    
-    if(clientSockfdToSessionID(sockfd) != SESSION_NOT_FOUND)
-    {
-        ack.type = NS_NAK;
-        ack.data = "Already in a session!";
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;
+// SHA-256 in progress, for hashing passwords
+struct sha256 {
+    uint32_t h[8];
+    unsigned char block[64]; // Bytes not hashed yet
+    size_t used;             // Bytes in the block
+    uint64_t length;         // Bytes hashed in total
+};
+
+// User in a credential file. A credential file is
+//   "CHC1" <iterations:4> <slots:4> <users:4> { <slot> }
+// with the numbers big-endian. The slots are a hash table, probed linearly
+// from the FNV-1a hash of the username, with empty names in the free ones.
+struct credentialSlot {
+    char name[MAX_USERNAME + 1];                // NUL padded
+    unsigned char salt[CREDENTIAL_SALT_SIZE];
+    unsigned char hash[CREDENTIAL_HASH_SIZE];   // PBKDF2-HMAC-SHA256 of the password
+};
+
+// Credential file mapped into memory
+struct credentialStore {
+    char *base;
+    size_t length;
+    uint32_t iterations;
+    uint32_t slotCount; // Power of two
+    uint32_t userCount;
+    const struct credentialSlot *slots;
+};
+
+// What a password job checks
+enum passwordCheck {
+    CHECK_LOGIN,       // The password of a LOGIN, against the credential file
+    CHECK_NEW_SESSION, // The password of a NEW_SESS, hashed for the session, against its log if logged
+    CHECK_JOIN         // The password of a JOIN, against the session's hash
+};
+
+// Password check handed to the hashing threads, which fill in the outcome
+// and hand it back to the worker that owns the connection. The stored hash
+// is copied, since the credential file may be reloaded and the session
+// ended meanwhile. A new session gets its hash from the hashing thread.
+struct passwordJob {
+    enum passwordCheck check;
+    struct shard *home;
+    int sockfd;
+    unsigned long id;      // Of the connection, which may be gone by the time the check is done
+    enum framing format;   // Framing the LOGIN came in
+    string user;           // Or the session name of a NEW_SESS or JOIN
+    string password;
+    string version;
+    unsigned long generation; // Of the credentials the hash was copied from
+    struct passwordHash stored;
+    bool matches;
+    struct sessionLog *log; // Opened for a NEW_SESS, NULL if it can't be
+};
+
+// Password of a user that matched the stored hash lately, as a keyed digest
+// of both, so a hash replaced by a reload doesn't match any more
+struct verifiedLogin {
+    unsigned char digest[CREDENTIAL_HASH_SIZE];
+    unsigned long expiry; // Monotonic clock, in milliseconds
+};
+
+// Severity of an event logged by the server. Events above the current level
+// are ignored.
+enum eventLevel {
+    LEVEL_ERROR,
+    LEVEL_WARN,
+    LEVEL_INFO
+};
+
+// Event logged by a thread, still in binary: the format it is printed with
+// and the arguments it names, packed by logEvent(). Integers and doubles take
+// 8 bytes, strings a length byte and as much of them as fits.
+struct eventRecord {
+    const char *format;    // A string literal, so it outlives the record
+    uint64_t time;         // Nanoseconds since the epoch, to the clock tick
+    uint8_t level;
+    uint8_t size;          // Bytes of args used
+    char args[EVENT_RECORD_SIZE - 18];
+};
+
+// Records logged by one thread, waiting for the writer thread. The thread
+// only moves tail and the writer only head, so neither ever waits.
+struct eventRing {
+    atomic<uint32_t> head;
+    char pad[60];          // Keeps the writer's index off the logging thread's cache line
+    atomic<uint32_t> tail;
+    atomic<unsigned long> dropped;    // Records lost to a full ring
+    atomic<unsigned long> suppressed; // Events over the rate limit
+    struct eventRecord records[EVENT_RING_SLOTS];
+};
+
+// Stages of handling packets that tracing times
+enum traceStage {
+    TRACE_PARSE,    // Decoding a packet, argument is its length
+    TRACE_LOGIN,    // Checking a LOGIN, argument is the socket
+    TRACE_HANDLE,   // Handling a packet of a logged in client, argument is its type
+    TRACE_LOCK,     // Waiting for stateLock, argument is 1 for writing
+    TRACE_FANOUT,   // Relaying a session message, argument is the members of the session
+    TRACE_ENCODE,   // Encoding a frame, argument is its framing
+    TRACE_DELIVER,  // Queueing a frame for a client of the thread, argument is the socket
+    TRACE_FORWARD,  // Handing frames to another worker, argument is the worker
+    TRACE_LOG,      // Appending a message to a session log, argument is its length
+    TRACE_DIRECT,   // Sending a direct message, argument is 1 if it was sent
+    TRACE_FLUSH,    // Writing out a client's output queue, argument is the socket
+    TRACE_MAILBOX,  // Handling the mail of other workers
+    NUM_TRACE_STAGES
+};
+
+// Stage timed by a thread, in the ticks of traceClock()
+struct traceRecord {
+    uint64_t begin;
+    uint32_t duration;   // At most UINT32_MAX
+    uint32_t stageArg;   // Stage in the top byte, its argument in the others
+};
+
+// Stages timed by one thread, waiting for the trace writer thread, which
+// moves head while the thread moves tail
+struct traceRing {
+    atomic<uint32_t> head;
+    char pad[60];
+    atomic<uint32_t> tail;
+    atomic<unsigned long> dropped; // Records lost to a full ring
+    pid_t tid;
+    char name[TRACE_NAME_SIZE];
+    struct traceRecord records[TRACE_RING_EVENTS];
+};
+
+// Header of a thread's records in the trace file. The writer also writes
+// blocks without records, which only tie the clock ticks to nanoseconds.
+struct traceBlock {
+    uint32_t tid;
+    uint32_t count;
+    uint32_t dropped;
+    uint32_t reserved;
+    uint64_t ticks;      // traceClock() when the block was written
+    uint64_t nanos;      // Monotonic clock at the same time
+    char name[TRACE_NAME_SIZE];
+};
+
+// Names of the stages in the trace file
+const char *traceStageNames[NUM_TRACE_STAGES] = {
+    "parse", "login", "handle", "lock", "fanout", "encode", "deliver", "forward", "log append",
+    "direct message", "flush", "mailbox"
+};
+
+// Rate limit of one format in one thread
+struct eventRate {
+    const char *format;
+    uint64_t second;
+    uint32_t count;
+};
+
+// Keeps a list of all users that are permitted to login, unless a
+// credential file is given
+unordered_map<string, string> permittedClientList({
+    {"sadman", "ahmed"},
+    {"eliano", "anile"},
+    {"chris", "pua"},
+    {"username", "password"},
+    {"hamid", "timorabadi"},
+    {"john", "smith"}
+}); 
+
+// Key is interned session name, value is the session
+idMap<struct session*> sessionList;
+
+// Key is interned username of a logged in client, value is its file descriptor
+idMap<int> usernameList;
+
+// Key is interned session name, value is the log of the session. Logs stay
+// open for the lifetime of the server once opened.
+// Changed with stateLock held for writing
+idMap<struct sessionLog*> sessionLogs;
+
+// Key is username, value is the inbox of the user. Inboxes are opened the
+// first time a user is sent a direct message while away, or logs in with
+// messages waiting, and stay open after.
+// Changed with inboxLock held
+unordered_map<string, struct inbox*> inboxes;
+pthread_mutex_t inboxLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Credential file given with -u and the store mapped from it, NULL if the
+// permitted client list is used instead. Replaced on SIGHUP with stateLock
+// held for writing.
+string credentialPath;
+struct credentialStore *credentials = NULL;
+unsigned long credentialGeneration = 0; // Counts the reloads, so checks against older credentials are told apart
+atomic<bool> reloadRequested(false);
+
+// Password checks waiting for the hashing threads
+pthread_mutex_t hashLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hashCond = PTHREAD_COND_INITIALIZER;
+deque<struct passwordJob*> hashQueue;
+int hashThreads = HASH_THREADS;
+
+// Key is username, value is the password it logged in with lately. The
+// digests are keyed with random bytes, so they are worthless outside the
+// server.
+pthread_mutex_t verifiedLock = PTHREAD_MUTEX_INITIALIZER;
+unordered_map<string, struct verifiedLogin> verifiedLogins;
+unsigned char verifiedKey[CREDENTIAL_HASH_SIZE];
+
+// Key is interned username of an absent member of a restored session,
+// value is the interned name of that session
+// Changed with stateLock held for writing
+idMap<uint32_t> absentMembers;
+
+// Index is file descriptor, value is the context of the connected client
+// Sized to the descriptor limit at startup so it is never reallocated
+vector<struct connection*> connTable;
+
+// Usernames and session names are interned when they enter the server, so
+// the tables above compare 32-bit IDs instead of strings. IDs are kept for
+// the lifetime of the server and double as the source IDs of the binary
+// protocol. Index is the ID, value is the name and, once the name logged
+// in, the SOURCE_DEF frame telling a client about it.
+unordered_map<string, uint32_t> nameIDs({{"SERVER", SERVER_SOURCE}});
+vector<pair<string, struct frame*>> names({{"", NULL}, {"SERVER", NULL}});
+
+// Guards sessionList, usernameList, connTable with the client state in the
+// contexts, and the interned names, which all worker threads share. Packets
+// that only read them take it shared, and so do joins and leaves, which only
+// change the members of one session under its own lock.
+pthread_rwlock_t stateLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Worker threads, each owning a shard of the connections
+vector<struct shard*> shards;
+
+// Shard owned by the calling thread
+thread_local struct shard *currentShard = NULL;
+
+// Source of connection IDs
+atomic<unsigned long> nextConnectionID(1);
+
+// True when the calling thread's event loop runs on the io_uring backend
+thread_local bool uringActive = false;
+
+// Seconds a new connection has to log in before it is closed
+int loginTimeout = LOGIN_TIMEOUT;
+
+// Longest message a client may send in fragments
+size_t maxMessageSize = MAX_MESSAGE_SIZE;
+
+// Port data connections of file transfers connect to, 0 if transfers are off
+int transferPort = 0;
+
+// Transfers offered but not started yet, by both of their tokens. Workers add
+// them and the transfer thread takes them out.
+pthread_mutex_t transferLock = PTHREAD_MUTEX_INITIALIZER;
+unordered_map<uint64_t, struct transfer*> transferTokens;
+
+// Directory session logs are kept in, no session is logged if empty
+string logDirectory;
+
+// Held while a session log is looked up and loaded, so it is loaded once
+pthread_mutex_t logOpenLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of logged messages a client entering a session is sent
+size_t replayCount = REPLAY_COUNT;
+
+// Directory the inboxes of offline users are kept in, no inboxes if empty
+string inboxDirectory;
+
+// Directory of the snapshot and journals of the session tables, which
+// aren't kept if empty
+string stateDirectory;
+
+// Journal the changes of the session tables go to, its generation and the
+// records in it. Changed with stateLock held for writing, and the descriptor
+// only with commitLock held too. Joins and leaves append to it holding
+// stateLock shared, one at a time under journalLock.
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+int journalFd = -1;
+unsigned long journalGeneration = 0;
+unsigned long journalRecords = 0;
+
+// Monotonic clock, in milliseconds, until which absent members of restored
+// sessions are kept, 0 once they are gone
+// Changed with stateLock held for writing
+unsigned long restoreDeadline = 0;
+
+// Logs, inboxes, journal and snapshot the committer hasn't written out yet
+pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commitCond = PTHREAD_COND_INITIALIZER;
+vector<struct sessionLog*> dirtyLogs;
+vector<struct inbox*> dirtyInboxes;
+bool journalDirty = false;
+struct snapshotJob *pendingSnapshot = NULL;
+
+// Output queue limits and what happens to clients that exceed them
+size_t highWatermark = HIGH_WATERMARK;
+size_t lowWatermark = LOW_WATERMARK;
+enum slowConsumerPolicy slowPolicy = POLICY_DROP_OLDEST;
+
+// Client whose packet the calling thread is handling
+thread_local struct connectionRef currentSender = {-1, 0, NULL};
+
+// Monotonic clock, in milliseconds, when the server started
+unsigned long serverStart = 0;
+
+// Path of the admin socket, none if empty
+string adminPath;
+
+// Heap allocations made by the calling thread, every operator new as well
+// as the frames and arena blocks taken with malloc(), printed on SIGUSR1 to
+// check that handling packets doesn't go through the heap in steady state
+thread_local unsigned long heapAllocations = 0;
+
+// Most verbose level of events logged, set with -v and lowered by SIGUSR2
+int configuredLevel = LEVEL_INFO;
+atomic<int> logLevel(LEVEL_INFO);
+
+// Event log rings of the threads that logged something, which the writer
+// thread drains. A thread adds its ring the first time it logs.
+pthread_mutex_t eventRingLock = PTHREAD_MUTEX_INITIALIZER;
+vector<struct eventRing*> eventRings;
+
+// Wakes the writer thread when the rings get records, -1 until it runs.
+// Logging threads only write it when eventWakePending was clear.
+int eventWakefd = -1;
+atomic<bool> eventWakePending(false);
+
+// Ring and rate limits of the calling thread, indexed by format
+thread_local struct eventRing *threadEvents = NULL;
+thread_local struct eventRate eventRates[64];
+
+// Set with -T before any thread starts and never changed after, so testing
+// it is all tracing costs when it is off
+bool tracing = false;
+
+// Trace rings of the threads that timed something, which the trace writer
+// drains. A thread adds its ring the first time.
+pthread_mutex_t traceRingLock = PTHREAD_MUTEX_INITIALIZER;
+vector<struct traceRing*> traceRings;
+thread_local struct traceRing *threadTrace = NULL;
+
+// Runs a statement and, when tracing, times it as a stage of the calling
+// thread. The argument is evaluated after the statement.
+#define TRACED(stage, arg, statement)                      \
+    do {                                                    \
+        if(__builtin_expect(tracing, 0))                    \
+        {                                                   \
+            uint64_t traceBegin = traceClock();             \
+            statement;                                      \
+            traceStage(stage, arg, traceBegin);             \
+        }                                                   \
+        else                                                \
+        {                                                   \
+            statement;                                      \
+        }                                                   \
+    } while(0)
+
+void closeConnection(struct connection *conn);
+void resumeConnections(struct shard *s);
+unsigned long monotonicMillis();
+unsigned long monotonicNanos();
+void releaseSegment(struct logSegment *segment);
+void deliverInbox(struct connection *conn);
+void journalEvent(enum journalOp op, uint32_t session, const string& arg);
+void rejoinSession(struct connection *conn);
+void finishSnapshot(struct snapshotJob *job);
+void expireAbsentMembers();
+void snapshotIfDue();
+uint32_t checksum(const char *p, size_t len);
+void reloadCredentials();
+void finishCheckedJobs(struct shard *s);
+void finishNewSession(struct passwordJob *job);
+bool finishJoin(struct passwordJob *job);
+bool openSessionLog(uint32_t id, const string& password, const struct passwordHash *restored,
+                    struct sessionLog *&log, bool& checked);
+
+// Counts every allocation of the standard containers and strings. Every
+// form is replaced, so each new is paired with the delete of its own family.
+void *operator new(size_t size)
+{
+    heapAllocations++;
+    void *p = malloc(size == 0 ? 1 : size);
+    if(p == NULL) throw bad_alloc();
+    return p;
+}
+
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+
+void *operator new(size_t size, const nothrow_t&) noexcept
+{
+    heapAllocations++;
+    return malloc(size == 0 ? 1 : size);
+}
+
+
+void *operator new[](size_t size, const nothrow_t&) noexcept
+{
+    return operator new(size, nothrow);
+}
+
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+
+void operator delete(void *p, const nothrow_t&) noexcept
+{
+    free(p);
+}
+
+
+void operator delete[](void *p, const nothrow_t&) noexcept
+{
+    free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+#endif
+
+#ifdef USE_IO_URING
+void uringFlush(struct connection *conn);
+void uringCancelRecv(struct connection *conn);
+#endif
+
+// Finds the end of the conversion specification starting at the '%' in f and
+// copies it to spec, which has room for 16 bytes
+// Returns the conversion character and whether it takes a long, a size_t or
+// a long long rather than an int
+char eventConversion(const char *&f, char *spec, bool *wide)
+{
+    size_t len = 0;
+    *wide = false;
+    spec[len++] = *f++;
+    while(*f != '\0' && strchr("-+ #0123456789.hlzjt", *f) != NULL)
+    {
+        if(strchr("lzjt", *f) != NULL) *wide = true;
+        if(len < 14) spec[len++] = *f;
+        f++;
+    }
+    spec[len++] = *f;
+    spec[len] = '\0';
+    return *f;
+}
+
+
+// Returns the ring of the calling thread, adding it for the writer thread
+// the first time
+struct eventRing *eventRingOfThread()
+{
+    if(threadEvents == NULL)
+    {
+        threadEvents = new eventRing();
+        pthread_mutex_lock(&eventRingLock);
+        eventRings.push_back(threadEvents);
+        pthread_mutex_unlock(&eventRingLock);
+    }
+    return threadEvents;
+}
+
+
+// Counts an event against the limit of its format for the current second
+// Returns false if it is over the limit
+bool withinRate(const char *format, uint64_t second)
+{
+    struct eventRate *rate = &eventRates[((uintptr_t) format >> 3) % 64];
+    if(rate->format != format)
+    {
+        rate->format = format;
+        rate->second = second;
+        rate->count = 0;
+    }
+    else if(rate->second != second)
+    {
+        rate->second = second;
+        rate->count = 0;
+    }
+    
+    if(rate->count >= EVENT_RATE_LIMIT) return false;
+    rate->count++;
+    return true;
+}
+
+
+// Logs an event with a printf() format, which has to be a string literal.
+// The arguments are copied into the calling thread's ring as they are and
+// formatted later by the writer thread, so this never waits for the output.
+// Events are dropped, never waited for, when the ring is full, and each
+// format is logged at most EVENT_RATE_LIMIT times a second per thread.
+// Before the writer thread runs, events are printed right away.
+void logEvent(int level, const char *format, ...)
+{
+    if(level > logLevel.load(memory_order_relaxed)) return;
+    
+    va_list ap;
+    va_start(ap, format);
+    if(eventWakefd == -1)
+    {
+        FILE *out = level == LEVEL_INFO ? stdout : stderr;
+        vfprintf(out, format, ap);
+        fputc('\n', out);
+        va_end(ap);
+        return;
+    }
+    
+    // The coarse clock is read without leaving user space and is good enough
+    // for millisecond timestamps
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    struct eventRing *ring = eventRingOfThread();
+    if(!withinRate(format, now.tv_sec))
+    {
+        ring->suppressed.fetch_add(1, memory_order_relaxed);
+        va_end(ap);
+        return;
+    }
+    
+    uint32_t tail = ring->tail.load(memory_order_relaxed);
+    if(tail - ring->head.load(memory_order_acquire) == EVENT_RING_SLOTS)
+    {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        va_end(ap);
+        return;
+    }
+    
+    struct eventRecord *record = &ring->records[tail & (EVENT_RING_SLOTS - 1)];
+    record->format = format;
+    record->time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->level = level;
+    
+    // Arguments that don't fit any more are left out
+    size_t size = 0;
+    char spec[16];
+    bool wide;
+    for(const char *f = strchr(format, '%'); f != NULL && *f != '\0'; f = strchr(f + 1, '%'))
+    {
+        if(f[1] == '%')
+        {
+            f++;
+            continue;
+        }
+        
+        char conversion = eventConversion(f, spec, &wide);
+        if(conversion == '\0') break;
+        if(conversion == 's')
+        {
+            const char *str = va_arg(ap, const char*);
+            size_t len = strnlen(str, 255);
+            if(size == sizeof record->args) continue;
+            if(len > sizeof record->args - size - 1) len = sizeof record->args - size - 1;
+            record->args[size] = len;
+            memcpy(record->args + size + 1, str, len);
+            size += 1 + len;
+            continue;
+        }
+        
+        int64_t value;
+        double real;
+        if(strchr("di", conversion) != NULL) value = wide ? va_arg(ap, long) : va_arg(ap, int);
+        else if(strchr("uxXo", conversion) != NULL) value = wide ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+        else if(conversion == 'c') value = va_arg(ap, int);
+        else if(conversion == 'p') value = (intptr_t) va_arg(ap, void*);
+        else if(strchr("fgeFGE", conversion) != NULL)
+        {
+            real = va_arg(ap, double);
+            memcpy(&value, &real, sizeof value);
+        }
+        else break;
+        
+        if(size + sizeof value > sizeof record->args) continue;
+        memcpy(record->args + size, &value, sizeof value);
+        size += sizeof value;
+    }
+    va_end(ap);
+    record->size = size;
+    
+    ring->tail.store(tail + 1, memory_order_release);
+    
+    uint64_t one = 1;
+    if(!eventWakePending.load(memory_order_relaxed) && !eventWakePending.exchange(true) &&
+       write(eventWakefd, &one, sizeof one) == -1) {} // The writer looks again soon anyway
+}
+
+
+// Appends an event, printed the way its format says, to out
+void formatEvent(const struct eventRecord *record, string& out)
+{
+    const char *format = record->format;
+    size_t pos = 0;
+    char spec[16];
+    char text[320];
+    bool wide;
+    
+    while(*format != '\0')
+    {
+        const char *f = strchr(format, '%');
+        if(f == NULL)
+        {
+            out.append(format);
+            break;
+        }
+        out.append(format, f - format);
+        if(f[1] == '%')
+        {
+            out.push_back('%');
+            format = f + 2;
+            continue;
+        }
+        
+        char conversion = eventConversion(f, spec, &wide);
+        if(conversion == '\0') break;
+        format = f + 1;
+        int len = 0;
+        
+        if(conversion == 's')
+        {
+            if(pos >= record->size) continue;
+            size_t strLen = (unsigned char) record->args[pos];
+            char str[256];
+            memcpy(str, record->args + pos + 1, strLen);
+            str[strLen] = '\0';
+            pos += 1 + strLen;
+            len = snprintf(text, sizeof text, spec, str);
+        }
+        else
+        {
+            int64_t value;
+            if(pos + sizeof value > record->size) continue;
+            memcpy(&value, record->args + pos, sizeof value);
+            pos += sizeof value;
+            
+            double real;
+            memcpy(&real, &value, sizeof real);
+            if(strchr("di", conversion) != NULL)
+            {
+                len = wide ? snprintf(text, sizeof text, spec, (long) value) : snprintf(text, sizeof text, spec, (int) value);
+            }
+            else if(strchr("uxXo", conversion) != NULL)
+            {
+                len = wide ? snprintf(text, sizeof text, spec, (unsigned long) value) :
+                             snprintf(text, sizeof text, spec, (unsigned int) value);
+            }
+            else if(conversion == 'c') len = snprintf(text, sizeof text, spec, (int) value);
+            else if(conversion == 'p') len = snprintf(text, sizeof text, spec, (void*) (intptr_t) value);
+            else len = snprintf(text, sizeof text, spec, real);
+        }
+        if(len > 0) out.append(text, len < (int) sizeof text ? len : sizeof text - 1);
+    }
+}
+
+
+// Writes all of buf to fd and empties it
+void writeEvents(int fd, string& buf)
+{
+    size_t done = 0;
+    while(done < buf.size())
+    {
+        ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) break;
+        done += n;
+    }
+    buf.clear();
+}
+
+
+// Prints the events logged by every thread, oldest first, with their time.
+// Informational events go to stdout and the others to stderr. The writer
+// sleeps until a thread logs something and wakes it.
+void runEventWriter()
+{
+    vector<struct eventRing*> rings;
+    vector<uint32_t> heads, tails;
+    string out, err;
+    out.reserve(EVENT_BUFFER_SIZE);
+    err.reserve(EVENT_BUFFER_SIZE);
+    time_t shownSecond = 0;
+    char clock[16] = "";
+    
+    while(true)
+    {
+        struct pollfd wake = {eventWakefd, POLLIN, 0};
+        uint64_t count;
+        if(poll(&wake, 1, EVENT_IDLE_WAIT) == 1)
+        {
+            // Lets events pile up, the threads logging them don't wake the
+            // writer again meanwhile
+            usleep(EVENT_BATCH_INTERVAL * 1000);
+            if(read(eventWakefd, &count, sizeof count) == -1) {}
+        }
+        eventWakePending.store(false);
+        
+        pthread_mutex_lock(&eventRingLock);
+        rings = eventRings;
+        pthread_mutex_unlock(&eventRingLock);
+        heads.resize(rings.size());
+        tails.resize(rings.size());
+        for(size_t i = 0; i < rings.size(); i++)
+        {
+            heads[i] = rings[i]->head.load(memory_order_relaxed);
+            tails[i] = rings[i]->tail.load(memory_order_acquire);
+        }
+        
+        // Merges the rings by time
+        while(true)
+        {
+            int next = -1;
+            for(size_t i = 0; i < rings.size(); i++)
+            {
+                if(heads[i] == tails[i]) continue;
+                if(next == -1 || rings[i]->records[heads[i] & (EVENT_RING_SLOTS - 1)].time <
+                                 rings[next]->records[heads[next] & (EVENT_RING_SLOTS - 1)].time)
+                {
+                    next = i;
+                }
+            }
+            if(next == -1) break;
+            
+            const struct eventRecord *record = &rings[next]->records[heads[next] & (EVENT_RING_SLOTS - 1)];
+            time_t second = record->time / 1000000000;
+            if(second != shownSecond)
+            {
+                struct tm local;
+                localtime_r(&second, &local);
+                strftime(clock, sizeof clock, "%H:%M:%S", &local);
+                shownSecond = second;
+            }
+            
+            string& buf = record->level == LEVEL_INFO ? out : err;
+            char stamp[32];
+            buf.append(stamp, snprintf(stamp, sizeof stamp, "%s.%03u ", clock,
+                                       (unsigned) (record->time / 1000000 % 1000)));
+            formatEvent(record, buf);
+            buf.push_back('\n');
+            rings[next]->head.store(++heads[next], memory_order_release);
+            
+            if(buf.size() > EVENT_BUFFER_SIZE - 1024) writeEvents(&buf == &out ? 1 : 2, buf);
+        }
+        
+        unsigned long dropped = 0, suppressed = 0;
+        for(auto const & ring : rings)
+        {
+            dropped += ring->dropped.exchange(0);
+            suppressed += ring->suppressed.exchange(0);
+        }
+        char note[80];
+        if(dropped > 0) err.append(note, snprintf(note, sizeof note, "server: %lu events lost to a full log ring\n", dropped));
+        if(suppressed > 0) err.append(note, snprintf(note, sizeof note, "server: %lu events over the rate limit\n", suppressed));
+        writeEvents(1, out);
+        writeEvents(2, err);
+    }
+}
+
+
+// Makes the event log one level less verbose, or back to the level of -v
+// after errors only
+void lowerLogLevel(int signum)
+{
+    int level = logLevel.load();
+    logLevel.store(level == LEVEL_ERROR ? configuredLevel : level - 1);
+}
+
+
+// Adds to a counter that only the calling thread changes, so it takes no
+// locked instruction
+void addCount(atomic<unsigned long>& counter, unsigned long n)
+{
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+
+// Returns the histogram bucket a value is counted in
+size_t histogramBucket(unsigned long value)
+{
+    if(value < HIST_SUB_BUCKETS) return value;
+    
+    int exponent = 63 - __builtin_clzl(value);
+    size_t bucket = (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+                    ((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+
+// Returns the highest value counted in a histogram bucket
+unsigned long bucketLimit(size_t bucket)
+{
+    if(bucket < HIST_SUB_BUCKETS) return bucket;
+    
+    int exponent = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    unsigned long sub = bucket % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+
+// Counts a value in a histogram of the calling thread
+void recordValue(struct histogram *h, unsigned long value)
+{
+    addCount(h->counts[histogramBucket(value)], 1);
+    addCount(h->total, 1);
+    addCount(h->sum, value);
+    if(value > h->max.load(memory_order_relaxed)) h->max.store(value, memory_order_relaxed);
+}
+
+
+// Returns the time stages are traced with: the time stamp counter where
+// there is one, otherwise the monotonic clock in nanoseconds
+inline uint64_t traceClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+
+// Records a stage that began at the given time and ends now in the calling
+// thread's trace ring. Stages are dropped, never waited for, when the ring
+// is full.
+void traceStage(int stage, unsigned long arg, uint64_t begin)
+{
+    uint64_t end = traceClock();
+    if(threadTrace == NULL)
+    {
+        threadTrace = new traceRing();
+        threadTrace->tid = syscall(SYS_gettid);
+        if(currentShard != NULL) snprintf(threadTrace->name, TRACE_NAME_SIZE, "worker %d", currentShard->id);
+        else pthread_getname_np(pthread_self(), threadTrace->name, TRACE_NAME_SIZE);
+        
+        pthread_mutex_lock(&traceRingLock);
+        traceRings.push_back(threadTrace);
+        pthread_mutex_unlock(&traceRingLock);
+    }
+    
+    struct traceRing *ring = threadTrace;
+    uint32_t tail = ring->tail.load(memory_order_relaxed);
+    if(tail - ring->head.load(memory_order_acquire) == TRACE_RING_EVENTS)
+    {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    
+    struct traceRecord *record = &ring->records[tail & (TRACE_RING_EVENTS - 1)];
+    record->begin = begin;
+    record->duration = end - begin < UINT32_MAX ? end - begin : UINT32_MAX;
+    record->stageArg = stage << 24 | (arg < 0xffffff ? arg : 0xffffff);
+    ring->tail.store(tail + 1, memory_order_release);
+}
+
+
+// Get sockaddr, IPv4 or IPv6:
+void *get_in_addr(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        return &(((struct sockaddr_in*) sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*) sa)->sin6_addr);
+}
+
+
+// Creates socket that listens for new connections and returns the file descriptor
+// With reusePort set, several listeners can share the port and the kernel
+// spreads new connections among them
+int createListenerSocket(const char* portNum, bool reusePort)
+{
+    int listener;     // listening socket descriptor
+    int yes=1;        // for setsockopt() SO_REUSEADDR, below
+    int rv;
+    
+    struct addrinfo hints, *ai, *p;
+    
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    
+    if ((rv = getaddrinfo(NULL, portNum, &hints, &ai)) != 0)
+    {
+        fprintf(stderr, "server: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+    
+    for(p = ai; p != NULL; p = p->ai_next)
+    {
+        listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listener < 0) continue;
+        
+        // lose the pesky "address already in use" error message
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if(reusePort) setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+
+        if (bind(listener, p->ai_addr, p->ai_addrlen) < 0)
+        {
+            close(listener);
+            continue;
+        }
+
+        break;
+    }
+
+    // if we got here, it means we didn't get bound
+    if (p == NULL) {
+        fprintf(stderr, "server: failed to bind\n");
+        exit(2);
+    }
+
+    freeaddrinfo(ai); // all done with this
+
+    // listen
+    if (listen(listener, BACKLOG) == -1) {
+        perror("listen");
+        exit(3);
+    }
+    
+    return listener;
+}
+
+
+// Returns scratch memory that lasts until the end of the loop iteration
+void *arenaAlloc(size_t size)
+{
+    struct arena& a = currentShard->scratch;
+    size = (size + 15) & ~(size_t) 15;
+    
+    if(size > ARENA_BLOCK_SIZE)
+    {
+        a.large.push_back((char*) malloc(size));
+        heapAllocations++;
+        return a.large.back();
+    }
+    
+    if(a.block < a.blocks.size() && a.used + size > ARENA_BLOCK_SIZE)
+    {
+        a.block++;
+        a.used = 0;
+    }
+    if(a.block == a.blocks.size())
+    {
+        a.blocks.push_back((char*) malloc(ARENA_BLOCK_SIZE));
+        heapAllocations++;
+    }
+    
+    void *p = a.blocks[a.block] + a.used;
+    a.used += size;
+    return p;
+}
+
+
+// Releases the scratch memory of a loop iteration
+void arenaReset(struct shard *s)
+{
+    for(auto const & p : s->scratch.large) free(p);
+    s->scratch.large.clear();
+    s->scratch.block = 0;
+    s->scratch.used = 0;
+}
+
+
+// Number of bytes of a message in the text protocol
+size_t textLength(const struct message *data)
+{
+    char digits[32];
+    return snprintf(digits, sizeof digits, "%u %u ", data->type, data->size)
+           + data->source.length() + 1 + data->data.length();
+}
+
+
+// Writes a message as the text "<type> <size> <source> <data>", which
+// takes textLength() bytes
+void writeText(const struct message *data, char *p)
+{
+    char digits[32];
+    int n = snprintf(digits, sizeof digits, "%u %u ", data->type, data->size);
+    memcpy(p, digits, n);
+    p += n;
+    memcpy(p, data->source.data(), data->source.length());
+    p += data->source.length();
+    *p++ = ' ';
+    memcpy(p, data->data.data(), data->data.length());
+}
+
+
+// Allocates a frame of the given length, held once by the caller. Workers
+// take their frames from their pool of the smallest size class they fit in.
+struct frame *newFrame(size_t len)
+{
+    size_t size = sizeof(struct frame) + len;
+    int sizeClass = 0;
+    while(sizeClass < NUM_FRAME_CLASSES && frameClasses[sizeClass] < size) sizeClass++;
+    
+    struct shard *s = currentShard;
+    struct frame *f = NULL;
+    if(s != NULL && sizeClass < NUM_FRAME_CLASSES)
+    {
+        vector<struct frame*>& pool = s->framePool[sizeClass];
+        if(pool.empty())
+        {
+            struct frame *returned = s->returnedFrames[sizeClass].exchange(NULL, memory_order_acquire);
+            for(; returned != NULL; returned = returned->next) pool.push_back(returned);
+        }
+        if(!pool.empty())
+        {
+            f = pool.back();
+            pool.pop_back();
+            s->framesReused++;
+        }
+    }
+    if(f == NULL)
+    {
+        f = (struct frame*) malloc(sizeClass < NUM_FRAME_CLASSES ? frameClasses[sizeClass] : size);
+        heapAllocations++;
+    }
+    
+    f->home = sizeClass < NUM_FRAME_CLASSES ? s : NULL;
+    f->sizeClass = sizeClass;
+    f->refs.store(1, memory_order_relaxed);
+    f->len = len;
+    f->segment = NULL;
+    f->attached = false;
+    f->data = (char*) (f + 1);
+    return f;
+}
+
+
+// Encodes a binary frame, held once by the caller
+struct frame *encodeBinaryFrame(unsigned int type, unsigned int flags, uint32_t sourceID,
+                                const string& data)
+{
+    struct frame *f = newFrame(BINHEADERSIZE + data.length());
+    
+    uint32_t length = htonl(data.length());
+    uint16_t fields[] = {htons(type), htons(flags)};
+    uint32_t source = htonl(sourceID);
+    memcpy(f->data, &length, 4);
+    memcpy(f->data + 4, fields, 4);
+    memcpy(f->data + 8, &source, 4);
+    memcpy(f->data + BINHEADERSIZE, data.data(), data.length());
+    return f;
+}
+
+
+// Returns the ID of a name, 0 if it was never interned
+// Must be called with stateLock held
+uint32_t findName(const string& name)
+{
+    auto id = nameIDs.find(name);
+    return id == nameIDs.end() ? 0 : id->second;
+}
+
+
+// Returns the ID of a name, assigning the next free one the first time
+// Must be called with stateLock held for writing
+uint32_t internName(const string& name)
+{
+    auto res = nameIDs.insert(make_pair(name, (uint32_t) names.size()));
+    if(res.second) names.push_back(make_pair(name, (struct frame*) NULL));
+    return res.first->second;
+}
+
+
+// Returns the name behind an ID
+// Must be called with stateLock held
+const string& nameOf(uint32_t id)
+{
+    return names[id].first;
+}
+
+
+// Returns the source ID of a username, encoding its SOURCE_DEF frame the
+// first time the user logs in
+// Must be called with stateLock held for writing
+uint32_t internSource(const string& name)
+{
+    uint32_t id = internName(name);
+    if(names[id].second == NULL) names[id].second = encodeBinaryFrame(SOURCE_DEF, 0, id, name);
+    return id;
+}
+
+
+// Returns the source ID of a message
+// Must be called with stateLock held, except for server generated messages
+uint32_t sourceIDOf(const struct message *data)
+{
+    if(data->sourceID != 0) return data->sourceID;
+    if(data->source == "SERVER") return SERVER_SOURCE;
+    return findName(data->source);
+}
+
+
+// Returns true if a message fits in a packet of the text protocol, which
+// also bounds the binary frames so every client can receive every message
+bool messageFits(const struct message *data)
+{
+    return textLength(data) + 1 <= MAXDATASIZE;
+}
+
+
+// Encodes a message into a frame of the given framing, held once by the caller
+// Must be called with stateLock held when encoding a client's packet for
+// binary framing
+struct frame *encodeFrame(const struct message *data, enum framing format)
+{
+    if(format == FRAMING_BINARY)
+    {
+        return encodeBinaryFrame(data->type, data->flags, sourceIDOf(data), data->data);
+    }
+    
+    size_t packetLen = textLength(data);
+    size_t len = format == FRAMING_LEGACY ? packetLen + 1 : FRAMEHEADERSIZE + packetLen;
+    struct frame *f = newFrame(len);
+    
+    if(format == FRAMING_LEGACY)
+    {
+        writeText(data, f->data);
+        f->data[packetLen] = '\0';
+        return f;
+    }
+    
+    uint32_t length = htonl(packetLen);
+    memcpy(f->data, &length, FRAMEHEADERSIZE);
+    writeText(data, f->data + FRAMEHEADERSIZE);
+    return f;
+}
+
+
+// Adds a holder to a frame
+void holdFrame(struct frame *f)
+{
+    f->refs.fetch_add(1, memory_order_relaxed);
+}
+
+
+// Removes a holder from a frame. The last one puts it back in the pool of
+// the worker that allocated it, or frees it if there is none or it is full.
+void releaseFrame(struct frame *f)
+{
+    if(f->refs.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    if(f->segment != NULL) releaseSegment(f->segment);
+    
+    struct shard *home = f->home;
+    if(home == NULL) free(f);
+    else if(home != currentShard)
+    {
+        atomic<struct frame*>& returned = home->returnedFrames[f->sizeClass];
+        f->next = returned.load(memory_order_relaxed);
+        while(!returned.compare_exchange_weak(f->next, f, memory_order_release, memory_order_relaxed));
+    }
+    else if(home->framePool[f->sizeClass].size() < FRAME_POOL_MAX)
+    {
+        home->framePool[f->sizeClass].push_back(f);
+    }
+    else free(f);
+}
+
+
+// Reads an unsigned decimal number followed by a space from a text packet
+// Returns false if there is none
+bool readTextField(const char *&p, const char *end, unsigned int& value)
+{
+    const char *start = p;
+    value = 0;
+    while(p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    
+    if(p == start || p == end || *p != ' ') return false;
+    p++;
+    return true;
+}
+
+
+// Creates a message structure from a text packet "<type> <size> <source> <data>"
+// The data is everything after the space following the source, ACK_DATA if
+// the packet ends with the source
+// Returns false if the packet is malformed
+bool messageFromPacket(const char *buffer, size_t len, struct message& packet)
+{
+    const char *p = buffer, *end = buffer + len;
+    if(!readTextField(p, end, packet.type) || !readTextField(p, end, packet.size)) return false;
+    
+    const char *space = (const char*) memchr(p, ' ', end - p);
+    if(space == NULL)
+    {
+        packet.source.assign(p, end - p);
+        packet.data = ACK_DATA;
+        packet.flags = 0;
+        return true;
+    }
+    packet.source.assign(p, space - p);
+    packet.data.assign(space + 1, end - space - 1);
+    packet.flags = 0;
+    return true;
+}
+
+
+// Creates a message structure from a binary frame of a client, whose header
+// was checked to fit already
+void messageFromBinary(const char *buffer, struct message& packet)
+{
+    uint32_t length;
+    uint16_t type, flags;
+    memcpy(&length, buffer, 4);
+    memcpy(&type, buffer + 4, 2);
+    memcpy(&flags, buffer + 6, 2);
+    
+    packet.type = ntohs(type);
+    packet.flags = ntohs(flags) & (FLAG_MORE | FLAG_CONTINUED);
+    packet.data.assign(buffer + BINHEADERSIZE, ntohl(length));
+    packet.size = packet.data.length() + 1; // Relayed to text clients as is
+}
+
+
+// Return the sessionID that the sockfd is connected to
+// Returns "NoSessionFound" if session could not be found
+string clientSockfdToSessionID (int sockfd)
+{
+    struct connection *conn = connTable[sockfd];
+    if(conn != NULL && conn->session != NULL) return nameOf(conn->session->id);
+
+    // Session could not be found 
+    return SESSION_NOT_FOUND;
+}
+
+
+// Returns the username of a logged in client
+// Must be called with stateLock held
+const string& usernameOf(const struct connection *conn)
+{
+    return nameOf(conn->userID);
+}
+
+
+// Adds a client to a session
+// Must be called with stateLock held for writing, or held for reading and
+// the session's lock held for writing
+void addMember(struct session *session, struct connection *conn)
+{
+    conn->session = session;
+    conn->memberIndex = session->members.size();
+    session->members.push_back(conn->sockfd);
+    journalEvent(JOURNAL_JOIN, session->id, usernameOf(conn));
+}
+
+
+// Removes a client from its session
+// Must be called with stateLock held for writing, or held for reading and
+// the session's lock held for writing
+// Returns true if nobody is left in the session, absent members included
+bool removeMember(struct connection *conn)
+{
+    struct session *session = conn->session;
+    if(session == NULL) return false;
+    
+    // The last member takes the place of the removed one
+    int last = session->members.back();
+    session->members[conn->memberIndex] = last;
+    connTable[last]->memberIndex = conn->memberIndex;
+    session->members.pop_back();
+    conn->session = NULL;
+    journalEvent(JOURNAL_LEAVE, session->id, usernameOf(conn));
+    
+    return session->members.empty() && session->absent.empty();
+}
+
+
+// Takes a session nobody is in any more out of the tables
+// Must be called with stateLock held for writing
+void endSession(struct session *session)
+{
+    sessionList.erase(session->id);
+    pthread_rwlock_destroy(&session->lock);
+    delete session;
+}
+
+
+// Ends a session a client left while holding stateLock shared, unless
+// somebody joined it or it was ended and created again meanwhile
+void endEmptySession(uint32_t id)
+{
+    pthread_rwlock_wrlock(&stateLock);
+    struct session **session = sessionList.find(id);
+    if(session != NULL && (*session)->members.empty() && (*session)->absent.empty()) endSession(*session);
+    pthread_rwlock_unlock(&stateLock);
+}
+
+
+// Returns true once the server stopped handling a connection's packets
+bool isClosing(const struct connection *conn)
+{
+    return conn->closed || conn->dropPending || conn->state == CLOSING;
+}
+
+
+// Closes a connection on the server's initiative, once the bytes already
+// queued for it are sent. The client is removed at the end of the loop
+// iteration, so this is safe to call while holding stateLock.
+void dropConnection(struct connection *conn)
+{
+    if(isClosing(conn)) return;
+    
+    conn->dropPending = true;
+    currentShard->droppedConns.push_back(conn);
+}
+
+
+// Posts an item to a shard's mailbox and wakes the shard up if needed
+void postToShard(struct shard *s, struct mailItem *item)
+{
+    item->next.store(NULL, memory_order_relaxed);
+    struct mailItem *prev = s->mailHead.exchange(item, memory_order_acq_rel);
+    prev->next.store(item, memory_order_release);
+    
+    // Only the first item posted since the shard last woke up signals it
+    if(!s->wakePending.exchange(true, memory_order_acq_rel))
+    {
+        uint64_t one = 1;
+        if(write(s->wakefd, &one, sizeof one) == -1) perror("write");
+    }
+}
+
+
+// Creates an empty mailbox item of the given kind sent by the current client
+struct mailItem *newMailItem(enum mailKind kind)
+{
+    struct shard *s = currentShard;
+    vector<struct mailItem*>& pool = s->mailPool;
+    if(pool.empty())
+    {
+        struct mailItem *returned = s->returnedItems.exchange(NULL, memory_order_acquire);
+        for(; returned != NULL; returned = returned->next.load(memory_order_relaxed))
+        {
+            pool.push_back(returned);
+        }
+    }
+    
+    struct mailItem *item;
+    if(!pool.empty())
+    {
+        item = pool.back();
+        pool.pop_back();
+        s->itemsReused++;
+    }
+    else
+    {
+        item = new mailItem;
+        item->home = s;
+    }
+    
+    item->kind = kind;
+    item->data = NULL;
+    item->sourceID = 0;
+    item->sender = currentSender;
+    return item;
+}
+
+
+// Stops (delta 1) or resumes (delta -1) reading from a client owned by the
+// calling thread. Reads only resume once every pause has been undone.
+void adjustPause(struct connection *conn, int delta)
+{
+    conn->pauseCount += delta;
+    
+    if(conn->pauseCount == 0)
+    {
+        currentShard->resumedConns.push_back(make_pair(conn->sockfd, conn->id));
+    }
+#ifdef USE_IO_URING
+    else if(conn->pauseCount == 1 && delta > 0 && uringActive) uringCancelRecv(conn);
+#endif
+}
+
+
+// Pauses or resumes reading from a client on whichever thread owns it
+void signalSender(const struct connectionRef& sender, enum mailKind kind)
+{
+    if(sender.owner == currentShard)
+    {
+        // Only the owner changes the table entries of its own sockets
+        struct connection *conn = connTable[sender.sockfd];
+        if(conn != NULL && conn->id == sender.id) adjustPause(conn, kind == MAIL_PAUSE ? 1 : -1);
+        return;
+    }
+    
+    struct mailItem *item = newMailItem(kind);
+    item->recipients.push_back(make_pair(sender.sockfd, sender.id));
+    postToShard(sender.owner, item);
+}
+
+
+// Resumes every client paused because of a connection's queue
+void releaseSenders(struct connection *conn)
+{
+    for(auto const & sender : conn->pausedSenders) signalSender(sender, MAIL_RESUME);
+    conn->pausedSenders.clear();
+}
+
+
+// Removes bytes the socket took from the front of a connection's output queue
+void consumeOutput(struct connection *conn, size_t nbytes)
+{
+    conn->outBytes -= nbytes;
+    conn->bytesOut += nbytes;
+    addCount(currentShard->metrics->bytesOut, nbytes);
+    
+    while(nbytes > 0)
+    {
+        struct frame *f = conn->outQueue.front();
+        if(nbytes < f->len - conn->outHead)
+        {
+            conn->outHead += nbytes;
+            return;
+        }
+        
+        nbytes -= f->len - conn->outHead;
+        conn->outQueue.pop_front();
+        conn->outHead = 0;
+        releaseFrame(f);
+        conn->framesOut++;
+        currentShard->framesFlushed++;
+        addCount(currentShard->metrics->framesOut, 1);
+    }
+}
+
+
+// Returns the number of frames at the front of the output queue that the
+// kernel may still be reading from
+size_t framesInFlight(const struct connection *conn)
+{
+#ifdef USE_IO_URING
+    if(uringActive) return conn->sendInFlight ? conn->sendFrames : 0;
+#endif
+    return 0;
+}
+
+
+// Releases every queued frame of a connection that the kernel isn't reading from
+void discardOutput(struct connection *conn)
+{
+    size_t keep = framesInFlight(conn);
+    if(keep == 0) conn->outHead = 0;
+    
+    while(conn->outQueue.size() > keep)
+    {
+        struct frame *f = conn->outQueue.back();
+        conn->outQueue.pop_back();
+        conn->outBytes -= f->len;
+        releaseFrame(f);
+    }
+    if(keep == 0) conn->outBytes = 0;
+}
+
+
+// Returns an unused connection context of the calling thread's slabs
+struct connection *allocConnection()
+{
+    vector<struct connection*>& freeConns = currentShard->freeConns;
+    if(freeConns.empty())
+    {
+        struct connection *slab = new connection[CONN_SLAB_SIZE];
+        for(int i = CONN_SLAB_SIZE - 1; i >= 0; i--) freeConns.push_back(&slab[i]);
+    }
+    
+    struct connection *conn = freeConns.back();
+    freeConns.pop_back();
+    return conn;
+}
+
+
+// Frees the context of a closed connection and the frames still queued for
+// it. The context goes back to its worker's slabs, without the memory its
+// buffers held.
+void freeConnection(struct connection *conn)
+{
+    for(auto const & f : conn->outQueue) releaseFrame(f);
+    
+    string().swap(conn->inBuf);
+    deque<struct frame*>().swap(conn->outQueue);
+    vector<bool>().swap(conn->knownSources);
+    vector<struct connectionRef>().swap(conn->pausedSenders);
+#ifdef USE_IO_URING
+    vector<struct iovec>().swap(conn->sendIov);
+#endif
+    conn->owner->freeConns.push_back(conn);
+}
+
+
+// Writes as much of a connection's output queue as the socket takes without
+// blocking, gathering up to IOV_MAX frames per writev(). The rest is written
+// once epoll reports the socket writable.
+void flushConnection(struct connection *conn)
+{
+    if(!conn->outQueue.empty()) recordValue(&currentShard->metrics->queueDepth, conn->outBytes);
+    
+#ifdef USE_IO_URING
+    if(uringActive)
+    {
+        uringFlush(conn);
+        return;
+    }
+#endif
+    
+    if(conn->closed) return;
+    
+    struct iovec iov[IOV_MAX];
+    bool corked = false;
+    int on = 1;
+    
+    if(!conn->outQueue.empty()) currentShard->flushes++;
+    
+    while(!conn->outQueue.empty())
+    {
+        size_t count = 0, total = 0;
+        for(auto const & f : conn->outQueue)
+        {
+            if(count == IOV_MAX) break;
+            
+            size_t skip = count == 0 ? conn->outHead : 0;
+            iov[count].iov_base = f->data + skip;
+            iov[count].iov_len = f->len - skip;
+            total += iov[count].iov_len;
+            count++;
+        }
+        
+        ssize_t nbytes = writev(conn->sockfd, iov, count);
+        currentShard->writeCalls++;
+        if(nbytes == -1)
+        {
+            // Socket buffer is full
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                conn->outBlocked = true;
+                break;
+            }
+            
+            logEvent(LEVEL_WARN, "writev: %s", strerror(errno));
+            discardOutput(conn);
+            dropConnection(conn);
+            break;
+        }
+        
+        consumeOutput(conn, nbytes);
+        
+        // More than one writev() is needed, hold partial segments back until
+        // the burst is written
+        if(!corked && (size_t) nbytes == total && !conn->outQueue.empty())
+        {
+            setsockopt(conn->sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+            corked = true;
+        }
+    }
+    
+    if(corked)
+    {
+        int off = 0;
+        setsockopt(conn->sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof off);
+    }
+    if(conn->outQueue.empty()) conn->outBlocked = false;
+    
+    if(conn->outBytes <= lowWatermark) releaseSenders(conn);
+    
+    // A client dropped by the server is closed once everything was sent
+    if(conn->outQueue.empty() && conn->state == CLOSING) closeConnection(conn);
+}
+
+
+// Applies the slow consumer policy to a client whose output queue is still
+// past the high watermark after its socket took what it could
+void handleSlowConsumer(struct connection *conn)
+{
+    switch(slowPolicy)
+    {
+        case POLICY_DROP_OLDEST:
+        {
+            // Frames the socket is reading from or partly took have to be finished
+            size_t keep = framesInFlight(conn);
+            if(keep == 0 && conn->outHead > 0) keep = 1;
+            while(keep < conn->outQueue.size() && conn->outQueue[keep]->attached) keep++;
+            
+            // Frames attached to a dropped one go with it
+            while(conn->outBytes > lowWatermark && conn->outQueue.size() > keep)
+            {
+                auto oldest = conn->outQueue.begin() + keep;
+                do
+                {
+                    conn->outBytes -= (*oldest)->len;
+                    releaseFrame(*oldest);
+                    oldest = conn->outQueue.erase(oldest);
+                } while(oldest != conn->outQueue.end() && (*oldest)->attached);
+            }
+            break;
+        }
+        case POLICY_DISCONNECT:
+            logEvent(LEVEL_INFO, "server: socket %d is not keeping up, dropping it", conn->sockfd);
+            discardOutput(conn);
+            dropConnection(conn);
+            break;
+        case POLICY_PAUSE:
+        {
+            // Server generated packets have no sender to pause
+            struct connectionRef sender = conn->lastSender;
+            if(sender.owner == NULL) break;
+            
+            for(auto const & paused : conn->pausedSenders)
+            {
+                if(paused.sockfd == sender.sockfd && paused.id == sender.id) return;
+            }
+            conn->pausedSenders.push_back(sender);
+            signalSender(sender, MAIL_PAUSE);
+            break;
+        }
+    }
+}
+
+
+// Returns true if the socket of a connection doesn't take more bytes. Only
+// then does a long output queue mean the client is too slow, rather than the
+// server having handled a burst of packets at once.
+bool outputStalled(const struct connection *conn)
+{
+#ifdef USE_IO_URING
+    // A send that found room in the socket completes in the loop iteration
+    // after the one it was queued in
+    if(uringActive)
+    {
+        return conn->sendInFlight && conn->owner->loopIteration >= conn->sendIteration + 2;
+    }
+#endif
+    // The flush stopped short of the end of the queue
+    return conn->outBlocked;
+}
+
+
+// Writes out the frames queued for clients during the loop iteration, one
+// flush per client however many frames it got
+void flushDirty(struct shard *s)
+{
+    for(auto const & ref : s->dirtyConns)
+    {
+        // Only the owner changes the table entries of its own sockets
+        struct connection *conn = connTable[ref.first];
+        if(conn == NULL || conn->id != ref.second) continue;
+        
+        conn->flushPending = false;
+        TRACED(TRACE_FLUSH, ref.first, flushConnection(conn));
+        
+        if(conn->outBytes > highWatermark && outputStalled(conn)) handleSlowConsumer(conn);
+    }
+    s->dirtyConns.clear();
+}
+
+
+// Prints the output counters of the calling thread
+void printFlushStats(struct shard *s)
+{
+    printf("server: worker %d wrote %lu frames in %lu flushes (%.2f per flush) with %lu write calls\n",
+           s->id, s->framesFlushed, s->flushes,
+           s->flushes > 0 ? (double) s->framesFlushed / s->flushes : 0.0, s->writeCalls);
+    printf("server: worker %d made %lu heap allocations, reused %lu frames and %lu mailbox items, "
+           "has %zu KiB of scratch memory\n", s->id, heapAllocations, s->framesReused, s->itemsReused,
+           s->scratch.blocks.size() * ARENA_BLOCK_SIZE / 1024);
+    fflush(stdout);
+}
+
+
+// Queues a frame for a client owned by the calling thread, to be written
+// together with the client's other frames at the end of the loop iteration.
+// The queue holds the frame itself rather than a copy.
+// Returns true if the frame was queued
+bool transmit(struct connection *conn, struct frame *f)
+{
+    if(conn == NULL || isClosing(conn)) return false;
+    
+    holdFrame(f);
+    conn->outQueue.push_back(f);
+    conn->outBytes += f->len;
+    if(currentSender.owner != NULL) conn->lastSender = currentSender;
+    
+    if(!conn->flushPending)
+    {
+        conn->flushPending = true;
+        currentShard->dirtyConns.push_back(make_pair(conn->sockfd, conn->id));
+    }
+    return true;
+}
+
+
+// Queues a frame from the given source for a client owned by the calling
+// thread. A binary client is told the name behind the source ID first,
+// unless it knows it already.
+// Must be called with stateLock held
+// Returns true if the frame was queued
+bool deliver(struct connection *conn, struct frame *f, uint32_t sourceID)
+{
+    if(conn != NULL && conn->format == FRAMING_BINARY && sourceID > SERVER_SOURCE &&
+       sourceID < names.size() && names[sourceID].second != NULL)
+    {
+        if(conn->knownSources.size() <= sourceID) conn->knownSources.resize(sourceID + 1, false);
+        if(!conn->knownSources[sourceID] && transmit(conn, names[sourceID].second))
+        {
+            conn->knownSources[sourceID] = true;
+        }
+    }
+    return transmit(conn, f);
+}
+
+
+// Sends a message to client in the following format:
+//   message = "<type> <data_size> <source> <data>"
+// framed the way the client frames its own packets, or as a binary frame
+// to clients that negotiated it
+// Clients of other worker threads get it through their shard's mailbox
+// Must be called with stateLock held
+// Returns true if message is successfully sent
+bool sendToClient(struct message *data, int sockfd)
+{
+    if(!messageFits(data)) return false;
+    
+    struct connection *conn = connTable[sockfd];
+    if(conn == NULL) return false;
+    
+    struct frame *f = encodeFrame(data, conn->format);
+    uint32_t sourceID = conn->format == FRAMING_BINARY ? sourceIDOf(data) : 0;
+    
+    if(conn->owner != currentShard)
+    {
+        struct mailItem *item = newMailItem(MAIL_DELIVER);
+        item->data = f;
+        item->sourceID = sourceID;
+        item->recipients.push_back(make_pair(sockfd, conn->id));
+        postToShard(conn->owner, item);
+        return true;
+    }
+    
+    bool sent = deliver(conn, f, sourceID);
+    releaseFrame(f);
+    return sent;
+}
+
+
+// Sends a message to every client of a group except the excluded one
+// The packet is encoded once per framing in use. Every recipient's queue
+// holds that same frame, and clients of other worker threads get it through
+// a single mailbox item per thread.
+// Must be called with stateLock held, which keeps the group from changing
+void sendToClients(struct message *data, const vector<int>& clients, int excluded)
+{
+    struct frame *frames[NUM_FRAMINGS] = {NULL}; // Indexed by framing
+    uint32_t sourceID = sourceIDOf(data);
+
+    if(!messageFits(data)) return;
+    
+    // One item per worker thread and framing
+    size_t numForwarded = shards.size() * NUM_FRAMINGS;
+    struct mailItem **forwarded = (struct mailItem**) arenaAlloc(numForwarded * sizeof *forwarded);
+    memset(forwarded, 0, numForwarded * sizeof *forwarded);
+    size_t fanout = 0;
+    
+    for(auto const & sockfd : clients)
+    {
+        if(sockfd == excluded) continue;
+        
+        // Clients of this thread on their way out are skipped here, those of
+        // other threads by their owner
+        struct connection *conn = connTable[sockfd];
+        if(conn == NULL || (conn->owner == currentShard && isClosing(conn))) continue;
+        fanout++;
+        
+        struct frame *&f = frames[conn->format];
+        if(f == NULL) TRACED(TRACE_ENCODE, conn->format, f = encodeFrame(data, conn->format));
+        
+        if(conn->owner == currentShard)
+        {
+            TRACED(TRACE_DELIVER, sockfd, deliver(conn, f, sourceID));
+            continue;
+        }
+        
+        struct mailItem *&item = forwarded[conn->owner->id * NUM_FRAMINGS + conn->format];
+        if(item == NULL)
+        {
+            item = newMailItem(MAIL_DELIVER);
+            item->data = f;
+            item->sourceID = sourceID;
+            holdFrame(f);
+        }
+        item->recipients.push_back(make_pair(sockfd, conn->id));
+    }
+    
+    for(size_t i = 0; i < numForwarded; i++)
+    {
+        if(forwarded[i] != NULL)
+        {
+            TRACED(TRACE_FORWARD, i / NUM_FRAMINGS, postToShard(shards[i / NUM_FRAMINGS], forwarded[i]));
+        }
+    }
+    recordValue(&currentShard->metrics->fanout, fanout);
+    for(auto const & f : frames)
+    {
+        if(f != NULL) releaseFrame(f);
+    }
+}
+
+
+// Returns the calling worker's reply message, emptied and coming from the server
+struct message& serverMessage()
+{
+    struct message& reply = currentShard->reply;
+    reply.size = 0;
+    reply.source = "SERVER";
+    reply.sourceID = SERVER_SOURCE;
+    reply.flags = 0;
+    reply.data.clear();
+    return reply;
+}
+
+
+// Send an acknowledge to a client if their login is successful
+void acknowledgeLogin(int sockfd)
+{
+    struct message& loginAck = serverMessage();
+    loginAck.type = LO_ACK;
+    
+    sendToClient(&loginAck, sockfd);
+}
+
+// Round constants of SHA-256
+const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+uint32_t rotateRight(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+
+void sha256Init(struct sha256 *c)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->h, initial, sizeof initial);
+    c->used = 0;
+    c->length = 0;
+}
+
+
+// Mixes one 64 byte block into the state
+void sha256Compress(struct sha256 *s, const unsigned char *block)
+{
+    uint32_t w[64];
+    for(int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+               (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for(int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for(int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) +
+                      ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s->h[0] += a;
+    s->h[1] += b;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+    s->h[5] += f;
+    s->h[6] += g;
+    s->h[7] += h;
+}
+
+
+void sha256Update(struct sha256 *c, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char*) data;
+    c->length += len;
+    while(len > 0)
+    {
+        size_t n = min(len, (size_t) 64 - c->used);
+        memcpy(c->block + c->used, p, n);
+        c->used += n;
+        p += n;
+        len -= n;
+        if(c->used == 64)
+        {
+            sha256Compress(c, c->block);
+            c->used = 0;
+        }
+    }
+}
+
+
+void sha256Final(struct sha256 *c, unsigned char digest[CREDENTIAL_HASH_SIZE])
+{
+    uint64_t bits = htobe64(c->length * 8);
+    unsigned char pad = 0x80;
+    sha256Update(c, &pad, 1);
+    pad = 0;
+    while(c->used != 56) sha256Update(c, &pad, 1);
+    sha256Update(c, &bits, 8);
+    for(int i = 0; i < 8; i++)
+    {
+        uint32_t word = htonl(c->h[i]);
+        memcpy(digest + 4 * i, &word, 4);
+    }
+}
+
+
+// Derives the hash a credential file keeps for a password: PBKDF2 with
+// HMAC-SHA256, one block long. The keyed inner and outer states are set up
+// once and copied for every round.
+void hashPassword(const string& password, const unsigned char *salt, uint32_t iterations,
+                  unsigned char out[CREDENTIAL_HASH_SIZE])
+{
+    unsigned char key[64] = {0};
+    if(password.length() > sizeof key)
+    {
+        struct sha256 c;
+        sha256Init(&c);
+        sha256Update(&c, password.data(), password.length());
+        sha256Final(&c, key);
+    }
+    else memcpy(key, password.data(), password.length());
+    
+    struct sha256 inner, outer;
+    unsigned char pad[64];
+    sha256Init(&inner);
+    sha256Init(&outer);
+    for(int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+    sha256Update(&inner, pad, 64);
+    for(int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+    sha256Update(&outer, pad, 64);
+    
+    static const unsigned char blockIndex[4] = {0, 0, 0, 1};
+    unsigned char u[CREDENTIAL_HASH_SIZE];
+    struct sha256 c = inner;
+    sha256Update(&c, salt, CREDENTIAL_SALT_SIZE);
+    sha256Update(&c, blockIndex, 4);
+    sha256Final(&c, u);
+    c = outer;
+    sha256Update(&c, u, sizeof u);
+    sha256Final(&c, u);
+    memcpy(out, u, sizeof u);
+    
+    for(uint32_t round = 1; round < iterations; round++)
+    {
+        c = inner;
+        sha256Update(&c, u, sizeof u);
+        sha256Final(&c, u);
+        c = outer;
+        sha256Update(&c, u, sizeof u);
+        sha256Final(&c, u);
+        for(int i = 0; i < CREDENTIAL_HASH_SIZE; i++) out[i] ^= u[i];
+    }
+}
+
+
+// Maps a credential file into memory. Nothing in it is read but the header,
+// so loading takes the same time however many users it holds.
+// Returns NULL if the file can't be used
+struct credentialStore *mapCredentials(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path.c_str());
+        if(fd != -1) close(fd);
+        return NULL;
+    }
+    
+    char *base = st.st_size >= CREDENTIAL_HEADER ?
+                 (char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : (char*) MAP_FAILED;
+    close(fd);
+    
+    uint32_t header[3];
+    if(base != MAP_FAILED) memcpy(header, base + 4, sizeof header);
+    uint32_t slotCount = ntohl(header[1]);
+    if(base == MAP_FAILED || memcmp(base, CREDENTIAL_MAGIC, 4) != 0 || slotCount == 0 ||
+       (slotCount & (slotCount - 1)) != 0 ||
+       (size_t) st.st_size != CREDENTIAL_HEADER + slotCount * sizeof(struct credentialSlot))
+    {
+        fprintf(stderr, "server: %s is not a credential file\n", path.c_str());
+        if(base != MAP_FAILED) munmap(base, st.st_size);
+        return NULL;
+    }
+    
+    struct credentialStore *store = new credentialStore;
+    store->base = base;
+    store->length = st.st_size;
+    store->iterations = ntohl(header[0]);
+    store->slotCount = slotCount;
+    store->userCount = ntohl(header[2]);
+    store->slots = (const struct credentialSlot*) (base + CREDENTIAL_HEADER);
+    return store;
+}
+
+
+// Returns the slot of a user in a credential store, NULL if there is none
+const struct credentialSlot *findCredential(const struct credentialStore *store, const string& user)
+{
+    if(user.empty() || user.length() > MAX_USERNAME) return NULL;
+    
+    uint32_t mask = store->slotCount - 1;
+    uint32_t i = checksum(user.data(), user.length()) & mask;
+    for(uint32_t probes = 0; probes < store->slotCount && store->slots[i].name[0] != 0; probes++)
+    {
+        if(strncmp(store->slots[i].name, user.c_str(), sizeof store->slots[i].name) == 0) return &store->slots[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+
+// Checks if a user may log in at all
+// Must be called with stateLock held
+bool userExists(const string& user)
+{
+    if(credentials != NULL) return findCredential(credentials, user) != NULL;
+    return permittedClientList.find(user) != permittedClientList.end();
+}
+
+
+// Compares two password hashes. Every byte is compared, so the time taken
+// gives nothing away.
+bool hashesMatch(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char diff = 0;
+    for(int i = 0; i < CREDENTIAL_HASH_SIZE; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+
+// Hashes the password of a new session with a fresh salt
+// Returns false if there is no randomness to be had
+bool makePasswordHash(const string& password, struct passwordHash& out)
+{
+    if(getrandom(out.salt, CREDENTIAL_SALT_SIZE, 0) != CREDENTIAL_SALT_SIZE)
+    {
+        perror("getrandom");
+        return false;
+    }
+    out.iterations = CREDENTIAL_ITERATIONS;
+    hashPassword(password, out.salt, out.iterations, out.hash);
+    return true;
+}
+
+
+// Checks if the password corresponds with the session being attempted to join
+// Takes tens of milliseconds, so only the hashing threads call it
+bool checkSessionPassword(const struct passwordHash& stored, const string& sessionPassword)
+{
+    unsigned char hash[CREDENTIAL_HASH_SIZE];
+    hashPassword(sessionPassword, stored.salt, stored.iterations, hash);
+    return hashesMatch(hash, stored.hash);
+}
+
+
+// Encodes a session password hash as <iterations:4> <salt> <hash>, with the
+// iterations big-endian
+string encodePasswordHash(const struct passwordHash& stored)
+{
+    uint32_t iterations = htonl(stored.iterations);
+    string data((const char*) &iterations, 4);
+    data.append((const char*) stored.salt, CREDENTIAL_SALT_SIZE);
+    data.append((const char*) stored.hash, CREDENTIAL_HASH_SIZE);
+    return data;
+}
+
+
+// Decodes a session password hash encoded by encodePasswordHash()
+// Returns false if it isn't one
+bool decodePasswordHash(const string& data, struct passwordHash& out)
+{
+    if(data.length() != PASSWORD_HASH_SIZE) return false;
+    
+    memcpy(&out.iterations, data.data(), 4);
+    out.iterations = ntohl(out.iterations);
+    memcpy(out.salt, data.data() + 4, CREDENTIAL_SALT_SIZE);
+    memcpy(out.hash, data.data() + 4 + CREDENTIAL_SALT_SIZE, CREDENTIAL_HASH_SIZE);
+    return out.iterations > 0;
+}
+
+
+// Computes the digest that marks a password as matching a stored hash
+void verifiedDigest(const unsigned char *hash, const string& password,
+                    unsigned char digest[CREDENTIAL_HASH_SIZE])
+{
+    struct sha256 c;
+    sha256Init(&c);
+    sha256Update(&c, verifiedKey, sizeof verifiedKey);
+    sha256Update(&c, hash, CREDENTIAL_HASH_SIZE);
+    sha256Update(&c, password.data(), password.length());
+    sha256Final(&c, digest);
+}
+
+
+// Checks if a user logged in with a password lately, so it needn't be
+// hashed again
+bool isVerified(const string& user, const unsigned char *hash, const string& password)
+{
+    unsigned char digest[CREDENTIAL_HASH_SIZE];
+    verifiedDigest(hash, password, digest);
+    
+    pthread_mutex_lock(&verifiedLock);
+    auto it = verifiedLogins.find(user);
+    bool verified = it != verifiedLogins.end() && it->second.expiry > monotonicMillis() &&
+                    hashesMatch(it->second.digest, digest);
+    pthread_mutex_unlock(&verifiedLock);
+    return verified;
+}
+
+
+// Remembers for VERIFIED_TTL that a password matched a stored hash
+void rememberVerified(const string& user, const unsigned char *hash, const string& password)
+{
+    struct verifiedLogin login;
+    verifiedDigest(hash, password, login.digest);
+    login.expiry = monotonicMillis() + VERIFIED_TTL * 1000;
+    
+    pthread_mutex_lock(&verifiedLock);
+    
+    // Expired entries make room first, and everyone if that isn't enough
+    if(verifiedLogins.size() >= VERIFIED_CACHE_MAX)
+    {
+        unsigned long now = monotonicMillis();
+        for(auto it = verifiedLogins.begin(); it != verifiedLogins.end(); )
+        {
+            if(it->second.expiry <= now) it = verifiedLogins.erase(it);
+            else ++it;
+        }
+        if(verifiedLogins.size() >= VERIFIED_CACHE_MAX) verifiedLogins.clear();
+    }
+    verifiedLogins[user] = login;
+    
+    pthread_mutex_unlock(&verifiedLock);
+}
+
+
+// Checks the password of a user who exists. Passwords in a credential file
+// are never hashed here: the caller checked them before taking stateLock,
+// through the verified logins or the hashing threads, and says if they matched.
+// Must be called with stateLock held
+bool passwordMatches(const string& user, const string& password, bool checked)
+{
+    if(credentials == NULL) return password == permittedClientList.find(user)->second;
+    return checked;
+}
+
+
+// Writes a credential file for the users in a text file, one
+// "<username> <password>" per line. The file is written next to its final
+// path and renamed over it, so a running server never maps half of it.
+// Returns the exit status of the server
+int writeCredentials(const string& listPath, const string& path)
+{
+    ifstream list(listPath.c_str());
+    if(!list)
+    {
+        perror(listPath.c_str());
+        return 1;
+    }
+    
+    vector<pair<string, string>> users;
+    string line, user, password;
+    while(getline(list, line))
+    {
+        istringstream fields(line);
+        if(!(fields >> user)) continue;
+        if(!(fields >> password) || user.length() > MAX_USERNAME)
+        {
+            fprintf(stderr, "server: can't add '%s', usernames have up to %d characters and need a password\n",
+                    line.c_str(), MAX_USERNAME);
+            return 1;
+        }
+        users.push_back(make_pair(user, password));
+    }
+    
+    // At most half the slots are taken, so probe sequences stay short
+    uint32_t slotCount = 16;
+    while(slotCount < users.size() * 2) slotCount *= 2;
+    vector<struct credentialSlot> slots(slotCount);
+    memset(slots.data(), 0, slotCount * sizeof(struct credentialSlot));
+    
+    for(auto const & entry : users)
+    {
+        uint32_t i = checksum(entry.first.data(), entry.first.length()) & (slotCount - 1);
+        while(slots[i].name[0] != 0)
+        {
+            if(entry.first == slots[i].name)
+            {
+                fprintf(stderr, "server: '%s' is listed twice\n", entry.first.c_str());
+                return 1;
+            }
+            i = (i + 1) & (slotCount - 1);
+        }
+    
+        memcpy(slots[i].name, entry.first.data(), entry.first.length());
+        if(getrandom(slots[i].salt, CREDENTIAL_SALT_SIZE, 0) != CREDENTIAL_SALT_SIZE)
+        {
+            perror("getrandom");
+            return 1;
+        }
+        hashPassword(entry.second, slots[i].salt, CREDENTIAL_ITERATIONS, slots[i].hash);
+    }
+    
+    uint32_t header[3] = {htonl(CREDENTIAL_ITERATIONS), htonl(slotCount), htonl(users.size())};
+    string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool written = fd != -1 &&
+                   write(fd, CREDENTIAL_MAGIC, 4) == 4 &&
+                   write(fd, header, sizeof header) == sizeof header &&
+                   write(fd, slots.data(), slotCount * sizeof(struct credentialSlot)) ==
+                       (ssize_t) (slotCount * sizeof(struct credentialSlot)) &&
+                   fsync(fd) == 0;
+    if(fd != -1) close(fd);
+    if(!written || rename(temp.c_str(), path.c_str()) == -1)
+    {
+        perror(path.c_str());
+        unlink(temp.c_str());
+        return 1;
+    }
+    
+    printf("server: wrote %zu users to %s\n", users.size(), path.c_str());
+    return 0;
+}
+
+
+// Maps the credential file again, after it was replaced. Lookups hold
+// stateLock, so nobody uses the old mapping once the new one is swapped in.
+void reloadCredentials()
+{
+    struct credentialStore *store = mapCredentials(credentialPath);
+    if(store == NULL)
+    {
+        logEvent(LEVEL_WARN, "server: keeping the credentials loaded before");
+        return;
+    }
+    
+    pthread_rwlock_wrlock(&stateLock);
+    struct credentialStore *old = credentials;
+    credentials = store;
+    credentialGeneration++;
+    pthread_rwlock_unlock(&stateLock);
+    
+    munmap(old->base, old->length);
+    delete old;
+    logEvent(LEVEL_INFO, "server: reloaded %u users from %s", store->userCount, credentialPath.c_str());
+}
+
+
+// Asks a worker thread to reload the credential file
+void requestReload(int signum)
+{
+    uint64_t one = 1;
+    reloadRequested.store(true);
+    if(write(shards[0]->wakefd, &one, sizeof one) == -1) {} // Nothing to do about it here
+}
+
+
+// Checks if the user can login to the server
+// If not, string returned is reason for error
+pair<bool, string> canUserConnect(const string& userID, const string& password, bool checked)
+{
+    // Checks if the user is on the list of permitted clients
+    if(userExists(userID))
+    {
+        // Checks if the user is already logged in 
+        if(usernameList.find(findName(userID)) != NULL)
+        {
+            return make_pair(false, "User is already logged in!");
+        }
+        
+        // Check if password is correct
+        if(!passwordMatches(userID, password, checked))
+        {
+            return make_pair(false, "Password is incorrect!");
+        }
+        return make_pair(true, ACK_DATA); 
+    }
+    return make_pair(false, "Username does not exist!");
+}
+
+
+// Refuses a login, telling the client why
+// Returns false, for the caller to pass on
+bool refuseLogin(struct connection *conn, const string& reason)
+{
+    struct message& nak = serverMessage();
+    nak.type = LO_NAK;
+    nak.data = reason;
+    nak.size = nak.data.length() + 1;
+    
+    sendToClient(&nak, conn->sockfd);
+    return false;
+}
+
+
+// Lets a client in once its password is known to be right, or cheap to
+// check. checked tells if a password from the credential file matched, in
+// the given generation of it. A match against credentials reloaded since
+// doesn't count. Clients asking for version 2 get their LO_ACK in the
+// framing they logged in with and use binary frames from then on.
+// Returns true if successful
+bool admitClient(struct connection *conn, const string& user, const string& password,
+                 bool checked, unsigned long generation, const string& version,
+                 enum framing loginFormat)
+{
+    int sockfd = conn->sockfd;
+    
+    // Check if user is permitted to connect to the server and claim the
+    // username in one step, so two workers can't log in the same user. The
+    // framing switches before other workers can send to the client.
+    pthread_rwlock_wrlock(&stateLock);
+    checked = checked && generation == credentialGeneration;
+    pair<bool, string> userConnectReq = canUserConnect(user, password, checked);
+    if(userConnectReq.first == true)
+    {
+        conn->userID = internSource(user);
+        usernameList.insert(conn->userID, sockfd);
+        if(version == PROTOCOL_VERSION && conn->format == FRAMING_LENGTH) conn->format = FRAMING_BINARY;
+    }
+    pthread_rwlock_unlock(&stateLock);
+    
+    // Send back reason for error
+    if (userConnectReq.first == false) return refuseLogin(conn, userConnectReq.second);
+    
+    // No data sent back, unless the client switched to binary frames
+    struct message& ack = serverMessage();
+    ack.type = LO_ACK;
+    ack.data = ACK_DATA;
+    if(conn->format == FRAMING_BINARY)
+    {
+        ack.data = PROTOCOL_VERSION;
+        ack.size = ack.data.length() + 1;
+    }
+    
+    struct frame *f = encodeFrame(&ack, loginFormat);
+    transmit(conn, f);
+    releaseFrame(f);
+    
+    // Followed by the session the user was in before a restart and the
+    // direct messages sent while the user was away
+    rejoinSession(conn);
+    deliverInbox(conn);
+    return true;
+}
+
+
+// Hands a password check to the hashing threads
+// Returns false if too many are waiting already
+bool queuePasswordJob(struct passwordJob *job)
+{
+    pthread_mutex_lock(&hashLock);
+    bool queued = hashQueue.size() < HASH_QUEUE_MAX;
+    if(queued)
+    {
+        hashQueue.push_back(job);
+        pthread_cond_signal(&hashCond);
+    }
+    pthread_mutex_unlock(&hashLock);
+    return queued;
+}
+
+
+// Logs a client into the server, using the first packet it sent. The data
+// of a LOGIN is the password, optionally followed by the protocol version
+// the client speaks. A password that has to be hashed is checked by the
+// hashing threads, and the client is paused in VERIFYING until they are
+// done, so the worker goes on with the other clients meanwhile.
+// Returns true if successful, or false with the client still in VERIFYING
+// if the check was handed off
+bool loginClient(struct connection *conn, const char *buffer, size_t len)
+{
+    struct message& loginInfo = conn->owner->packet;
+    if(!messageFromPacket(buffer, len, loginInfo) || loginInfo.type != LOGIN)
+    {
+        return refuseLogin(conn, "Please login first!");
+    }
+    
+    string password = loginInfo.data, version;
+    size_t space = password.find(' ');
+    if(space != string::npos)
+    {
+        version = password.substr(space + 1);
+        password.erase(space);
+    }
+    
+    // Users who logged in with the same password lately don't need the hash
+    struct passwordJob *job = NULL;
+    bool verified = false;
+    pthread_rwlock_rdlock(&stateLock);
+    unsigned long generation = credentialGeneration;
+    const struct credentialSlot *slot = credentials != NULL ? findCredential(credentials, loginInfo.source) : NULL;
+    if(slot != NULL) verified = isVerified(loginInfo.source, slot->hash, password);
+    if(slot != NULL && usernameList.find(findName(loginInfo.source)) == NULL && !verified)
+    {
+        job = new passwordJob;
+        job->home = conn->owner;
+        job->sockfd = conn->sockfd;
+        job->id = conn->id;
+        job->format = conn->format;
+        job->user = loginInfo.source;
+        job->password = password;
+        job->version = version;
+        job->generation = generation;
+        job->stored.iterations = credentials->iterations;
+        memcpy(job->stored.salt, slot->salt, sizeof job->stored.salt);
+        memcpy(job->stored.hash, slot->hash, sizeof job->stored.hash);
+    }
+    pthread_rwlock_unlock(&stateLock);
+    
+    if(job == NULL) return admitClient(conn, loginInfo.source, password, verified, generation, version, conn->format);
+    
+    if(!queuePasswordJob(job))
+    {
+        delete job;
+        return refuseLogin(conn, "Server is busy, try again later!");
+    }
+    conn->state = VERIFYING;
+    adjustPause(conn, 1);
+    return false;
+}
+
+
+// Moves a client whose login is over on to the command dispatch, or drops it
+void concludeLogin(struct connection *conn, bool admitted)
+{
+    if(admitted)
+    {
+        conn->state = ACTIVE;
+        logEvent(LEVEL_INFO, "server: socket %d logged in", conn->sockfd);
+    }
+    else
+    {
+        logEvent(LEVEL_INFO, "Attempted connection failed");
+        dropConnection(conn);
+    }
+}
+
+
+// Finishes a login whose password the hashing threads checked, if the
+// client is still there
+void finishCheckedLogin(struct passwordJob *job)
+{
+    // A client that hung up meanwhile may have had its socket reused.
+    // A password checked against credentials a reload replaced since is
+    // checked again, against the user's new hash if there still is one.
+    pthread_rwlock_rdlock(&stateLock);
+    struct connection *conn = connTable[job->sockfd];
+    const struct credentialSlot *slot = NULL;
+    if(job->generation != credentialGeneration) slot = findCredential(credentials, job->user);
+    if(slot != NULL)
+    {
+        job->generation = credentialGeneration;
+        job->stored.iterations = credentials->iterations;
+        memcpy(job->stored.salt, slot->salt, sizeof job->stored.salt);
+        memcpy(job->stored.hash, slot->hash, sizeof job->stored.hash);
+    }
+    pthread_rwlock_unlock(&stateLock);
+    
+    if(conn != NULL && conn->id == job->id && conn->state == VERIFYING)
+    {
+        if(slot != NULL && queuePasswordJob(job)) return;
+        
+        currentSender.sockfd = conn->sockfd;
+        currentSender.id = conn->id;
+        currentSender.owner = conn->owner;
+        
+        conn->state = HANDSHAKE;
+        adjustPause(conn, -1);
+        if(slot != NULL) concludeLogin(conn, refuseLogin(conn, "Server is busy, try again later!"));
+        else concludeLogin(conn, job->matches ?
+                           admitClient(conn, job->user, job->password, true, job->generation,
+                                       job->version, job->format) :
+                           refuseLogin(conn, "Password is incorrect!"));
+        
+        currentSender.owner = NULL;
+    }
+    delete job;
+}
+
+
+// Finishes the logins, session creations and joins whose passwords the
+// hashing threads checked
+void finishCheckedJobs(struct shard *s)
+{
+    vector<struct passwordJob*> checked;
+    pthread_mutex_lock(&s->jobLock);
+    checked.swap(s->checkedJobs);
+    pthread_mutex_unlock(&s->jobLock);
+    
+    for(auto const & job : checked)
+    {
+        if(job->check == CHECK_LOGIN)
+        {
+            finishCheckedLogin(job);
+            continue;
+        }
+        
+        // A join that replays history may intern the names in it
+        bool exclusive = job->check == CHECK_NEW_SESSION || !logDirectory.empty();
+        if(exclusive)
+        {
+            pthread_rwlock_wrlock(&stateLock);
+            snapshotIfDue();
+        }
+        else pthread_rwlock_rdlock(&stateLock);
+        currentSender.sockfd = job->sockfd;
+        currentSender.id = job->id;
+        currentSender.owner = s;
+        bool requeued = false;
+        if(job->check == CHECK_NEW_SESSION) finishNewSession(job);
+        else requeued = finishJoin(job);
+        currentSender.owner = NULL;
+        pthread_rwlock_unlock(&stateLock);
+        if(!requeued) delete job;
+    }
+}
+
+
+// Hashes the password of a new session. A logged session takes the hash its
+// log keeps, once the password matches it, since the salt and hash of an
+// opened log never change.
+void hashNewSession(struct passwordJob *job)
+{
+    job->matches = true;
+    job->log = NULL;
+    if(!logDirectory.empty())
+    {
+        pthread_rwlock_rdlock(&stateLock);
+        uint32_t id = findName(job->user);
+        pthread_rwlock_unlock(&stateLock);
+        
+        bool checked;
+        job->matches = openSessionLog(id, job->password, NULL, job->log, checked);
+        if(job->log != NULL && !checked) job->matches = checkSessionPassword(job->log->password, job->password);
+    }
+    if(job->log != NULL) job->stored = job->log->password;
+    else if(job->matches) job->matches = makePasswordHash(job->password, job->stored);
+}
+
+
+// Runs one of the threads checking passwords against the credential file
+// and the sessions, at a lower priority than the workers so a burst
+// of logins doesn't hold up chat. A login password that matches is
+// remembered, so the worker it goes back to lets the user in without
+// hashing it again.
+void runHasher()
+{
+    if(setpriority(PRIO_PROCESS, syscall(SYS_gettid), HASH_NICE) == -1) perror("setpriority");
+    
+    while(1)
+    {
+        pthread_mutex_lock(&hashLock);
+        while(hashQueue.empty()) pthread_cond_wait(&hashCond, &hashLock);
+        struct passwordJob *job = hashQueue.front();
+        hashQueue.pop_front();
+        pthread_mutex_unlock(&hashLock);
+        
+        if(job->check == CHECK_NEW_SESSION) hashNewSession(job);
+        else if(job->check == CHECK_JOIN) job->matches = checkSessionPassword(job->stored, job->password);
+        else
+        {
+            unsigned char hash[CREDENTIAL_HASH_SIZE];
+            hashPassword(job->password, job->stored.salt, job->stored.iterations, hash);
+            job->matches = hashesMatch(hash, job->stored.hash);
+            if(job->matches) rememberVerified(job->user, job->stored.hash, job->password);
+        }
+        
+        // Only the first job handed back since the worker last woke up signals it
+        struct shard *home = job->home;
+        pthread_mutex_lock(&home->jobLock);
+        home->checkedJobs.push_back(job);
+        pthread_mutex_unlock(&home->jobLock);
+        if(!home->wakePending.exchange(true, memory_order_acq_rel))
+        {
+            uint64_t one = 1;
+            if(write(home->wakefd, &one, sizeof one) == -1) perror("write");
+        }
+    }
+}
+
+// Header fields of a record in a session log, see appendToLog()
+struct logRecord {
+    unsigned int type;
+    unsigned int flags;
+    size_t sourceLen;  // Length of the source name in the text packet
+    size_t dataOffset; // Offset of the data in the text packet
+    size_t textLen;    // Length of the text packet
+    size_t length;     // Bytes of the whole record
+};
+
+
+// Adds a holder to a log segment
+void holdSegment(struct logSegment *segment)
+{
+    segment->refs.fetch_add(1, memory_order_relaxed);
+}
+
+
+// Removes a holder from a log segment, unmapping it once there is none
+void releaseSegment(struct logSegment *segment)
+{
+    if(segment->refs.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    
+    munmap(segment->base, LOG_SEGMENT_SIZE);
+    delete segment;
+}
+
+
+// Returns a name as it is used in file names. Bytes other than letters,
+// digits, '-' and '_' are escaped as %XX, so no name leads out of the
+// directory its file is in.
+string escapeName(const string& name)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    string escaped;
+    for(unsigned char c : name)
+    {
+        if(isalnum(c) || c == '-' || c == '_') escaped += c;
+        else
+        {
+            escaped += '%';
+            escaped += hex[c >> 4];
+            escaped += hex[c & 15];
+        }
+    }
+    return escaped;
+}
+
+
+// Maps a segment file, creating it first if asked to. New segments get all
+// their blocks up front, so writing through the mapping can't run out of space.
+// Returns NULL on error
+struct logSegment *mapSegment(const string& path, bool create)
+{
+    int fd = open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if(fd == -1)
+    {
+        perror("open");
+        return NULL;
+    }
+    
+    struct stat st;
+    void *base = MAP_FAILED;
+    if((!create || posix_fallocate(fd, 0, LOG_SEGMENT_SIZE) == 0) &&
+       fstat(fd, &st) == 0 && st.st_size == LOG_SEGMENT_SIZE)
+    {
+        base = mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    
+    if(base == MAP_FAILED)
+    {
+        fprintf(stderr, "server: can't map log segment %s\n", path.c_str());
+        if(create) unlink(path.c_str());
+        return NULL;
+    }
+    
+    struct logSegment *segment = new logSegment;
+    segment->refs.store(1, memory_order_relaxed);
+    segment->base = (char*) base;
+    segment->tail = 0;
+    segment->committed = 0;
+    segment->path = path;
+    return segment;
+}
+
+
+// Reads the header of the record at an offset of a segment
+// Returns false if there is no complete record there, which is where the
+// records of the segment end
+bool readRecord(const struct logSegment *segment, size_t offset, struct logRecord& rec)
+{
+    if(offset + LOG_RECORD_HEADER + 1 > LOG_SEGMENT_SIZE) return false;
+    
+    const char *p = segment->base + offset;
+    uint16_t fields[4];
+    uint32_t textLen;
+    memcpy(fields, p, 8);
+    memcpy(&textLen, p + 8, 4);
+    
+    rec.type = ntohs(fields[0]);
+    rec.flags = ntohs(fields[1]);
+    rec.sourceLen = ntohs(fields[2]);
+    rec.dataOffset = ntohs(fields[3]);
+    rec.textLen = ntohl(textLen);
+    rec.length = LOG_RECORD_HEADER + rec.textLen + 1;
+    
+    return rec.textLen > 0 && rec.textLen < MAXDATASIZE && rec.sourceLen < rec.dataOffset &&
+           rec.dataOffset <= rec.textLen && offset + rec.length <= LOG_SEGMENT_SIZE &&
+           p[LOG_RECORD_HEADER + rec.textLen] == '\0';
+}
+
+
+// Starts a new segment at the end of a log. That is the spare the committer
+// mapped ahead if there is one, so appends only wait for a segment file to be
+// created when they outrun the committer. Once there are more than
+// LOG_SEGMENTS_KEPT, the oldest is deleted, and unmapped when the last frame
+// pointing into it is sent.
+// Must be called with the log's lock held
+// Returns NULL on error
+struct logSegment *addSegment(struct sessionLog *log)
+{
+    struct logSegment *segment = log->spare;
+    log->spare = NULL;
+    if(segment == NULL)
+    {
+        char file[32];
+        snprintf(file, sizeof file, "/%016lx.log", log->nextSegment);
+        segment = mapSegment(log->directory + file, true);
+        if(segment == NULL) return NULL;
+        log->nextSegment++;
+    }
+    log->segments.push_back(segment);
+    
+    if(log->segments.size() > LOG_SEGMENTS_KEPT)
+    {
+        struct logSegment *oldest = log->segments.front();
+        log->segments.pop_front();
+        while(!log->recent.empty() && log->recent.front().first == oldest) log->recent.pop_front();
+        
+        unlink(oldest->path.c_str());
+        releaseSegment(oldest);
+    }
+    return segment;
+}
+
+
+// Loads the segments a log has on disk, finding where its records end and
+// where its last messages start
+// Must be called before the log is shared
+void loadSegments(struct sessionLog *log)
+{
+    vector<unsigned long> numbers;
+    DIR *dir = opendir(log->directory.c_str());
+    for(struct dirent *entry; dir != NULL && (entry = readdir(dir)) != NULL; )
+    {
+        char *end;
+        unsigned long number = strtoul(entry->d_name, &end, 16);
+        if(end != entry->d_name && strcmp(end, ".log") == 0) numbers.push_back(number);
+    }
+    if(dir != NULL) closedir(dir);
+    sort(numbers.begin(), numbers.end());
+    
+    for(auto const & number : numbers)
+    {
+        char file[32];
+        snprintf(file, sizeof file, "/%016lx.log", number);
+        struct logSegment *segment = mapSegment(log->directory + file, false);
+        log->nextSegment = number + 1;
+        if(segment == NULL) continue;
+        
+        struct logRecord rec;
+        while(readRecord(segment, segment->tail, rec))
+        {
+            if(!(rec.flags & FLAG_CONTINUED))
+            {
+                log->recent.push_back(make_pair(segment, segment->tail));
+                if(log->recent.size() > replayCount) log->recent.pop_front();
+            }
+            segment->tail += rec.length;
+        }
+        segment->committed = segment->tail;
+        
+        // A record torn by a crash is wiped, so no record appended in its
+        // place is followed by a remnant of it. Fewer bytes than a header
+        // at the end of a segment never held one.
+        size_t torn = min((size_t) LOG_RECORD_HEADER + MAXDATASIZE + 1, LOG_SEGMENT_SIZE - segment->tail);
+        char *p = segment->base + segment->tail;
+        if(torn >= LOG_RECORD_HEADER && (p[8] | p[9] | p[10] | p[11]) != 0) memset(p, 0, torn);
+        
+        // A newest segment without records is the spare mapped before a restart
+        if(segment->tail == 0 && number == numbers.back())
+        {
+            log->spare = segment;
+            continue;
+        }
+        
+        // Only the newest segments are kept
+        log->segments.push_back(segment);
+        if(log->segments.size() > LOG_SEGMENTS_KEPT)
+        {
+            struct logSegment *oldest = log->segments.front();
+            log->segments.pop_front();
+            while(!log->recent.empty() && log->recent.front().first == oldest) log->recent.pop_front();
+            unlink(oldest->path.c_str());
+            releaseSegment(oldest);
+        }
+    }
+}
+
+
+// Writes the password file of a session log, "CHP1" followed by the hash
+// of its password as encodePasswordHash() puts it. The file is written next
+// to its final path and renamed over it.
+// Returns false on error
+bool writeLogPassword(const string& path, const struct passwordHash& stored)
+{
+    string data = LOG_PASSWORD_MAGIC + encodePasswordHash(stored);
+    string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool written = fd != -1 && write(fd, data.data(), data.length()) == (ssize_t) data.length();
+    if(fd != -1) close(fd);
+    if(!written || rename(temp.c_str(), path.c_str()) == -1)
+    {
+        perror(path.c_str());
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Loads a session log from its directory, creating both if there are none.
+// The log is created for the given password, or at startup, when only the
+// hash a restored session keeps is known, for restored, which is NULL
+// otherwise. Password files written in plain text by older servers are
+// replaced by a hashed one if the password matches, and checked tells the
+// password was compared already then.
+// Returns false if the password doesn't match a plain-text file. Otherwise
+// log is the loaded log, NULL if it can't be loaded.
+bool loadSessionLog(const string& directory, const string& password, const struct passwordHash *restored,
+                    struct sessionLog *&log, bool& checked)
+{
+    log = NULL;
+    checked = false;
+    if(mkdir(directory.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        perror("mkdir");
+        return true;
+    }
+    
+    struct sessionLog *loaded = new sessionLog;
+    string passwordFile = directory + "/password";
+    ifstream in(passwordFile, ios::binary);
+    string stored((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    
+    bool hashed = stored.compare(0, 4, LOG_PASSWORD_MAGIC) == 0 &&
+                  decodePasswordHash(stored.substr(4), loaded->password);
+    if(!hashed && !in.is_open() && restored != NULL)
+    {
+        // Logged since the session was created
+        loaded->password = *restored;
+    }
+    else if(!hashed)
+    {
+        // The password is written when the log is created
+        string plain = in.is_open() ? stored.substr(0, stored.find('\n')) : password;
+        bool matches = restored != NULL ? checkSessionPassword(*restored, plain) : plain == password;
+        checked = true;
+        if(!matches || !makePasswordHash(plain, loaded->password))
+        {
+            delete loaded;
+            return !matches;
+        }
+    }
+    if(!hashed && !writeLogPassword(passwordFile, loaded->password))
+    {
+        delete loaded;
+        return true;
+    }
+    
+    log = loaded;
+    pthread_mutex_init(&log->lock, NULL);
+    log->directory = directory;
+    log->nextSegment = 1;
+    log->spare = NULL;
+    log->dirty = false;
+    loadSegments(log);
+    return true;
+}
+
+
+// Opens the log of a session, loading the history it has on disk, or finds
+// it open already. A log keeps a salted hash of the password its session was
+// first created with, and only opens for the same one, which the caller
+// checks against it unless checked tells it was compared already. Logs are
+// loaded without stateLock, which is only taken to look the log up and to
+// add it to sessionLogs, so no worker waits for the disk.
+// Runs on the hashing threads, and before them at startup with the hash of
+// a restored session in restored, see loadSessionLog()
+// Returns false if the password is wrong. Otherwise log is the session's
+// log, NULL if it can't be opened.
+bool openSessionLog(uint32_t id, const string& password, const struct passwordHash *restored,
+                    struct sessionLog *&log, bool& checked)
+{
+    // One thread at a time loads logs, so none is loaded twice
+    pthread_mutex_lock(&logOpenLock);
+    pthread_rwlock_rdlock(&stateLock);
+    struct sessionLog **opened = sessionLogs.find(id);
+    log = opened == NULL ? NULL : *opened;
+    string directory = logDirectory + "/" + escapeName(nameOf(id));
+    pthread_rwlock_unlock(&stateLock);
+    
+    bool matches = true;
+    checked = false;
+    if(log == NULL)
+    {
+        matches = loadSessionLog(directory, password, restored, log, checked);
+        if(log != NULL)
+        {
+            pthread_rwlock_wrlock(&stateLock);
+            sessionLogs.insert(id, log);
+            pthread_rwlock_unlock(&stateLock);
+            
+            // The committer maps the first segment ahead of the first message
+            if(log->spare == NULL)
+            {
+                pthread_mutex_lock(&log->lock);
+                log->dirty = true;
+                pthread_mutex_unlock(&log->lock);
+                pthread_mutex_lock(&commitLock);
+                dirtyLogs.push_back(log);
+                pthread_cond_signal(&commitCond);
+                pthread_mutex_unlock(&commitLock);
+            }
+        }
+    }
+    pthread_mutex_unlock(&logOpenLock);
+    return matches;
+}
+
+
+// Appends a chat message to a session's log. The record is written into the
+// mapped segment, without a system call, and reaches the disk with the next
+// group commit. Records are laid out as
+//   <type:2> <flags:2> <source length:2> <data offset:2> <text length:4>
+//   <text packet> <NUL>
+// all big-endian, so the length-prefixed and NUL-terminated text framings of
+// the message are both found as they are in the record, and so is the data
+// of a binary frame.
+// Must be called with stateLock held
+void appendToLog(struct sessionLog *log, const struct message *data)
+{
+    size_t textLen = textLength(data);
+    size_t length = LOG_RECORD_HEADER + textLen + 1;
+    
+    pthread_mutex_lock(&log->lock);
+    
+    struct logSegment *segment = log->segments.empty() ? NULL : log->segments.back();
+    if(segment == NULL || segment->tail + length > LOG_SEGMENT_SIZE) segment = addSegment(log);
+    if(segment == NULL)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+    
+    char *p = segment->base + segment->tail;
+    uint16_t fields[] = {htons(data->type), htons(data->flags), htons(data->source.length()),
+                         htons(textLen - data->data.length())};
+    uint32_t length32 = htonl(textLen);
+    memcpy(p, fields, 8);
+    memcpy(p + 8, &length32, 4);
+    writeText(data, p + LOG_RECORD_HEADER);
+    p[LOG_RECORD_HEADER + textLen] = '\0';
+    
+    // Replays start at the first fragment of a message
+    if(!(data->flags & FLAG_CONTINUED))
+    {
+        log->recent.push_back(make_pair(segment, segment->tail));
+        if(log->recent.size() > replayCount) log->recent.pop_front();
+    }
+    segment->tail += length;
+    
+    // The committer picks up every record appended until it gets to the log
+    if(!log->dirty)
+    {
+        log->dirty = true;
+        pthread_mutex_lock(&commitLock);
+        dirtyLogs.push_back(log);
+        pthread_cond_signal(&commitCond);
+        pthread_mutex_unlock(&commitLock);
+    }
+    
+    pthread_mutex_unlock(&log->lock);
+}
+
+
+// Queues a logged message for a client, in frames pointing into the mapped
+// segment, so the record is written to the socket without being copied.
+// Text clients get it as it is in the record. Binary clients get a header
+// frame of their own, followed by the data straight from the record.
+// Must be called with stateLock held for writing by the client's worker
+void replayRecord(struct connection *conn, struct logSegment *segment, size_t offset,
+                  const struct logRecord& rec)
+{
+    char *p = segment->base + offset;
+    struct frame *body = newFrame(0);
+    body->segment = segment;
+    holdSegment(segment);
+    
+    if(conn->format == FRAMING_BINARY)
+    {
+        char *text = p + LOG_RECORD_HEADER;
+        string source(text + rec.dataOffset - 1 - rec.sourceLen, rec.sourceLen);
+        uint32_t sourceID = internSource(source);
+        
+        struct frame *header = newFrame(BINHEADERSIZE);
+        uint32_t length = htonl(rec.textLen - rec.dataOffset);
+        uint16_t fields[] = {htons(rec.type), htons(rec.flags)};
+        uint32_t sourceField = htonl(sourceID);
+        memcpy(header->data, &length, 4);
+        memcpy(header->data + 4, fields, 4);
+        memcpy(header->data + 8, &sourceField, 4);
+        
+        body->data = text + rec.dataOffset;
+        body->len = rec.textLen - rec.dataOffset;
+        body->attached = true;
+        
+        if(deliver(conn, header, sourceID) && body->len > 0) transmit(conn, body);
+        releaseFrame(header);
+    }
+    else
+    {
+        // The NUL terminated packet, or its length and the packet
+        body->data = conn->format == FRAMING_LEGACY ? p + LOG_RECORD_HEADER : p + 8;
+        body->len = conn->format == FRAMING_LEGACY ? rec.textLen + 1 : rec.textLen + 4;
+        transmit(conn, body);
+    }
+    releaseFrame(body);
+}
+
+
+// Sends a client that entered a session the last messages in its log
+// Must be called with stateLock held for writing by the client's worker
+void replayLog(struct sessionLog *log, struct connection *conn)
+{
+    pthread_mutex_lock(&log->lock);
+    
+    if(!log->recent.empty())
+    {
+        size_t offset = log->recent.front().second;
+        size_t i = find(log->segments.begin(), log->segments.end(), log->recent.front().first) -
+                   log->segments.begin();
+        for(; i < log->segments.size(); i++, offset = 0)
+        {
+            struct logSegment *segment = log->segments[i];
+            struct logRecord rec;
+            for(; offset < segment->tail; offset += rec.length)
+            {
+                readRecord(segment, offset, rec);
+                replayRecord(conn, segment, offset, rec);
+            }
+        }
+    }
+    
+    pthread_mutex_unlock(&log->lock);
+}
+
+
+// Writes the records appended to session logs, inboxes and the journal out
+// to disk. The committer sleeps until one gets records, then lets appends
+// pile up for LOG_COMMIT_INTERVAL so one msync() per segment, or fdatasync()
+// per file, commits all of them. It also writes the snapshots.
+void runLogCommitter()
+{
+    vector<struct sessionLog*> logs;
+    vector<struct inbox*> boxes;
+    vector<pair<struct logSegment*, pair<size_t, size_t>>> ranges; // Segment and bytes to commit
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    
+    while(true)
+    {
+        pthread_mutex_lock(&commitLock);
+        while(dirtyLogs.empty() && dirtyInboxes.empty() && !journalDirty && pendingSnapshot == NULL)
+        {
+            pthread_cond_wait(&commitCond, &commitLock);
+        }
+        pthread_mutex_unlock(&commitLock);
+        
+        usleep(LOG_COMMIT_INTERVAL * 1000);
+        
+        // The journal may be replaced by the next one meanwhile
+        pthread_mutex_lock(&commitLock);
+        logs.swap(dirtyLogs);
+        boxes.swap(dirtyInboxes);
+        int journal = journalDirty ? dup(journalFd) : -1;
+        struct snapshotJob *snapshot = pendingSnapshot;
+        journalDirty = false;
+        pendingSnapshot = NULL;
+        pthread_mutex_unlock(&commitLock);
+        
+        if(journal != -1)
+        {
+            if(fdatasync(journal) == -1) perror("fdatasync");
+            close(journal);
+        }
+        if(snapshot != NULL) finishSnapshot(snapshot);
+        
+        // Inboxes are never closed, so their files can be synced unlocked.
+        // One whose records were all sent is emptied first, one that got
+        // new records since keeps the sent ones until those are sent too.
+        for(auto const & box : boxes)
+        {
+            pthread_mutex_lock(&box->lock);
+            box->dirty = false;
+            if(box->delivered > 0 && box->delivered == box->size)
+            {
+                if(ftruncate(box->fd, 0) == -1) perror("ftruncate");
+                box->size = 0;
+                box->delivered = 0;
+            }
+            pthread_mutex_unlock(&box->lock);
+            
+            if(fdatasync(box->fd) == -1) perror("fdatasync");
+        }
+        
+        for(auto const & log : logs)
+        {
+            pthread_mutex_lock(&log->lock);
+            log->dirty = false;
+            for(auto const & segment : log->segments)
+            {
+                if(segment->committed == segment->tail) continue;
+                
+                holdSegment(segment);
+                ranges.push_back(make_pair(segment, make_pair(segment->committed, segment->tail)));
+                segment->committed = segment->tail;
+            }
+            
+            // The next segment is mapped ahead, unlocked, so appends only
+            // have to swap it in
+            unsigned long number = log->nextSegment;
+            bool prepare = log->spare == NULL;
+            if(prepare) log->nextSegment++;
+            pthread_mutex_unlock(&log->lock);
+            if(!prepare) continue;
+            
+            char file[32];
+            snprintf(file, sizeof file, "/%016lx.log", number);
+            struct logSegment *spare = mapSegment(log->directory + file, true);
+            if(spare == NULL) continue;
+            
+            // An append that couldn't wait for it mapped a newer segment itself
+            pthread_mutex_lock(&log->lock);
+            bool current = log->nextSegment == number + 1;
+            if(current) log->spare = spare;
+            pthread_mutex_unlock(&log->lock);
+            if(!current)
+            {
+                unlink(spare->path.c_str());
+                releaseSegment(spare);
+            }
+        }
+        
+        for(auto const & range : ranges)
+        {
+            size_t start = range.second.first & ~(pageSize - 1);
+            if(msync(range.first->base + start, range.second.second - start, MS_SYNC) == -1)
+            {
+                perror("msync");
+            }
+            releaseSegment(range.first);
+        }
+        logs.clear();
+        boxes.clear();
+        ranges.clear();
+    }
+}
+
+
+// Opens the inbox of a permitted user, dropping a record torn by a crash
+// from the end of the file
+// Returns NULL if it can't be opened, or doesn't exist and isn't created
+struct inbox *openInbox(const string& user, bool create)
+{
+    string path = inboxDirectory + "/" + escapeName(user) + ".inbox";
+    int fd = open(path.c_str(), O_RDWR | O_APPEND | (create ? O_CREAT : 0), 0600);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        if(fd != -1 || errno != ENOENT) perror("inbox");
+        if(fd != -1) close(fd);
+        return NULL;
+    }
+    
+    // Only whole records count
+    size_t size = 0;
+    if(st.st_size > 0)
+    {
+        char *p = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        while(p != MAP_FAILED && size + INBOX_RECORD_HEADER <= (size_t) st.st_size)
+        {
+            uint32_t length;
+            memcpy(&length, p + size, 4);
+            size_t end = size + INBOX_RECORD_HEADER + (unsigned char) p[size + 6] + ntohl(length);
+            if(end > (size_t) st.st_size) break;
+            size = end;
+        }
+        if(p != MAP_FAILED) munmap(p, st.st_size);
+        if(size < (size_t) st.st_size && ftruncate(fd, size) == -1) perror("ftruncate");
+    }
+    
+    struct inbox *box = new inbox;
+    pthread_mutex_init(&box->lock, NULL);
+    box->fd = fd;
+    box->size = size;
+    box->delivered = 0;
+    box->dirty = false;
+    return box;
+}
+
+
+// Returns the inbox of a permitted user, opening it the first time, NULL if
+// inboxes are off or it doesn't exist and isn't created
+struct inbox *inboxOf(const string& user, bool create)
+{
+    if(inboxDirectory.empty()) return NULL;
+    
+    pthread_mutex_lock(&inboxLock);
+    auto it = inboxes.find(user);
+    struct inbox *box = it != inboxes.end() ? it->second : openInbox(user, create);
+    if(it == inboxes.end() && box != NULL) inboxes[user] = box;
+    pthread_mutex_unlock(&inboxLock);
+    return box;
+}
+
+
+// Queues an inbox for the committer, unless it is queued already
+// Must be called with the inbox's lock held
+void commitInbox(struct inbox *box)
+{
+    if(box->dirty) return;
+    
+    box->dirty = true;
+    pthread_mutex_lock(&commitLock);
+    dirtyInboxes.push_back(box);
+    pthread_cond_signal(&commitCond);
+    pthread_mutex_unlock(&commitLock);
+}
+
+
+// Appends a direct message for a user who isn't logged in to their inbox,
+// with one write(). It reaches the disk with the next group commit.
+// Must be called with stateLock held
+// Returns false if the message doesn't fit in the inbox
+bool appendToInbox(struct inbox *box, const struct message *data)
+{
+    if(!messageFits(data)) return false;
+    
+    size_t length = INBOX_RECORD_HEADER + data->source.length() + data->data.length();
+    char *record = (char*) arenaAlloc(length);
+    uint32_t dataLen = htonl(data->data.length());
+    uint16_t flags = htons(data->flags);
+    memcpy(record, &dataLen, 4);
+    memcpy(record + 4, &flags, 2);
+    record[6] = data->source.length();
+    memcpy(record + INBOX_RECORD_HEADER, data->source.data(), data->source.length());
+    memcpy(record + INBOX_RECORD_HEADER + data->source.length(), data->data.data(), data->data.length());
+    
+    pthread_mutex_lock(&box->lock);
+    
+    // The burst a user gets at login has to stay clear of the slow consumer policy
+    bool appended = box->size - box->delivered + length <= highWatermark / 2;
+    if(appended && write(box->fd, record, length) != (ssize_t) length)
+    {
+        perror("inbox");
+        if(ftruncate(box->fd, box->size) == -1) perror("ftruncate");
+        appended = false;
+    }
+    if(appended)
+    {
+        box->size += length;
+        commitInbox(box);
+    }
+    
+    pthread_mutex_unlock(&box->lock);
+    return appended;
+}
+
+
+// Sends a client that just logged in the direct messages that waited in its
+// inbox, all queued at once so they go out together at the end of the loop
+// iteration, and leaves emptying the inbox to the committer. The inbox is
+// read and parsed holding only its own lock, and stateLock is held for
+// writing only if a sender's name has to be interned.
+void deliverInbox(struct connection *conn)
+{
+    pthread_rwlock_rdlock(&stateLock);
+    string user = usernameOf(conn);
+    pthread_rwlock_unlock(&stateLock);
+    
+    struct inbox *box = inboxOf(user, false);
+    if(box == NULL) return;
+    
+    // Copied out, so the inbox is unlocked before stateLock is taken
+    string records;
+    pthread_mutex_lock(&box->lock);
+    size_t size = box->size, delivered = box->delivered;
+    char *p = delivered < size ? (char*) mmap(NULL, size, PROT_READ, MAP_SHARED, box->fd, 0) : (char*) MAP_FAILED;
+    if(delivered < size && p == MAP_FAILED) perror("mmap");
+    if(p != MAP_FAILED)
+    {
+        records.assign(p + delivered, size - delivered);
+        munmap(p, size);
+        box->delivered = size;
+        commitInbox(box);
+    }
+    pthread_mutex_unlock(&box->lock);
+    if(records.empty()) return;
+    
+    // Senders are interned when they log in, so only those from before a
+    // restart may not be
+    struct message& mail = conn->owner->packet;
+    bool exclusive = false;
+    pthread_rwlock_rdlock(&stateLock);
+    for(size_t offset = 0; offset < records.length() && !exclusive; )
+    {
+        uint32_t dataLen;
+        memcpy(&dataLen, records.data() + offset, 4);
+        size_t sourceLen = (unsigned char) records[offset + 6];
+        mail.source.assign(records, offset + INBOX_RECORD_HEADER, sourceLen);
+        uint32_t id = findName(mail.source);
+        exclusive = id == 0 || names[id].second == NULL;
+        offset += INBOX_RECORD_HEADER + sourceLen + ntohl(dataLen);
+    }
+    if(exclusive)
+    {
+        pthread_rwlock_unlock(&stateLock);
+        pthread_rwlock_wrlock(&stateLock);
+    }
+    
+    // The packet was handled already, its buffers carry the queued messages
+    size_t count = 0;
+    for(size_t offset = 0; offset < records.length(); count++)
+    {
+        uint32_t dataLen;
+        uint16_t flags;
+        memcpy(&dataLen, records.data() + offset, 4);
+        memcpy(&flags, records.data() + offset + 4, 2);
+        size_t sourceLen = (unsigned char) records[offset + 6];
+        
+        mail.type = DIRMESSAGE;
+        mail.flags = ntohs(flags);
+        mail.source.assign(records, offset + INBOX_RECORD_HEADER, sourceLen);
+        mail.sourceID = exclusive ? internSource(mail.source) : findName(mail.source);
+        mail.data.assign(records, offset + INBOX_RECORD_HEADER + sourceLen, ntohl(dataLen));
+        mail.size = mail.data.length() + 1;
+        
+        struct frame *f = encodeFrame(&mail, conn->format);
+        deliver(conn, f, conn->format == FRAMING_BINARY ? mail.sourceID : 0);
+        releaseFrame(f);
+        
+        offset += INBOX_RECORD_HEADER + sourceLen + mail.data.length();
+    }
+    pthread_rwlock_unlock(&stateLock);
+    logEvent(LEVEL_INFO, "server: delivered %zu queued messages to socket %d", count, conn->sockfd);
+}
+
+
+// Returns the FNV-1a hash of some bytes, which detects torn journal records
+// and damaged snapshots
+uint32_t checksum(const char *p, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char) p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// Appends a string to a snapshot, preceded by its length
+void putString(string& out, const string& s)
+{
+    uint16_t len = htons(s.length());
+    out.append((const char*) &len, 2);
+    out.append(s);
+}
+
+
+// Reads a string written by putString()
+// Returns false if it runs past the end
+bool getString(const char *&p, const char *end, string& s)
+{
+    uint16_t len;
+    if(end - p < 2) return false;
+    memcpy(&len, p, 2);
+    len = ntohs(len);
+    if(end - p - 2 < len) return false;
+    
+    s.assign(p + 2, len);
+    p += 2 + len;
+    return true;
+}
+
+
+// Returns the path of the journal of a generation
+string journalPath(unsigned long generation)
+{
+    char file[32];
+    snprintf(file, sizeof file, "/journal.%016lx", generation);
+    return stateDirectory + file;
+}
+
+
+// Opens the journal of a generation for appending
+// Returns -1 on error
+int openJournal(unsigned long generation)
+{
+    int fd = open(journalPath(generation).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if(fd == -1) perror("journal");
+    return fd;
+}
+
+
+// Encodes the session tables, absent members included, as a snapshot that
+// covers every journal before the given generation. A snapshot is
+//   "CHS1" <generation:8> <sessions:4> <members:4>
+//   { <name> <password hash> <members:4> { <username> } } <checksum:4>
+// with the numbers big-endian and every string preceded by its 2 byte length.
+// The password hash is encoded by encodePasswordHash().
+// Must be called with stateLock held for writing
+string serializeState(unsigned long generation)
+{
+    string data(SNAPSHOT_MAGIC, 4);
+    uint64_t gen = htobe64(generation);
+    uint32_t count = htonl(sessionList.count);
+    uint32_t total = 0;
+    data.append((const char*) &gen, 8);
+    data.append((const char*) &count, 4);
+    data.append((const char*) &total, 4);
+    
+    for(auto const & slot : sessionList.slots)
+    {
+        if(slot.first == 0) continue;
+        
+        struct session *session = slot.second;
+        total += session->members.size() + session->absent.size();
+        uint32_t members = htonl(session->members.size() + session->absent.size());
+        putString(data, nameOf(session->id));
+        putString(data, encodePasswordHash(session->password));
+        data.append((const char*) &members, 4);
+        for(auto const & sockfd : session->members) putString(data, usernameOf(connTable[sockfd]));
+        for(auto const & user : session->absent) putString(data, nameOf(user));
+    }
+    total = htonl(total);
+    data.replace(16, 4, (const char*) &total, 4);
+    
+    uint32_t sum = htonl(checksum(data.data(), data.length()));
+    data.append((const char*) &sum, 4);
+    return data;
+}
+
+
+// Writes a snapshot next to the journals, replacing the previous one only
+// once it is on disk, then deletes the journals it covers
+void finishSnapshot(struct snapshotJob *job)
+{
+    // The journal it follows can't get records anymore
+    if(job->journal != -1)
+    {
+        if(fdatasync(job->journal) == -1) perror("fdatasync");
+        close(job->journal);
+    }
+    
+    string path = stateDirectory + "/snapshot";
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool written = fd != -1 && write(fd, job->data.data(), job->data.length()) == (ssize_t) job->data.length() &&
+                   fdatasync(fd) == 0;
+    if(fd != -1) close(fd);
+    if(!written || rename(tmp.c_str(), path.c_str()) == -1)
+    {
+        perror("snapshot");
+        delete job;
+        return;
+    }
+    
+    int dirfd = open(stateDirectory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(dirfd != -1)
+    {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    
+    DIR *dir = opendir(stateDirectory.c_str());
+    for(struct dirent *entry; dir != NULL && (entry = readdir(dir)) != NULL; )
+    {
+        unsigned long generation;
+        if(sscanf(entry->d_name, "journal.%lx", &generation) == 1 && generation < job->generation)
+        {
+            unlink((stateDirectory + "/" + entry->d_name).c_str());
+        }
+    }
+    if(dir != NULL) closedir(dir);
+    delete job;
+}
+
+
+// Snapshots the session tables and starts the journal of the next
+// generation. The committer writes the snapshot out.
+// Must be called with stateLock held for writing
+void startSnapshot()
+{
+    pthread_mutex_lock(&commitLock);
+    bool busy = pendingSnapshot != NULL;
+    pthread_mutex_unlock(&commitLock);
+    if(busy) return;
+    
+    unsigned long generation = journalGeneration + 1;
+    int fd = openJournal(generation);
+    if(fd == -1) return;
+    
+    struct snapshotJob *job = new snapshotJob;
+    job->data = serializeState(generation);
+    job->generation = generation;
+    
+    // The committer only touches the journal under the commit lock
+    pthread_mutex_lock(&commitLock);
+    job->journal = journalFd;
+    journalFd = fd;
+    journalGeneration = generation;
+    journalRecords = 0;
+    pendingSnapshot = job;
+    pthread_cond_signal(&commitCond);
+    pthread_mutex_unlock(&commitLock);
+}
+
+
+// Appends a change of the session tables to the journal with one write().
+// It reaches the disk with the next group commit. Records are
+//   <length:4> <checksum:4> <op:1> <session> <password hash or username>
+// with the strings as in a snapshot. The snapshot that makes the records
+// obsolete is taken by the next change made with stateLock held for writing.
+// Must be called with stateLock held
+void journalEvent(enum journalOp op, uint32_t session, const string& arg)
+{
+    if(journalFd == -1) return;
+    
+    const string& name = nameOf(session);
+    size_t bodyLen = 1 + 2 + name.length() + 2 + arg.length();
+    char record[JOURNAL_RECORD_HEADER + 5 + 2 * MAXDATASIZE];
+    if(bodyLen > sizeof record - JOURNAL_RECORD_HEADER) return;
+    
+    char *body = record + JOURNAL_RECORD_HEADER;
+    uint16_t nameLen = htons(name.length()), argLen = htons(arg.length());
+    body[0] = op;
+    memcpy(body + 1, &nameLen, 2);
+    memcpy(body + 3, name.data(), name.length());
+    memcpy(body + 3 + name.length(), &argLen, 2);
+    memcpy(body + 5 + name.length(), arg.data(), arg.length());
+    
+    uint32_t header[] = {htonl(bodyLen), htonl(checksum(body, bodyLen))};
+    memcpy(record, header, JOURNAL_RECORD_HEADER);
+    
+    size_t length = JOURNAL_RECORD_HEADER + bodyLen;
+    pthread_mutex_lock(&journalLock);
+    if(write(journalFd, record, length) != (ssize_t) length) perror("journal");
+    journalRecords++;
+    pthread_mutex_unlock(&journalLock);
+    
+    pthread_mutex_lock(&commitLock);
+    journalDirty = true;
+    pthread_cond_signal(&commitCond);
+    pthread_mutex_unlock(&commitLock);
+}
+
+
+// Takes a snapshot once the journal has SNAPSHOT_INTERVAL records
+// Must be called with stateLock held for writing
+void snapshotIfDue()
+{
+    if(journalFd != -1 && journalRecords >= SNAPSHOT_INTERVAL) startSnapshot();
+}
+
+
+// Creates a session while the tables are rebuilt, without members
+// Returns the session, the one already there if there is one
+struct session *restoreSession(const string& name, const struct passwordHash& password)
+{
+    uint32_t id = internName(name);
+    struct session **existing = sessionList.find(id);
+    if(existing != NULL) return *existing;
+    
+    struct session *session = new struct session;
+    session->id = id;
+    session->password = password;
+    session->log = NULL;
+    pthread_rwlock_init(&session->lock, NULL);
+    sessionList.insert(id, session);
+    return session;
+}
+
+
+// Returns the session with a name, NULL if there is none
+struct session *findSession(const string& name)
+{
+    struct session **session = sessionList.find(findName(name));
+    return session == NULL ? NULL : *session;
+}
+
+
+// Takes an absent member out of a session, and the session out of the
+// tables once nobody is left in it
+// Must be called with stateLock held for writing
+void removeAbsent(struct session *session, uint32_t user)
+{
+    session->absent.erase(find(session->absent.begin(), session->absent.end(), user));
+    absentMembers.erase(user);
+    
+    if(session->members.empty() && session->absent.empty()) endSession(session);
+}
+
+
+// Puts a user in a session while the tables are rebuilt. Nobody is logged
+// in yet, so every member is absent.
+void restoreMember(struct session *session, const string& username)
+{
+    if(session == NULL) return;
+    
+    uint32_t user = internName(username);
+    uint32_t *previous = absentMembers.find(user);
+    if(previous != NULL)
+    {
+        // Rejoining after a restart journals a second JOIN
+        if(*previous == session->id) return;
+        removeAbsent(*sessionList.find(*previous), user);
+    }
+    session->absent.push_back(user);
+    absentMembers.insert(user, session->id);
+}
+
+
+// Takes a user out of a session while the tables are rebuilt
+void restoreLeave(const string& name, const string& username)
+{
+    uint32_t user = findName(username);
+    uint32_t *previous = absentMembers.find(user);
+    if(previous != NULL && *previous == findName(name)) removeAbsent(*sessionList.find(*previous), user);
+}
+
+
+// Loads a snapshot into the session tables
+// Returns the generation of the first journal it doesn't cover, 0 if there
+// is no valid snapshot
+unsigned long loadSnapshot(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1 || st.st_size < 24)
+    {
+        if(fd != -1) close(fd);
+        return 0;
+    }
+    
+    char *p = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return 0;
+    
+    const char *end = p + st.st_size - 4;
+    uint32_t sum;
+    memcpy(&sum, end, 4);
+    if(memcmp(p, SNAPSHOT_MAGIC, 4) != 0 || ntohl(sum) != checksum(p, end - p))
+    {
+        fprintf(stderr, "server: %s is damaged, ignoring it\n", path.c_str());
+        munmap(p, st.st_size);
+        return 0;
+    }
+    
+    uint64_t generation;
+    uint32_t count, total;
+    memcpy(&generation, p + 4, 8);
+    memcpy(&count, p + 12, 4);
+    memcpy(&total, p + 16, 4);
+    
+    // The snapshot lists sessions in the order of their slots
+    sessionList.reserve(sessionList.count + ntohl(count));
+    absentMembers.reserve(absentMembers.count + ntohl(total));
+    
+    const char *q = p + 20;
+    string name, password, username;
+    struct passwordHash stored;
+    for(uint32_t i = 0; i < ntohl(count); i++)
+    {
+        uint32_t members;
+        if(!getString(q, end, name) || !getString(q, end, password) || end - q < 4 ||
+           !decodePasswordHash(password, stored))
+        {
+            break;
+        }
+        memcpy(&members, q, 4);
+        q += 4;
+        
+        struct session *session = restoreSession(name, stored);
+        for(uint32_t j = 0; j < ntohl(members) && getString(q, end, username); j++)
+        {
+            restoreMember(session, username);
+        }
+    }
+    
+    munmap(p, st.st_size);
+    return be64toh(generation);
+}
+
+
+// Replays the records of a journal into the session tables, up to the
+// first torn one
+// Returns the number of records replayed
+unsigned long replayJournal(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        if(fd != -1) close(fd);
+        return 0;
+    }
+    
+    char *p = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return 0;
+    
+    const char *q = p, *end = p + st.st_size;
+    unsigned long records = 0;
+    string name, arg;
+    struct passwordHash stored;
+    while(end - q >= JOURNAL_RECORD_HEADER)
+    {
+        uint32_t header[2];
+        memcpy(header, q, JOURNAL_RECORD_HEADER);
+        size_t bodyLen = ntohl(header[0]);
+        const char *body = q + JOURNAL_RECORD_HEADER;
+        if(bodyLen < 5 || (size_t) (end - body) < bodyLen || checksum(body, bodyLen) != ntohl(header[1])) break;
+        
+        const char *field = body + 1;
+        if(!getString(field, body + bodyLen, name) || !getString(field, body + bodyLen, arg)) break;
+        
+        switch(body[0])
+        {
+            case JOURNAL_CREATE:
+                if(decodePasswordHash(arg, stored)) restoreSession(name, stored);
+                break;
+            case JOURNAL_JOIN:
+                restoreMember(findSession(name), arg);
+                break;
+            case JOURNAL_LEAVE:
+                restoreLeave(name, arg);
+                break;
+        }
+        q = body + bodyLen;
+        records++;
+    }
+    
+    munmap(p, st.st_size);
+    return records;
+}
+
+
+// Rebuilds the session tables from the snapshot and the journals written
+// after it, then starts the journal of a new generation behind a fresh
+// snapshot, which the committer writes out. Every member of a restored
+// session is absent until they log back in.
+// Must be called before the workers start
+void restoreState()
+{
+    unsigned long start = monotonicMillis();
+    unsigned long generation = loadSnapshot(stateDirectory + "/snapshot");
+    
+    vector<unsigned long> journals;
+    DIR *dir = opendir(stateDirectory.c_str());
+    for(struct dirent *entry; dir != NULL && (entry = readdir(dir)) != NULL; )
+    {
+        unsigned long number;
+        if(sscanf(entry->d_name, "journal.%lx", &number) == 1 && number >= generation)
+        {
+            journals.push_back(number);
+        }
+    }
+    if(dir != NULL) closedir(dir);
+    sort(journals.begin(), journals.end());
+    
+    unsigned long records = 0;
+    for(auto const & number : journals)
+    {
+        records += replayJournal(journalPath(number));
+        generation = number;
+    }
+    
+    // Sessions whose creator never joined them are no session
+    vector<uint32_t> empty;
+    for(auto const & slot : sessionList.slots)
+    {
+        if(slot.first != 0 && slot.second->absent.empty()) empty.push_back(slot.first);
+    }
+    for(auto const & id : empty) endSession(*sessionList.find(id));
+    
+    // Logged sessions get their history back, their passwords were checked
+    // when they were created
+    bool checked;
+    for(auto const & slot : sessionList.slots)
+    {
+        if(slot.first != 0 && !logDirectory.empty())
+        {
+            openSessionLog(slot.first, "", &slot.second->password, slot.second->log, checked);
+        }
+    }
+    
+    struct snapshotJob *job = new snapshotJob;
+    job->generation = generation + 1;
+    job->data = serializeState(job->generation);
+    job->journal = -1;
+    journalFd = openJournal(job->generation);
+    journalGeneration = job->generation;
+    journalRecords = 0;
+    pendingSnapshot = job;
+    
+    if(absentMembers.count > 0) restoreDeadline = monotonicMillis() + RESTORE_GRACE * 1000;
+    printf("server: restored %zu sessions from the snapshot and %lu journal records in %lu ms\n",
+           sessionList.count, records, monotonicMillis() - start);
+}
+
+
+// Drops the absent members of restored sessions once they had their time to
+// log back in, and the sessions nobody came back to
+// Must be called with stateLock held for writing
+void expireAbsentMembers()
+{
+    if(restoreDeadline == 0 || monotonicMillis() < restoreDeadline) return;
+    restoreDeadline = 0;
+    
+    vector<pair<uint32_t, uint32_t>> expired; // Session and user
+    for(auto const & slot : absentMembers.slots)
+    {
+        if(slot.first != 0) expired.push_back(make_pair(slot.second, slot.first));
+    }
+    for(auto const & member : expired)
+    {
+        removeAbsent(*sessionList.find(member.first), member.second);
+        journalEvent(JOURNAL_LEAVE, member.first, nameOf(member.second));
+    }
+}
+
+
+// Puts a user who logs in after a restart back into the session they were
+// in, as if they had joined it again
+void rejoinSession(struct connection *conn)
+{
+    pthread_rwlock_wrlock(&stateLock);
+    expireAbsentMembers();
+    
+    uint32_t *sessionID = absentMembers.find(conn->userID);
+    if(sessionID != NULL)
+    {
+        struct session *session = *sessionList.find(*sessionID);
+        
+        // Absent or not, the session has at least this member
+        session->absent.erase(find(session->absent.begin(), session->absent.end(), conn->userID));
+        absentMembers.erase(conn->userID);
+        addMember(session, conn);
+        
+        struct message& ack = serverMessage();
+        ack.type = JN_ACK;
+        ack.data = nameOf(session->id);
+        ack.size = ack.data.length() + 1;
+        sendToClient(&ack, conn->sockfd);
+        if(session->log != NULL) replayLog(session->log, conn);
+        
+        logEvent(LEVEL_INFO, "server: socket %d is back in session '%s'", conn->sockfd, ack.data.c_str());
+    }
+    
+    pthread_rwlock_unlock(&stateLock);
+}
+
+
+// Measures how long a restart takes with the given number of sessions. Half
+// of them are in the snapshot and the other half only in the journal after
+// it, and each has BENCH_MEMBERS members. Uses a directory of its own.
+void benchRestore(unsigned long count)
+{
+    // Every session has the same password, hashed once
+    struct passwordHash password;
+    if(!makePasswordHash("password", password)) return;
+    
+    char directory[] = "/tmp/chatroom-bench-XXXXXX";
+    if(mkdtemp(directory) == NULL)
+    {
+        perror("mkdtemp");
+        return;
+    }
+    stateDirectory = directory;
+    logDirectory.clear();
+    
+    // The first half as it was when the snapshot was taken
+    char name[32], user[32];
+    for(unsigned long i = 0; i < count / 2; i++)
+    {
+        snprintf(name, sizeof name, "session%lu", i);
+        struct session *session = restoreSession(name, password);
+        for(int j = 0; j < BENCH_MEMBERS; j++)
+        {
+            snprintf(user, sizeof user, "user%lu", i * BENCH_MEMBERS + j);
+            restoreMember(session, user);
+        }
+    }
+    struct snapshotJob *job = new snapshotJob;
+    job->generation = 1;
+    job->data = serializeState(1);
+    job->journal = -1;
+    finishSnapshot(job);
+    
+    // The second half created, joined and partly left since
+    journalFd = openJournal(1);
+    journalGeneration = 1;
+    for(unsigned long i = count / 2; i < count; i++)
+    {
+        snprintf(name, sizeof name, "session%lu", i);
+        struct session *session = restoreSession(name, password);
+        journalEvent(JOURNAL_CREATE, session->id, encodePasswordHash(password));
+        for(int j = 0; j < BENCH_MEMBERS; j++)
+        {
+            snprintf(user, sizeof user, "user%lu", i * BENCH_MEMBERS + j);
+            restoreMember(session, user);
+            journalEvent(JOURNAL_JOIN, session->id, user);
+        }
+        restoreLeave(name, user);
+        journalEvent(JOURNAL_LEAVE, session->id, user);
+        snapshotIfDue();
+    }
+    if(pendingSnapshot != NULL) finishSnapshot(pendingSnapshot);
+    pendingSnapshot = NULL;
+    close(journalFd);
+    
+    // Start over from nothing, like a server that was just started
+    for(auto const & slot : sessionList.slots)
+    {
+        if(slot.first != 0) delete slot.second;
+    }
+    sessionList = idMap<struct session*>();
+    absentMembers = idMap<uint32_t>();
+    
+    struct stat st;
+    stat((stateDirectory + "/snapshot").c_str(), &st);
+    printf("server: %lu sessions, snapshot of %ld bytes\n", count, (long) st.st_size);
+    restoreState();
+    
+    // Clean up behind the benchmark
+    finishSnapshot(pendingSnapshot);
+    close(journalFd);
+    unlink(journalPath(journalGeneration).c_str());
+    unlink((stateDirectory + "/snapshot").c_str());
+    rmdir(directory);
+}
+
+
+// Refuses to add a client to a session, telling it why
+// Returns false, for the caller to pass on
+bool refuseJoin(struct connection *conn, const string& sessionID, const string& reason)
+{
+    struct message& nak = serverMessage();
+    nak.type = JN_NAK;
+    nak.data = reason;
+    nak.size = nak.data.length() + 1;
+    
+    sendToClient(&nak, conn->sockfd);
+    logEvent(LEVEL_INFO, "Client '%s' could not join session '%s'", usernameOf(conn).c_str(), sessionID.c_str());
+    return false;
+}
+
+
+// Returns the session with a name, locked for writing, NULL if there is none
+// A session left empty by a leave is only waiting to be ended, and is none.
+// Must be called with stateLock held
+struct session *lockSession(const string& name)
+{
+    // Names never seen can't have one
+    struct session **session = sessionList.find(findName(name));
+    if(session == NULL) return NULL;
+    
+    pthread_rwlock_wrlock(&(*session)->lock);
+    if((*session)->members.empty() && (*session)->absent.empty())
+    {
+        pthread_rwlock_unlock(&(*session)->lock);
+        return NULL;
+    }
+    return *session;
+}
+
+
+// Adds client to the specified session
+// If the session exists and they aren't already in a session, the password
+// is checked against its hash by the hashing threads, and the client is
+// paused until they are done, see finishJoin()
+// Otherwise, it sends back the reason they couldn't be added to the specified session
+// Must be called with stateLock held
+// Returns true if handed off
+bool joinSession (int sockfd, const string& sessionData)
+{
+    string sessionID, sessionPassword;  
+    stringstream ss(sessionData);
+    ss >> sessionID >> sessionPassword;
+    
+    struct connection *conn = connTable[sockfd];
+    if (sessionID == ACK_DATA) return refuseJoin(conn, sessionID, "No session ID was provided!");
+    if (conn->session != NULL) return refuseJoin(conn, sessionID, "Already in a session!");
+    
+    struct session *session = lockSession(sessionID);
+    if (session == NULL) return refuseJoin(conn, sessionID, "Session not found!");
+    
+    struct passwordJob *job = new passwordJob;
+    job->check = CHECK_JOIN;
+    job->home = conn->owner;
+    job->sockfd = sockfd;
+    job->id = conn->id;
+    job->format = conn->format;
+    job->user = sessionID;
+    job->password = sessionPassword;
+    job->stored = session->password;
+    job->log = NULL;
+    pthread_rwlock_unlock(&session->lock);
+    
+    if(!queuePasswordJob(job))
+    {
+        delete job;
+        return refuseJoin(conn, sessionID, "Server is busy, try again later!");
+    }
+    adjustPause(conn, 1);
+    return true;
+}
+
+
+// Adds a client to a session once the hashing threads checked its password,
+// if the client is still there, and sends back the session it was added to
+// followed by what was said before it joined. A session ended and created
+// again meanwhile has its new password checked.
+// Must be called with stateLock held for writing if sessions are logged,
+// otherwise held for reading will do
+// Returns true if the password was handed back to the hashing threads
+bool finishJoin(struct passwordJob *job)
+{
+    struct connection *conn = connTable[job->sockfd];
+    if(conn == NULL || conn->id != job->id || isClosing(conn)) return false;
+    
+    struct session *session = lockSession(job->user);
+    bool recreated = session != NULL && !hashesMatch(session->password.hash, job->stored.hash);
+    if(recreated)
+    {
+        job->stored = session->password;
+        pthread_rwlock_unlock(&session->lock);
+        if(queuePasswordJob(job)) return true;
+        session = NULL;
+    }
+    adjustPause(conn, -1);
+    
+    if(recreated) return refuseJoin(conn, job->user, "Server is busy, try again later!");
+    if(conn->session != NULL || session == NULL || !job->matches)
+    {
+        if(session != NULL) pthread_rwlock_unlock(&session->lock);
+        refuseJoin(conn, job->user, conn->session != NULL ? "Already in a session!" :
+                                    session == NULL ? "Session not found!" : "Password is incorrect!");
+        return false;
+    }
+    
+    // Add client to the session
+    addMember(session, conn);
+    
+    // Send response with the data as the sessionID, before anyone
+    // broadcasting to the session can queue a message after it
+    struct message& ack = serverMessage();
+    ack.type = JN_ACK;
+    ack.data = job->user;
+    ack.size = ack.data.length() + 1;
+    
+    sendToClient(&ack, conn->sockfd);
+    
+    // Followed by what was said before the client joined
+    if(session->log != NULL) replayLog(session->log, conn);
+    pthread_rwlock_unlock(&session->lock);
+    logEvent(LEVEL_INFO, "Client '%s' joined session '%s'", usernameOf(conn).c_str(), job->user.c_str());
+    return false;
+}
+
+
+// Removes client from their current session.
+// If they're in a session, it sends back the session they were removed from
+// Otherwise, it sends back the reason they couldn't leave the specified session
+// Must be called with stateLock held for reading. A session left empty is
+// ended once it is released, ended is its ID then and 0 otherwise.
+// Returns true if successful
+bool leaveSession (int sockfd, uint32_t& ended)
+{
+    struct message& ack = serverMessage();
+    ended = 0;
+    string currentSessionID = clientSockfdToSessionID(sockfd);
+    
+    // Check if client is in a session
+    if (currentSessionID != SESSION_NOT_FOUND)
+    {
+        // Remove client from session, which ends once nobody is left in it
+        struct session *session = connTable[sockfd]->session;
+        pthread_rwlock_wrlock(&session->lock);
+        if(removeMember(connTable[sockfd])) ended = session->id;
+        pthread_rwlock_unlock(&session->lock);
+        
+        ack.type = LS_ACK;
+        ack.data = currentSessionID;
+        ack.size = ack.data.length() + 1;
+
+        sendToClient(&ack, sockfd);
+        return true;
+    }
+    else
+    {
+        ack.type = LS_NAK;
+        ack.data = "Not in a session!";
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        return false;
+    }
+}
+
+
+// Refuses to create a session, telling the client why
+// Returns false, for the caller to pass on
+bool refuseSession(struct connection *conn, const string& sessionID, const string& reason)
+{
+    struct message& nak = serverMessage();
+    nak.type = NS_NAK;
+    nak.data = reason;
+    nak.size = nak.data.length() + 1;
+    
+    sendToClient(&nak, conn->sockfd);
+    logEvent(LEVEL_INFO, "Session '%s' cannot be created", sessionID.c_str());
+    return false;
+}
+
+
+// Returns true if a session is going on already. One left empty by a leave
+// is only waiting to be ended, and is ended.
+// Must be called with stateLock held for writing
+bool sessionExists(uint32_t id)
+{
+    struct session **existing = sessionList.find(id);
+    if(existing != NULL && (*existing)->members.empty() && (*existing)->absent.empty())
+    {
+        endSession(*existing);
+        existing = NULL;
+    }
+    return existing != NULL;
+}
+
+
+// Creates a session whose name is free and whose password is known to be
+// right, with the client as its only member, and sends back the sessionID
+// followed by the history of its log, if it has one
+// Must be called with stateLock held for writing
+// Returns true
+bool startSession(struct connection *conn, uint32_t id, const struct passwordHash& sessionPassword,
+                  struct sessionLog *log)
+{
+    // Recording password hash of the created session list
+    struct session *session = new struct session;
+    session->id = id;
+    session->password = sessionPassword;
+    session->log = log;
+    pthread_rwlock_init(&session->lock, NULL);
+    sessionList.insert(id, session);
+    journalEvent(JOURNAL_CREATE, id, encodePasswordHash(sessionPassword));
+    addMember(session, conn);
+    
+    struct message& ack = serverMessage();
+    ack.type = NS_ACK;
+    ack.data = nameOf(id);
+    ack.size = ack.data.length() + 1;
+    
+    sendToClient(&ack, conn->sockfd);
+    if(log != NULL) replayLog(log, conn);
+    logEvent(LEVEL_INFO, "New session '%s' created for client %s", ack.data.c_str(), usernameOf(conn).c_str());
+    return true;
+}
+
+
+// Create a new session in the session list and add the requesting client to it
+// If the session doesn't exist, it creates it and adds the client to it, and
+// sends back the sessionID
+// Otherwise, it sends back the reason why it couldn't be created
+// The password is hashed by the hashing threads, and the client is paused
+// until they are done, see finishNewSession(). A session with history keeps
+// the password it was first created with, so they also open its log and
+// check the password against it.
+// Returns true if handed off
+bool createSession(int sockfd, const string& sessionData)
+{   
+    struct connection *conn = connTable[sockfd];
+    string sessionID, sessionPassword;
+    stringstream ss(sessionData);
+    
+    ss >> sessionID >> sessionPassword;
+    
+    if(conn->session != NULL) return refuseSession(conn, sessionID, "Already in a session!");
+    
+    // Checked before creating the session, which must not outlive the NAK
+    if (sessionID == ACK_DATA) return refuseSession(conn, sessionID, "No session ID was provided!");
+    
+    uint32_t id = internName(sessionID);
+    if(sessionExists(id)) return refuseSession(conn, sessionID, "Session already exists!");
+    
+    struct passwordJob *job = new passwordJob;
+    job->check = CHECK_NEW_SESSION;
+    job->home = conn->owner;
+    job->sockfd = sockfd;
+    job->id = conn->id;
+    job->format = conn->format;
+    job->user = sessionID;
+    job->password = sessionPassword;
+    job->log = NULL;
+    if(!queuePasswordJob(job))
+    {
+        delete job;
+        return refuseSession(conn, sessionID, "Server is busy, try again later!");
+    }
+    adjustPause(conn, 1);
+    return true;
+}
+
+
+// Creates a session once the hashing threads hashed its password, opened its
+// log and checked the password against it, if the client is still there and
+// the name still free
+// Must be called with stateLock held for writing
+void finishNewSession(struct passwordJob *job)
+{
+    struct connection *conn = connTable[job->sockfd];
+    if(conn == NULL || conn->id != job->id || isClosing(conn)) return;
+    adjustPause(conn, -1);
+    
+    uint32_t id = internName(job->user);
+    if(conn->session != NULL) refuseSession(conn, job->user, "Already in a session!");
+    else if(sessionExists(id)) refuseSession(conn, job->user, "Session already exists!");
+    else if(!job->matches) refuseSession(conn, job->user, "Password is incorrect!");
+    else startSession(conn, id, job->stored, job->log);
+}
+
+
+// Send an acknowledge to a client for requesting a list
+void acknowledgeList(int sockfd, const string& buffer)
+{
+    struct message& listAck = serverMessage();
+    listAck.type = QU_ACK;
+    listAck.size = buffer.length() + 1;
+    listAck.data = buffer;
+    
+    sendToClient(&listAck, sockfd);
+}
+
+
+void createList(int sockfd)
+{
+    string buffer = "\nClients Online: ";
+    
+    for(auto const & it : usernameList.slots){
+        if(it.first != 0) buffer += nameOf(it.first) + " ";
+    }
+    
+    
+    buffer += "\nAvailable Sessions: ";
+    for(auto const & it : sessionList.slots){
+        if(it.first != 0) buffer += nameOf(it.first) + " ";
+    }
+    
+    acknowledgeList(sockfd, buffer);
+}
+
+
+// Names of the packet types, as the statistics show them
+const char *typeNames[NUM_MSG_TYPES] = {
+    "LOGIN", "LO_ACK", "LO_NAK", "EXIT", "JOIN", "JN_ACK", "JN_NAK", "LEAVE_SESS", "LS_ACK",
+    "LS_NAK", "NEW_SESS", "NS_ACK", "NS_NAK", "MESSAGE", "QUERY", "QU_ACK", "DIRMESSAGE",
+    "DMESS_ACK", "DMESS_NAK", "SOURCE_DEF", "FILE_OFFER", "FILE_ACK", "FILE_NAK", "STATS"
+};
+
+// Histograms of every worker added together
+struct histogramSum {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long sum;
+    unsigned long max;
+};
+
+
+void addHistogram(struct histogramSum *sum, const struct histogram *h)
+{
+    for(size_t i = 0; i < HIST_BUCKETS; i++) sum->counts[i] += h->counts[i].load(memory_order_relaxed);
+    sum->total += h->total.load(memory_order_relaxed);
+    sum->sum += h->sum.load(memory_order_relaxed);
+    sum->max = max(sum->max, h->max.load(memory_order_relaxed));
+}
+
+
+// Returns the value the given fraction of the counted values are at or
+// below, to the precision of the buckets
+unsigned long percentile(const struct histogramSum *h, double fraction)
+{
+    unsigned long rank = (unsigned long) (fraction * h->total + 0.5), seen = 0;
+    if(rank == 0) rank = 1;
+    for(size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if(seen >= rank) return min(bucketLimit(i), h->max);
+    }
+    return h->max;
+}
+
+
+void appendFormat(string& out, const char *format, ...)
+{
+    char text[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(text, sizeof text, format, ap);
+    va_end(ap);
+    if(len > 0) out.append(text, min(len, (int) sizeof text - 1));
+}
+
+
+// Appends the count and percentiles of a histogram, as a JSON object or as
+// text with the values divided by scale
+void appendHistogram(string& out, const struct histogramSum *h, bool json, double scale)
+{
+    if(json)
+    {
+        appendFormat(out, "{\"count\":%lu,\"mean\":%.1f,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}",
+                     h->total, h->total > 0 ? (double) h->sum / h->total : 0.0, percentile(h, 0.5),
+                     percentile(h, 0.99), percentile(h, 0.999), h->max);
+    }
+    else if(scale == 1)
+    {
+        appendFormat(out, "p50 %lu, p99 %lu, p99.9 %lu, max %lu", percentile(h, 0.5),
+                     percentile(h, 0.99), percentile(h, 0.999), h->max);
+    }
+    else
+    {
+        appendFormat(out, "p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f", percentile(h, 0.5) / scale,
+                     percentile(h, 0.99) / scale, percentile(h, 0.999) / scale, h->max / scale);
+    }
+}
+
+
+// Returns the counters of every worker added together, as text or JSON.
+// Only detailed reports list the workers one by one.
+// Must be called with stateLock held
+string statsReport(bool json, bool detailed)
+{
+    unsigned long packetsIn = 0, bytesIn = 0, framesOut = 0, bytesOut = 0, connections = 0;
+    struct histogramSum *sums = new histogramSum[NUM_MSG_TYPES + 2]();
+    struct histogramSum *fanout = &sums[NUM_MSG_TYPES], *queueDepth = &sums[NUM_MSG_TYPES + 1];
+    string workers;
+    
+    for(auto const & s : shards)
+    {
+        struct metrics *m = s->metrics;
+        unsigned long worker[] = {m->packetsIn.load(), m->bytesIn.load(), m->framesOut.load(),
+                                  m->bytesOut.load(), m->connections.load()};
+        packetsIn += worker[0];
+        bytesIn += worker[1];
+        framesOut += worker[2];
+        bytesOut += worker[3];
+        connections += worker[4];
+        for(int type = 0; type < NUM_MSG_TYPES; type++) addHistogram(&sums[type], &m->latency[type]);
+        addHistogram(fanout, &m->fanout);
+        addHistogram(queueDepth, &m->queueDepth);
+        
+        if(!detailed) continue;
+        if(json)
+        {
+            appendFormat(workers, "%s{\"id\":%d,\"packets_in\":%lu,\"bytes_in\":%lu,\"frames_out\":%lu,"
+                         "\"bytes_out\":%lu,\"connections\":%lu}", workers.empty() ? "" : ",",
+                         s->id, worker[0], worker[1], worker[2], worker[3], worker[4]);
+        }
+        else
+        {
+            appendFormat(workers, "worker %d: %lu packets in (%lu bytes), %lu frames out (%lu bytes), "
+                         "%lu connections\n", s->id, worker[0], worker[1], worker[2], worker[3], worker[4]);
+        }
+    }
+    
+    string out;
+    unsigned long uptime = (monotonicMillis() - serverStart) / 1000;
+    if(json)
+    {
+        appendFormat(out, "{\"uptime_s\":%lu,\"connections\":%lu,\"users\":%zu,\"sessions\":%zu,"
+                     "\"packets_in\":%lu,\"bytes_in\":%lu,\"frames_out\":%lu,\"bytes_out\":%lu,\"fanout\":",
+                     uptime, connections, usernameList.count, sessionList.count,
+                     packetsIn, bytesIn, framesOut, bytesOut);
+        appendHistogram(out, fanout, true, 1);
+        out += ",\"queue_depth_bytes\":";
+        appendHistogram(out, queueDepth, true, 1);
+        out += ",\"latency_ns\":{";
+        bool first = true;
+        for(int type = 0; type < NUM_MSG_TYPES; type++)
+        {
+            if(sums[type].total == 0) continue;
+            appendFormat(out, "%s\"%s\":", first ? "" : ",", typeNames[type]);
+            appendHistogram(out, &sums[type], true, 1);
+            first = false;
+        }
+        out += "}";
+        if(detailed) out += ",\"workers\":[" + workers + "]";
+        out += "}\n";
+    }
+    else
+    {
+        appendFormat(out, "up %lu s, %lu connections, %zu users logged in, %zu sessions\n",
+                     uptime, connections, usernameList.count, sessionList.count);
+        appendFormat(out, "%lu packets in (%lu bytes), %lu frames out (%lu bytes)\n",
+                     packetsIn, bytesIn, framesOut, bytesOut);
+        out += "fan-out: ";
+        appendHistogram(out, fanout, false, 1);
+        out += " recipients\nqueue depth: ";
+        appendHistogram(out, queueDepth, false, 1);
+        out += " bytes\n";
+        for(int type = 0; type < NUM_MSG_TYPES; type++)
+        {
+            if(sums[type].total == 0) continue;
+            appendFormat(out, "%s: %lu handled, ", typeNames[type], sums[type].total);
+            appendHistogram(out, &sums[type], false, 1000);
+            out += " us\n";
+        }
+        out += workers;
+    }
+    
+    delete[] sums;
+    return out;
+}
+
+
+// Sends a client the server's counters
+void sendStats(int sockfd)
+{
+    struct message& stats = serverMessage();
+    stats.type = STATS;
+    stats.data = statsReport(false, false);
+    stats.data.pop_back(); // The client ends the line
+    stats.size = stats.data.length() + 1;
+    
+    sendToClient(&stats, sockfd);
+}
+
+
+// Serves the admin socket: every connection sends one command, gets the
+// answer and is closed. "stats" asks for the counters as text, and
+// "stats json" as JSON.
+void runAdmin(int listener)
+{
+    while(true)
+    {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if(fd == -1)
+        {
+            if(errno != EINTR) logEvent(LEVEL_WARN, "admin: %s", strerror(errno));
+            continue;
+        }
+        
+        struct timeval timeout = {ADMIN_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        char command[64];
+        ssize_t len = recv(fd, command, sizeof command - 1, 0);
+        if(len < 0) len = 0;
+        while(len > 0 && isspace((unsigned char) command[len - 1])) len--;
+        command[len] = '\0';
+        
+        string reply;
+        bool json = strcmp(command, "stats json") == 0;
+        if(json || strcmp(command, "stats") == 0)
+        {
+            pthread_rwlock_rdlock(&stateLock);
+            reply = statsReport(json, true);
+            pthread_rwlock_unlock(&stateLock);
+        }
+        else reply = "Unknown command, send stats or stats json\n";
+        
+        for(size_t done = 0; done < reply.size(); )
+        {
+            ssize_t n = write(fd, reply.data() + done, reply.size() - done);
+            if(n <= 0) break;
+            done += n;
+        }
+        close(fd);
+    }
+}
+
+
+// Creates the admin socket at the given path, which only the server's user
+// can connect to, and returns its file descriptor
+int createAdminSocket(const string& path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if(path.length() >= sizeof addr.sun_path)
+    {
+        fprintf(stderr, "server: admin socket path too long\n");
+        exit(3);
+    }
+    strcpy(addr.sun_path, path.c_str());
+    
+    // A socket left behind by an earlier run is in the way
+    unlink(path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listener == -1 || bind(listener, (struct sockaddr*) &addr, sizeof addr) == -1 ||
+       chmod(path.c_str(), 0600) == -1 || listen(listener, BACKLOG) == -1)
+    {
+        perror("admin");
+        exit(3);
+    }
+    return listener;
+}
+
+
+// Trace file given with -T
+string tracePath;
+int traceFd = -1;
+
+
+// Appends a block to the trace file with the records of a ring, or only the
+// clock if ring is NULL
+void writeTraceBlock(struct traceRing *ring, string& buf)
+{
+    struct traceBlock block;
+    memset(&block, 0, sizeof block);
+    block.ticks = traceClock();
+    block.nanos = monotonicNanos();
+    size_t start = buf.size();
+    buf.append((const char*) &block, sizeof block);
+    if(ring == NULL) return;
+    
+    uint32_t head = ring->head.load(memory_order_relaxed);
+    uint32_t tail = ring->tail.load(memory_order_acquire);
+    for(uint32_t i = head; i != tail; i++)
+    {
+        buf.append((const char*) &ring->records[i & (TRACE_RING_EVENTS - 1)], sizeof(struct traceRecord));
+    }
+    ring->head.store(tail, memory_order_release);
+    
+    block.tid = ring->tid;
+    block.count = tail - head;
+    block.dropped = ring->dropped.exchange(0);
+    memcpy(block.name, ring->name, TRACE_NAME_SIZE);
+    memcpy(&buf[start], &block, sizeof block);
+}
+
+
+// Writes the stages the threads timed to the trace file every
+// TRACE_FLUSH_INTERVAL milliseconds
+void runTraceWriter()
+{
+    vector<struct traceRing*> rings;
+    string buf;
+    
+    while(true)
+    {
+        usleep(TRACE_FLUSH_INTERVAL * 1000);
+        
+        pthread_mutex_lock(&traceRingLock);
+        rings = traceRings;
+        pthread_mutex_unlock(&traceRingLock);
+        
+        writeTraceBlock(NULL, buf);
+        for(auto const & ring : rings) writeTraceBlock(ring, buf);
+        writeEvents(traceFd, buf);
+    }
+}
+
+
+// Creates the trace file, with the names of the stages and the clock, and
+// turns tracing on
+void startTrace()
+{
+    traceFd = open(tracePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(traceFd == -1)
+    {
+        perror(tracePath.c_str());
+        exit(3);
+    }
+    
+    string buf(TRACE_MAGIC);
+    uint32_t stages = NUM_TRACE_STAGES;
+    buf.append((const char*) &stages, sizeof stages);
+    for(int i = 0; i < NUM_TRACE_STAGES; i++) buf.append(traceStageNames[i], strlen(traceStageNames[i]) + 1);
+    writeTraceBlock(NULL, buf);
+    writeEvents(traceFd, buf);
+    tracing = true;
+}
+
+
+// Converts a trace file to the JSON trace event format that chrome://tracing
+// and Perfetto open, with every stage as a complete event
+// Returns false if the trace file can't be read
+bool convertTrace(const string& path, const string& jsonPath)
+{
+    ifstream in(path, ios::binary);
+    string trace((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    uint32_t stages = 0;
+    if(trace.compare(0, 4, TRACE_MAGIC) != 0 || trace.size() < 8)
+    {
+        fprintf(stderr, "server: %s is not a trace file\n", path.c_str());
+        return false;
+    }
+    memcpy(&stages, &trace[4], sizeof stages);
+    
+    vector<string> names;
+    size_t pos = 8;
+    for(uint32_t i = 0; i < stages && pos < trace.size(); i++)
+    {
+        names.push_back(trace.c_str() + pos);
+        pos += names.back().length() + 1;
+    }
+    
+    // The first and last blocks give the length of a clock tick
+    vector<pair<size_t, struct traceBlock>> blocks;
+    while(pos + sizeof(struct traceBlock) <= trace.size())
+    {
+        struct traceBlock block;
+        memcpy(&block, &trace[pos], sizeof block);
+        pos += sizeof block;
+        if(pos + block.count * sizeof(struct traceRecord) > trace.size()) break; // Torn by a kill
+        blocks.push_back(make_pair(pos, block));
+        pos += block.count * sizeof(struct traceRecord);
+    }
+    if(blocks.empty())
+    {
+        fprintf(stderr, "server: %s has no clock\n", path.c_str());
+        return false;
+    }
+    const struct traceBlock& first = blocks.front().second;
+    const struct traceBlock& last = blocks.back().second;
+    double nanosPerTick = last.ticks > first.ticks ? (double) (last.nanos - first.nanos) / (last.ticks - first.ticks) : 1.0;
+    
+    FILE *out = fopen(jsonPath.c_str(), "w");
+    if(out == NULL)
+    {
+        perror(jsonPath.c_str());
+        return false;
+    }
+    
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"server\"}}");
+    vector<uint32_t> named;
+    unsigned long count = 0, dropped = 0;
+    for(auto const & entry : blocks)
+    {
+        const struct traceBlock& block = entry.second;
+        dropped += block.dropped;
+        if(block.count == 0) continue;
+        if(find(named.begin(), named.end(), block.tid) == named.end())
+        {
+            string name(block.name, strnlen(block.name, TRACE_NAME_SIZE));
+            fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    block.tid, name.c_str());
+            named.push_back(block.tid);
+        }
+        
+        for(uint32_t i = 0; i < block.count; i++)
+        {
+            struct traceRecord record;
+            memcpy(&record, &trace[entry.first + i * sizeof record], sizeof record);
+            unsigned int stage = record.stageArg >> 24, arg = record.stageArg & 0xffffff;
+            double ts = ((int64_t) (record.begin - first.ticks)) * nanosPerTick / 1000;
+            
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                    stage < names.size() ? names[stage].c_str() : "?", block.tid, ts,
+                    record.duration * nanosPerTick / 1000);
+            if(stage == TRACE_HANDLE && arg < NUM_MSG_TYPES) fprintf(out, "\"type\":\"%s\"}}", typeNames[arg]);
+            else fprintf(out, "\"arg\":%u}}", arg);
+            count++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    
+    printf("server: wrote %lu stages to %s", count, jsonPath.c_str());
+    if(dropped > 0) printf(", %lu more were lost to full trace rings", dropped);
+    printf("\n");
+    return true;
+}
+
+
+// Sends a direct message to a client specified in the data of the given packet
+// If the client doesn't exist, inform sender
+// Returns true if message sent successfully
+bool sendDirectMessage(struct message& packet, int senderfd)
+{
+    struct message& dirMessAck = serverMessage();
+    struct connection *sender = connTable[senderfd];
+    struct connectionRef& target = sender->fragTarget;
+    
+    // Later fragments of a message go where its first one went, without an
+    // acknowledgement. They are dropped if the first one was refused.
+    if(packet.flags & FLAG_CONTINUED)
+    {
+        if(sender->fragInbox != NULL)
+        {
+            bool queued = appendToInbox(sender->fragInbox, &packet);
+            if(!(packet.flags & FLAG_MORE)) sender->fragInbox = NULL;
+            return queued;
+        }
+        
+        struct connection *receiver = target.owner != NULL ? connTable[target.sockfd] : NULL;
+        bool sent = receiver != NULL && receiver->id == target.id && sendToClient(&packet, target.sockfd);
+        if(!(packet.flags & FLAG_MORE)) target.owner = NULL;
+        return sent;
+    }
+    target.owner = NULL;
+    sender->fragInbox = NULL;
+    
+    size_t space = packet.data.find(' ');
+    string receiverID = packet.data.substr(0, space);
+    
+    int *client = usernameList.find(findName(receiverID));
+    if(client != NULL)
+    {
+        // Don't send to yourself
+        if(*client == senderfd)
+        {
+            dirMessAck.type = DMESS_NAK;
+            dirMessAck.data = "Can't send message to yourself!";
+            dirMessAck.size = dirMessAck.data.length() + 1;
+            sendToClient(&dirMessAck, senderfd);
+            
+            return false;
+        }
+        
+        // Send message to receiver, without the name and the space after it
+        packet.data.erase(0, space == string::npos ? space : space + 1);
+        sendToClient(&packet, *client);
+        
+        if(packet.flags & FLAG_MORE)
+        {
+            struct connection *receiver = connTable[*client];
+            target.sockfd = *client;
+            target.id = receiver->id;
+            target.owner = receiver->owner;
+        }
+        
+        // Tell sender the message was delivered
+        dirMessAck.type = DMESS_ACK;
+        dirMessAck.data = receiverID;
+        dirMessAck.size = dirMessAck.data.length() + 1;
+        sendToClient(&dirMessAck, senderfd);
+        
+        return true;
+    }
+    
+    // Permitted users who aren't logged in get it when they are
+    struct inbox *box = userExists(receiverID) ? inboxOf(receiverID, true) : NULL;
+    if(box != NULL)
+    {
+        packet.data.erase(0, space == string::npos ? space : space + 1);
+        if(!appendToInbox(box, &packet))
+        {
+            dirMessAck.type = DMESS_NAK;
+            dirMessAck.data = "User '" + receiverID + "' is offline and their inbox is full!";
+            dirMessAck.size = dirMessAck.data.length() + 1;
+            sendToClient(&dirMessAck, senderfd);
+            
+            return false;
+        }
+        if(packet.flags & FLAG_MORE) sender->fragInbox = box;
+        
+        // The sender is told the message waits
+        dirMessAck.type = DMESS_ACK;
+        dirMessAck.data = receiverID + " queued";
+        dirMessAck.size = dirMessAck.data.length() + 1;
+        sendToClient(&dirMessAck, senderfd);
+        
+        return true;
+    }
+    
+    // Inform sender the user does not exist
+    dirMessAck.type = DMESS_NAK;
+    dirMessAck.data = "User '" + receiverID + "' does not exist!";
+    dirMessAck.size = dirMessAck.data.length() + 1;
+    sendToClient(&dirMessAck, senderfd);
+    
+    return false;
+}
+
+
+// Returns a random token for a data connection to claim its part in a transfer
+uint64_t newTransferToken()
+{
+    uint64_t token = 0;
+    while(token == 0)
+    {
+        if(getrandom(&token, sizeof token, 0) != sizeof token) perror("getrandom");
+    }
+    return token;
+}
+
+
+// Offers a file to a user, or to the other members of the sender's session,
+// given the data "<target> <size> <name>" of the sender's FILE_OFFER. Only
+// clients that speak the binary protocol can receive files. The sender gets
+// the port and token its data connection presents, the recipients another
+// token for theirs.
+// Must be called with stateLock held
+// Returns true if the file was offered to anyone
+bool offerFile(int sockfd, struct message& packet)
+{
+    struct message& ack = serverMessage();
+    struct connection *sender = connTable[sockfd];
+    
+    string target, name;
+    uint64_t size = 0;
+    stringstream ss(packet.data);
+    ss >> target >> size;
+    getline(ss, name);
+    if(!name.empty()) name.erase(0, 1); // Remove extra space
+    
+    // Recipients are a user, or the other members of the sender's session
+    vector<int> recipients;
+    int *client = usernameList.find(findName(target));
+    struct session **session = sessionList.find(findName(target));
+    if(client != NULL && *client != sockfd)
+    {
+        recipients.push_back(*client);
+    }
+    else if(session != NULL && *session == sender->session)
+    {
+        pthread_rwlock_rdlock(&(*session)->lock);
+        for(auto const & member : (*session)->members)
+        {
+            if(member != sockfd) recipients.push_back(member);
+        }
+        pthread_rwlock_unlock(&(*session)->lock);
+    }
+    recipients.erase(remove_if(recipients.begin(), recipients.end(), [](int fd) {
+        return connTable[fd] == NULL || connTable[fd]->format != FRAMING_BINARY;
+    }), recipients.end());
+    
+    ack.type = FILE_NAK;
+    if(transferPort == 0) ack.data = "File transfers are off!";
+    else if(size == 0 || name.empty()) ack.data = "Nothing to send!";
+    else if(client == NULL && session == NULL) ack.data = "'" + target + "' does not exist!";
+    else if(client != NULL && *client == sockfd) ack.data = "Can't send a file to yourself!";
+    else if(client == NULL && *session != sender->session) ack.data = "Not in session '" + target + "'!";
+    else if(recipients.empty()) ack.data = "Nobody in '" + target + "' can receive files!";
+    
+    if(!ack.data.empty())
+    {
+        ack.size = ack.data.length() + 1;
+        sendToClient(&ack, sockfd);
+        return false;
+    }
+    
+    struct transfer *t = new transfer;
+    t->sendToken = newTransferToken();
+    t->recvToken = newTransferToken();
+    t->size = size;
+    t->moved = 0;
+    t->expected = recipients.size();
+    t->deadline = monotonicMillis() + TRANSFER_TIMEOUT * 1000UL;
+    t->started = false;
+    t->closed = false;
+    t->ready = false;
+    t->sender = -1;
+    t->pipefd[0] = t->pipefd[1] = -1;
+    t->name = name;
+    
+    pthread_mutex_lock(&transferLock);
+    transferTokens[t->sendToken] = t;
+    transferTokens[t->recvToken] = t;
+    pthread_mutex_unlock(&transferLock);
+    
+    // Tell the recipients first, the sender's reply ends the handling of the packet
+    string port = to_string(transferPort) + " ";
+    packet.type = FILE_OFFER;
+    packet.data = port + to_string(t->recvToken) + " " + to_string(size) + " " + name;
+    packet.size = packet.data.length() + 1;
+    for(auto const & recipient : recipients) sendToClient(&packet, recipient);
+    
+    ack.type = FILE_ACK;
+    ack.data = port + to_string(t->sendToken);
+    ack.size = ack.data.length() + 1;
+    sendToClient(&ack, sockfd);
+    return true;
+}
+
+// Sets a file descriptor to non-blocking mode
+// Returns true if successful
+bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        return false;
+    }
+    return true;
+}
+
+
+// Registers a connection with the epoll instance for the given edge-triggered events
+// Returns true if successful
+bool watchConnection(int epfd, struct connection *conn, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = conn;
+    
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sockfd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+
+// Records the context of a connection in the connection table
+// Returns false if the socket is beyond the size of the table
+bool addConnection(struct connection *conn)
+{
+    if(conn->sockfd >= (int) connTable.size()) return false;
+    
+    pthread_rwlock_wrlock(&stateLock);
+    connTable[conn->sockfd] = conn;
+    pthread_rwlock_unlock(&stateLock);
+    return true;
+}
+
+
+// Removes a client that hung up from the client list, its session and the
+// connection table
+void hangUpClient(int sockfd)
+{
+    pthread_rwlock_wrlock(&stateLock);
+    
+    struct connection *conn = sockfd < (int) connTable.size() ? connTable[sockfd] : NULL;
+    if(conn != NULL)
+    {
+        // Remove client from a session, and the session if it was the last
+        // one in it
+        struct session *session = conn->session;
+        if(removeMember(conn)) endSession(session);
+        
+        // Remove client
+        if(conn->userID != 0) usernameList.erase(conn->userID);
+        conn->userID = 0;
+        connTable[sockfd] = NULL;
+    }
+    snapshotIfDue();
+    pthread_rwlock_unlock(&stateLock);
+}
+
+
+// Returns the time of the monotonic clock in milliseconds
+unsigned long monotonicMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+
+unsigned long monotonicNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+
+// Arms the shard's timer for the oldest pending login, or disarms it if
+// there is none
+void armLoginTimer(struct shard *s)
+{
+    struct itimerspec when;
+    memset(&when, 0, sizeof when);
+    
+    if(!s->pendingLogins.empty())
+    {
+        unsigned long deadline = s->pendingLogins.front().deadline;
+        when.it_value.tv_sec = deadline / 1000;
+        when.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    }
+    
+    if(timerfd_settime(s->timerfd, TFD_TIMER_ABSTIME, &when, NULL) == -1)
+    {
+        perror("timerfd_settime");
+    }
+}
+
+
+// Creates the context of a connection accepted by the calling thread and
+// starts the deadline for its login
+// Returns NULL if the socket doesn't fit in the connection table
+struct connection *newConnection(int sockfd)
+{
+    struct connection *conn = allocConnection();
+    conn->sockfd = sockfd;
+    conn->id = nextConnectionID++;
+    conn->owner = currentShard;
+    conn->state = HANDSHAKE;
+    conn->closed = false;
+    conn->dropPending = false;
+    conn->format = FRAMING_UNKNOWN;
+    conn->userID = 0;
+    conn->session = NULL;
+    conn->packetsIn = 0;
+    conn->bytesIn = 0;
+    conn->framesOut = 0;
+    conn->bytesOut = 0;
+    conn->outHead = 0;
+    conn->outBytes = 0;
+    conn->flushPending = false;
+    conn->outBlocked = false;
+    conn->pauseCount = 0;
+    conn->lastSender.owner = NULL;
+    conn->fragmenting = false;
+    conn->fragTarget.owner = NULL;
+    conn->fragInbox = NULL;
+#ifdef USE_IO_URING
+    conn->recvArmed = false;
+    conn->sendInFlight = false;
+    conn->sendFrames = 0;
+#endif
+
+    // Frames are already gathered into one write per client and loop
+    // iteration. Nagle's algorithm would only hold back the next write until
+    // the client acknowledged the last, which it may delay by 40 ms.
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if(!addConnection(conn))
+    {
+        freeConnection(conn);
+        return NULL;
+    }
+    addCount(currentShard->metrics->connections, 1);
+    
+    struct pendingLogin login;
+    login.sockfd = sockfd;
+    login.id = conn->id;
+    login.deadline = monotonicMillis() + loginTimeout * 1000UL;
+    
+    currentShard->pendingLogins.push_back(login);
+    if(currentShard->pendingLogins.size() == 1) armLoginTimer(currentShard);
+    return conn;
+}
+
+
+// Prints the counters of a connection that was closed
+void printConnectionStats(const struct connection *conn)
+{
+    logEvent(LEVEL_INFO, "server: socket %d closed after %lu packets (%lu bytes) in, %lu frames (%lu bytes) out",
+                         conn->sockfd, conn->packetsIn, conn->bytesIn, conn->framesOut, conn->bytesOut);
+}
+
+
+// Closes a client's socket and removes the client from the lists
+// The context is freed at the end of the loop iteration, since other events
+// of the same batch may still refer to it
+void closeConnection(struct connection *conn)
+{
+    if(conn->closed) return;
+    
+    // Dropped clients were removed already
+    if(conn->state != CLOSING) hangUpClient(conn->sockfd);
+    close(conn->sockfd); // Also removes it from the epoll set
+    conn->closed = true;
+    addCount(currentShard->metrics->connections, -1UL);
+    printConnectionStats(conn);
+    releaseSenders(conn);
+    currentShard->closedConns.push_back(conn);
+}
+
+
+// Removes the clients dropped during the loop iteration. Their sockets are
+// closed once the bytes queued for them are sent.
+void finishDrops(struct shard *s)
+{
+    for(auto const & conn : s->droppedConns)
+    {
+        conn->dropPending = false;
+        
+#ifdef USE_IO_URING
+        if(uringActive)
+        {
+            if(conn->closed)
+            {
+                if(!conn->sendInFlight && !conn->recvArmed) freeConnection(conn);
+                continue;
+            }
+            
+            hangUpClient(conn->sockfd);
+            conn->state = CLOSING;
+            releaseSenders(conn);
+            
+            // Shutting the socket down ends the pending receive, which closes it
+            if(!conn->sendInFlight) shutdown(conn->sockfd, SHUT_RDWR);
+            continue;
+        }
+#endif
+        
+        if(conn->closed) continue;
+        
+        hangUpClient(conn->sockfd);
+        conn->state = CLOSING;
+        releaseSenders(conn);
+        if(conn->outQueue.empty()) closeConnection(conn);
+    }
+    s->droppedConns.clear();
+}
+
+
+// Closes the connections of the calling shard that didn't log in before
+// their deadline
+void expireLogins(struct shard *s)
+{
+    uint64_t expirations;
+    if(read(s->timerfd, &expirations, sizeof expirations) == -1 && errno != EAGAIN)
+    {
+        perror("read");
+    }
+    
+    unsigned long now = monotonicMillis();
+    while(!s->pendingLogins.empty() && s->pendingLogins.front().deadline <= now)
+    {
+        struct pendingLogin login = s->pendingLogins.front();
+        s->pendingLogins.pop_front();
+        
+        pthread_rwlock_rdlock(&stateLock);
+        struct connection *conn = connTable[login.sockfd];
+        pthread_rwlock_unlock(&stateLock);
+        
+        // Connections that logged in or closed since stay untouched
+        if(conn != NULL && conn->id == login.id && conn->state == HANDSHAKE)
+        {
+            logEvent(LEVEL_INFO, "server: socket %d did not log in in time", login.sockfd);
+            dropConnection(conn);
+        }
+    }
+    
+    armLoginTimer(s);
+}
+
+
+// Keeps track of the messages a client sends in fragments. Every fragment
+// but the last has FLAG_MORE set, and every one but the first has
+// FLAG_CONTINUED. Fragments are relayed as they arrive, so the server never
+// holds a whole message.
+// Returns false if the fragment continues no message of its type, or the
+// message grew past maxMessageSize, in which case the client is dropped
+bool acceptFragment(struct connection *conn, const struct message& packet)
+{
+    if(packet.flags & FLAG_CONTINUED)
+    {
+        if(!conn->fragmenting || conn->fragType != packet.type) return false;
+        conn->fragBytes += packet.data.length();
+    }
+    else conn->fragBytes = packet.data.length();
+    
+    conn->fragmenting = packet.flags & FLAG_MORE;
+    conn->fragType = packet.type;
+    
+    if(conn->fragBytes > maxMessageSize)
+    {
+        logEvent(LEVEL_INFO, "server: socket %d sent a message longer than %zu bytes, dropping it",
+                             conn->sockfd, maxMessageSize);
+        conn->fragmenting = false;
+        dropConnection(conn);
+        return false;
+    }
+    return true;
+}
+
+
+// Handles a single packet received from a logged in client
+void handlePacket(int sockfd, struct message& packet)
+{
+    string sessionID;
+    uint32_t endedSession = 0;
+    
+    // Only packets that change the client and session lists lock out other
+    // workers. Joins and leaves only lock their session, and a join is only
+    // handed to the hashing threads here, see finishJoin().
+    if(packet.type == MESSAGE || packet.type == DIRMESSAGE || packet.type == QUERY ||
+       packet.type == FILE_OFFER || packet.type == STATS || packet.type == LEAVE_SESS ||
+       packet.type == JOIN)
+    {
+        TRACED(TRACE_LOCK, 0, pthread_rwlock_rdlock(&stateLock));
+    }
+    else
+    {
+        TRACED(TRACE_LOCK, 1, pthread_rwlock_wrlock(&stateLock));
+        expireAbsentMembers();
+        snapshotIfDue();
+    }
+    
+    // Clients only speak for themselves, binary ones don't even name the source
+    struct connection *client = connTable[sockfd];
+    if(client != NULL && client->userID != 0)
+    {
+        packet.source = usernameOf(client);
+        packet.sourceID = client->userID;
+    }
+    
+    // Only chat messages come in fragments
+    if(packet.type != MESSAGE && packet.type != DIRMESSAGE) packet.flags = 0;
+    else if(client != NULL && !acceptFragment(client, packet))
+    {
+        pthread_rwlock_unlock(&stateLock);
+        return;
+    }
+
+    switch(packet.type)
+    {
+        case JOIN:
+            // Logged once the client joined, or was refused
+            joinSession(sockfd, packet.data);
+            break;
+
+
+        case LEAVE_SESS:
+            if (leaveSession(sockfd, endedSession))
+            {
+                logEvent(LEVEL_INFO, "Client '%s' has left session", packet.source.c_str());
+
+            }
+            else
+            {
+                logEvent(LEVEL_INFO, "Client '%s' is not in a session", packet.source.c_str());
+            }
+            break;
+
+        case NEW_SESS:
+            // Logged once the session is created, or refused
+            createSession(sockfd, packet.data);
+            break;
+        case MESSAGE:
+        {
+            // Send message to all clients in the session (excluding the sender),
+            // straight from its member list
+            if(client->session != NULL)
+            {
+                pthread_rwlock_rdlock(&client->session->lock);
+                TRACED(TRACE_FANOUT, client->session->members.size(),
+                       sendToClients(&packet, client->session->members, sockfd));
+                pthread_rwlock_unlock(&client->session->lock);
+                if(client->session->log != NULL && messageFits(&packet))
+                {
+                    TRACED(TRACE_LOG, packet.data.length(), appendToLog(client->session->log, &packet));
+                }
+            }
+            
+            // Messages sent in fragments are logged once, at their last one
+            if(packet.flags & FLAG_MORE) break;
+            logEvent(LEVEL_INFO, "Message sent to session '%s'",
+                     client->session != NULL ? nameOf(client->session->id).c_str() : SESSION_NOT_FOUND);
+            break;
+        }
+        case DIRMESSAGE:
+        {
+            bool sent;
+            TRACED(TRACE_DIRECT, sent, sent = sendDirectMessage(packet, sockfd));
+            if(packet.flags & FLAG_MORE) break;
+            
+            if(!sent)
+            {
+                logEvent(LEVEL_INFO, "Direct message not sent");
+            }
+            else
+            {
+                logEvent(LEVEL_INFO, "Direct message sent");
+            }
+            break;
+        }
+        case QUERY:
+            createList(sockfd);
+            break;
+        case STATS:
+            sendStats(sockfd);
+            break;
+        case FILE_OFFER:
+            if(offerFile(sockfd, packet))
+            {
+                logEvent(LEVEL_INFO, "Client '%s' is sending a file", packet.source.c_str());
+            }
+            else
+            {
+                logEvent(LEVEL_INFO, "File offer refused");
+            }
+            break;
+        default:
+            break;
+    }
+    
+    pthread_rwlock_unlock(&stateLock);
+    if(endedSession != 0) endEmptySession(endedSession);
+}
+
+
+// Hands a packet to the login handshake or to the command dispatch,
+// depending on the stage of the connection. Binary frames include their header.
+void processPacket(struct connection *conn, const char *data, size_t len)
+{
+    unsigned long start = monotonicNanos();
+    unsigned int type = NUM_MSG_TYPES; // Until the packet is parsed
+    
+    conn->packetsIn++;
+    addCount(currentShard->metrics->packetsIn, 1);
+    currentSender.sockfd = conn->sockfd;
+    currentSender.id = conn->id;
+    currentSender.owner = conn->owner;
+    
+    if(conn->state == ACTIVE)
+    {
+        struct message& packet = conn->owner->packet;
+        bool parsed = true;
+        if(conn->format == FRAMING_BINARY) TRACED(TRACE_PARSE, len, messageFromBinary(data, packet));
+        else TRACED(TRACE_PARSE, len, parsed = messageFromPacket(data, len, packet));
+        
+        if(parsed)
+        {
+            type = packet.type;
+            TRACED(TRACE_HANDLE, type, handlePacket(conn->sockfd, packet));
+        }
+    }
+    else if(conn->state == HANDSHAKE)
+    {
+        type = LOGIN;
+        bool admitted;
+        TRACED(TRACE_LOGIN, conn->sockfd, admitted = loginClient(conn, data, len));
+        if(conn->state != VERIFYING) concludeLogin(conn, admitted);
+    }
+    
+    currentSender.owner = NULL;
+    if(type < NUM_MSG_TYPES) recordValue(&currentShard->metrics->latency[type], monotonicNanos() - start);
+}
+
+
+// Splits received bytes into frames and processes every complete one, until
+// reading from the client is paused
+// Returns the number of bytes consumed, the rest wait in the input buffer
+size_t extractFrames(struct connection *conn, const char *data, size_t len)
+{
+    size_t offset = 0;
+    
+    while(offset < len && !isClosing(conn) && conn->pauseCount == 0)
+    {
+        // Clients predating length prefixes start with the ASCII packet type
+        if(conn->format == FRAMING_UNKNOWN)
+        {
+            conn->format = isdigit((unsigned char) data[offset]) ? FRAMING_LEGACY : FRAMING_LENGTH;
+        }
+        
+        size_t start, length, next;
+        if(conn->format == FRAMING_LEGACY)
+        {
+            const char *end = (const char*) memchr(data + offset, '\0', len - offset);
+            if(end == NULL)
+            {
+                if(len - offset >= MAXDATASIZE) break; // Too long, rejected below
+                return offset;
+            }
+            start = offset;
+            length = end - (data + offset);
+            next = start + length + 1;
+        }
+        else if(conn->format == FRAMING_BINARY)
+        {
+            if(len - offset < BINHEADERSIZE) return offset;
+            
+            uint32_t header;
+            memcpy(&header, data + offset, 4);
+            size_t dataLength = ntohl(header);
+            if(dataLength >= MAXDATASIZE) break; // Too long, rejected below
+            
+            start = offset;
+            length = BINHEADERSIZE + dataLength;
+            next = start + length;
+            if(len - start < length) return offset;
+        }
+        else
+        {
+            if(len - offset < FRAMEHEADERSIZE) return offset;
+            
+            uint32_t header;
+            memcpy(&header, data + offset, FRAMEHEADERSIZE);
+            start = offset + FRAMEHEADERSIZE;
+            length = ntohl(header);
+            next = start + length;
+            
+            if(length >= MAXDATASIZE) break; // Too long, rejected below
+            if(len - start < length) return offset;
+        }
+        
+        processPacket(conn, data + start, length);
+        offset = next;
+    }
+    
+    // Stopped on an oversized frame rather than running out of bytes
+    if(offset < len && !isClosing(conn) && conn->pauseCount == 0)
+    {
+        logEvent(LEVEL_INFO, "server: socket %d sent an oversized packet", conn->sockfd);
+        dropConnection(conn);
+        return len;
+    }
+    return offset;
+}
+
+
+// Processes bytes received from a client. Complete frames are handled
+// straight from the receive buffer, only a trailing partial frame, or the
+// frames left over when reading was paused, are kept in the connection's
+// input buffer.
+void processInput(struct connection *conn, const char *data, size_t len)
+{
+    conn->bytesIn += len;
+    addCount(currentShard->metrics->bytesIn, len);
+    if(conn->inBuf.empty())
+    {
+        size_t consumed = extractFrames(conn, data, len);
+        conn->inBuf.assign(data + consumed, len - consumed);
+        return;
+    }
+    
+    conn->inBuf.append(data, len);
+    size_t consumed = extractFrames(conn, conn->inBuf.data(), conn->inBuf.length());
+    conn->inBuf.erase(0, consumed);
+}
+
+
+// Accepts every pending connection on the listener. The clients log in
+// through the event loop once their LOGIN packet arrives.
+void acceptClients(int epfd, int listener)
+{
+    char remoteIP[INET6_ADDRSTRLEN];
+    
+    while(1)
+    {
+        struct sockaddr_storage remoteaddr; // client address
+        socklen_t addrlen = sizeof(remoteaddr);
+        int newfd = accept4(listener, (struct sockaddr *)&remoteaddr, &addrlen, SOCK_NONBLOCK);
+
+        if (newfd == -1)
+        {
+            // No more pending connections
+            if(errno != EAGAIN && errno != EWOULDBLOCK) logEvent(LEVEL_WARN, "accept: %s", strerror(errno));
+            return;
+        }
+        
+        struct connection *conn = newConnection(newfd);
+        if(conn == NULL)
+        {
+            close(newfd);
+            continue;
+        }
+        if(!watchConnection(epfd, conn, EPOLLIN | EPOLLOUT | EPOLLRDHUP))
+        {
+            closeConnection(conn);
+            continue;
+        }
+
+        logEvent(LEVEL_INFO, "server: new connection from %s on socket %d",
+                          inet_ntop(remoteaddr.ss_family,
+                              get_in_addr((struct sockaddr*)&remoteaddr),
+                              remoteIP, INET6_ADDRSTRLEN),
+                              newfd);
+    }
+}
+
+
+// Reads every packet available on a client's socket
+// Returns false if the connection was closed
+bool readFromClient(struct connection *conn)
+{
+    int sockfd = conn->sockfd;
+    char buf[READBUFSIZE];
+    
+    for(int reads = 0; ; reads++)
+    {
+        int nbytes;
+        
+        if(conn->closed) return false;
+        
+        // A client that keeps sending can't hold up the rest of the shard
+        if(reads == READS_PER_EVENT)
+        {
+            currentShard->resumedConns.push_back(make_pair(sockfd, conn->id));
+            return true;
+        }
+        
+        // Unread bytes stay in the socket, so the kernel slows the client
+        // down until reading resumes
+        if(conn->pauseCount > 0) return true;
+
+        if ((nbytes = recv(sockfd, buf, READBUFSIZE, 0)) <= 0)
+        {
+            // Socket drained, wait for the next edge
+            if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            
+            // Got error or connection closed by client
+            if (nbytes == 0) logEvent(LEVEL_INFO, "server: socket %d hung up", sockfd);
+            else logEvent(LEVEL_WARN, "recv: %s", strerror(errno));
+            
+            closeConnection(conn);
+            return false;
+        }
+        
+        // Bytes arriving after the server dropped the client are discarded
+        if(!isClosing(conn)) processInput(conn, buf, nbytes);
+    }
+}
+
+
+// Takes the oldest item out of a shard's mailbox
+// Only the thread owning the shard may call this
+// Returns NULL if the mailbox is empty
+struct mailItem *takeFromMailbox(struct shard *s)
+{
+    struct mailItem *tail = s->mailTail;
+    struct mailItem *next = tail->next.load(memory_order_acquire);
+    
+    // Skip over the stub
+    if(tail == &s->mailStub)
+    {
+        if(next == NULL) return NULL;
+        s->mailTail = next;
+        tail = next;
+        next = next->next.load(memory_order_acquire);
+    }
+    
+    if(next != NULL)
+    {
+        s->mailTail = next;
+        return tail;
+    }
+    
+    // A producer hasn't linked its item yet. It signals the shard once it has.
+    if(tail != s->mailHead.load(memory_order_acquire)) return NULL;
+    
+    // tail is the last item, queue the stub behind it so tail can be taken
+    s->mailStub.next.store(NULL, memory_order_relaxed);
+    struct mailItem *prev = s->mailHead.exchange(&s->mailStub, memory_order_acq_rel);
+    prev->next.store(&s->mailStub, memory_order_release);
+    
+    next = tail->next.load(memory_order_acquire);
+    if(next != NULL)
+    {
+        s->mailTail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+// Hands a delivered mailbox item back to the worker that allocated it, which
+// keeps it and its recipient list's capacity for the next one
+void recycleMailItem(struct mailItem *item)
+{
+    item->recipients.clear();
+    
+    struct shard *home = item->home;
+    if(home != currentShard)
+    {
+        struct mailItem *next = home->returnedItems.load(memory_order_relaxed);
+        do item->next.store(next, memory_order_relaxed);
+        while(!home->returnedItems.compare_exchange_weak(next, item, memory_order_release,
+                                                         memory_order_relaxed));
+    }
+    else if(home->mailPool.size() < MAIL_POOL_MAX) home->mailPool.push_back(item);
+    else delete item;
+}
+
+
+// Delivers every packet other workers forwarded to the calling thread and
+// applies their pause requests
+void drainMailbox(struct shard *s)
+{
+    uint64_t count;
+    if(read(s->wakefd, &count, sizeof count) == -1 && errno != EAGAIN) perror("read");
+    
+    // Items posted from here on signal the shard again
+    s->wakePending.store(false, memory_order_release);
+    
+    if(s->statsRequested.exchange(false)) printFlushStats(s);
+    if(reloadRequested.exchange(false)) reloadCredentials();
+    finishCheckedJobs(s);
+    
+    pthread_rwlock_rdlock(&stateLock);
+    
+    struct mailItem *item;
+    while((item = takeFromMailbox(s)) != NULL)
+    {
+        for(auto const & recipient : item->recipients)
+        {
+            // Skip clients that hung up since, their socket may have been reused
+            struct connection *conn = connTable[recipient.first];
+            if(conn == NULL || conn->id != recipient.second) continue;
+            
+            if(item->kind == MAIL_DELIVER)
+            {
+                currentSender = item->sender;
+                deliver(conn, item->data, item->sourceID);
+                currentSender.owner = NULL;
+            }
+            else adjustPause(conn, item->kind == MAIL_PAUSE ? 1 : -1);
+        }
+        if(item->data != NULL) releaseFrame(item->data);
+        recycleMailItem(item);
+    }
+    
+    pthread_rwlock_unlock(&stateLock);
+}
+
+
+#ifdef USE_IO_URING
+
+// Tags stored in the low bits of a completion's user_data next to the connection
+enum uringOp {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_POLL,
+    URING_CANCEL
+};
+
+// Memory shared with the kernel for one io_uring instance
+struct uringQueue {
+    int ringfd;
+    
+    // Submission queue
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqEntries;
+    unsigned sqLocalTail; // Tail including SQEs that were not published yet
+    
+    // Completion queue
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    
+    // Provided receive buffers
+    struct io_uring_buf_ring *bufRing;
+    char *bufBase;
+    
+    bool multishotRecv; // Cleared if the kernel rejects multishot recv
+};
+
+thread_local struct uringQueue ring;
+
+
+// Maps the submission and completion queues of a new ring
+// Returns false if the kernel doesn't support io_uring
+bool uringSetup(struct uringQueue *q)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    
+    q->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(q->ringfd < 0) return false;
+    
+    // Both rings share one mapping on every kernel that supports buffer rings
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(q->ringfd);
+        return false;
+    }
+    
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+    
+    char *ringPtr = (char*) mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, q->ringfd, IORING_OFF_SQ_RING);
+    q->sqes = (struct io_uring_sqe*) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          q->ringfd, IORING_OFF_SQES);
+    if(ringPtr == MAP_FAILED || q->sqes == MAP_FAILED)
+    {
+        close(q->ringfd);
+        return false;
+    }
+    
+    q->sqHead = (unsigned*) (ringPtr + params.sq_off.head);
+    q->sqTail = (unsigned*) (ringPtr + params.sq_off.tail);
+    q->sqMask = (unsigned*) (ringPtr + params.sq_off.ring_mask);
+    q->sqArray = (unsigned*) (ringPtr + params.sq_off.array);
+    q->sqEntries = params.sq_entries;
+    q->sqLocalTail = *q->sqTail;
+    
+    q->cqHead = (unsigned*) (ringPtr + params.cq_off.head);
+    q->cqTail = (unsigned*) (ringPtr + params.cq_off.tail);
+    q->cqMask = (unsigned*) (ringPtr + params.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe*) (ringPtr + params.cq_off.cqes);
+    
+    q->multishotRecv = true;
+    return true;
+}
+
+
+// Checks that the kernel implements every operation used by the backend
+bool uringProbe(struct uringQueue *q)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*) calloc(1, len);
+    
+    bool supported = syscall(__NR_io_uring_register, q->ringfd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL};
+    
+    for(int op : ops)
+    {
+        if(!supported || op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            supported = false;
+        }
+    }
+    
+    free(probe);
+    return supported;
+}
+
+
+// Hands a receive buffer (back) to the kernel
+void uringProvideBuffer(struct uringQueue *q, unsigned short bid)
+{
+    // Index the ring directly: in C++ the header's flexible bufs[] member
+    // doesn't start at offset 0 like the kernel expects
+    struct io_uring_buf *bufs = (struct io_uring_buf*) q->bufRing;
+    unsigned short tail = q->bufRing->tail;
+    struct io_uring_buf *buf = &bufs[tail & (URING_NUM_BUFS - 1)];
+    
+    buf->addr = (unsigned long) (q->bufBase + bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    
+    __atomic_store_n(&q->bufRing->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+
+// Registers the ring of provided buffers that receives are served from
+// Returns false if the kernel doesn't support buffer rings
+bool uringSetupBuffers(struct uringQueue *q)
+{
+    size_t ringSize = URING_NUM_BUFS * sizeof(struct io_uring_buf);
+    
+    q->bufRing = (struct io_uring_buf_ring*) mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    q->bufBase = (char*) malloc(URING_NUM_BUFS * URING_BUF_SIZE);
+    if(q->bufRing == MAP_FAILED || q->bufBase == NULL) return false;
+    
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long) q->bufRing;
+    reg.ring_entries = URING_NUM_BUFS;
+    reg.bgid = URING_BUF_GROUP;
+    
+    if(syscall(__NR_io_uring_register, q->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        return false;
+    }
+    
+    q->bufRing->tail = 0;
+    for(unsigned short bid = 0; bid < URING_NUM_BUFS; bid++) uringProvideBuffer(q, bid);
+    return true;
+}
+
+
+// Submits every queued SQE and waits for at least minComplete completions
+void uringSubmit(struct uringQueue *q, unsigned minComplete)
+{
+    unsigned toSubmit = q->sqLocalTail - *q->sqTail;
+    __atomic_store_n(q->sqTail, q->sqLocalTail, __ATOMIC_RELEASE);
+    
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if(syscall(__NR_io_uring_enter, q->ringfd, toSubmit, minComplete, flags, NULL, 0) < 0 &&
+       errno != EINTR)
+    {
+        perror("io_uring_enter");
+        exit(4);
+    }
+}
+
+
+// Returns a cleared SQE tagged with the given operation and connection
+struct io_uring_sqe *uringGetSqe(struct uringQueue *q, enum uringOp op, struct connection *conn)
+{
+    // Submission queue is full, hand what we have to the kernel first
+    if(q->sqLocalTail - __atomic_load_n(q->sqHead, __ATOMIC_ACQUIRE) == q->sqEntries)
+    {
+        uringSubmit(q, 0);
+    }
+    
+    unsigned index = q->sqLocalTail & *q->sqMask;
+    struct io_uring_sqe *sqe = &q->sqes[index];
+    
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (unsigned long) conn | op;
+    q->sqArray[index] = index;
+    q->sqLocalTail++;
+    
+    return sqe;
+}
+
+
+// Queues a multishot accept on the listener
+void uringArmAccept(struct uringQueue *q, struct connection *listenerConn)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(q, URING_ACCEPT, listenerConn);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenerConn->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+
+// Queues a multishot poll on one of the shard's own descriptors, the
+// mailbox eventfd or the login timer
+void uringArmPoll(struct uringQueue *q, struct connection *pollConn)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(q, URING_POLL, pollConn);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = pollConn->sockfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+
+// Queues a receive into a provided buffer on a client's socket
+void uringArmRecv(struct uringQueue *q, struct connection *conn)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(q, URING_RECV, conn);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->sockfd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    if(q->multishotRecv) sqe->ioprio = IORING_RECV_MULTISHOT;
+    conn->recvArmed = true;
+}
+
+
+// Queues a send of the connection's in-flight frames
+void uringArmSend(struct uringQueue *q, struct connection *conn)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(q, URING_SEND, conn);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->sockfd;
+    sqe->addr = (unsigned long) &conn->sendMsg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+
+// Starts sending a connection's queued frames. At most one send per
+// connection is in the ring at a time so that bytes can't be reordered; it
+// gathers every queued frame straight from the shared buffers, so only the
+// socket limits how fast a client is served.
+void uringFlush(struct connection *conn)
+{
+    if(conn->closed || conn->sendInFlight || conn->outQueue.empty()) return;
+    
+    conn->sendFrames = conn->outQueue.size() < IOV_MAX ? conn->outQueue.size() : IOV_MAX;
+    conn->sendIov.resize(conn->sendFrames);
+    conn->sendBytes = 0;
+    for(size_t i = 0; i < conn->sendFrames; i++)
+    {
+        struct frame *f = conn->outQueue[i];
+        size_t skip = i == 0 ? conn->outHead : 0;
+        conn->sendIov[i].iov_base = f->data + skip;
+        conn->sendIov[i].iov_len = f->len - skip;
+        conn->sendBytes += f->len - skip;
+    }
+    
+    memset(&conn->sendMsg, 0, sizeof conn->sendMsg);
+    conn->sendMsg.msg_iov = conn->sendIov.data();
+    conn->sendMsg.msg_iovlen = conn->sendFrames;
+    
+    conn->sendInFlight = true;
+    conn->sendIteration = currentShard->loopIteration;
+    uringArmSend(&ring, conn);
+    currentShard->flushes++;
+    currentShard->writeCalls++;
+}
+
+
+// Cancels the receive of a client whose reads are paused. Bytes it already
+// received are kept in its input buffer.
+void uringCancelRecv(struct connection *conn)
+{
+    if(!conn->recvArmed) return;
+    
+    struct io_uring_sqe *sqe = uringGetSqe(&ring, URING_CANCEL, conn);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long) conn | URING_RECV;
+}
+
+
+// Closes a client's socket once its final receive completed. Its context is
+// freed once no send refers to it.
+void uringCloseConnection(struct connection *conn)
+{
+    if(!conn->closed)
+    {
+        // Dropped clients were removed already
+        if(conn->state != CLOSING) hangUpClient(conn->sockfd);
+        close(conn->sockfd);
+        conn->closed = true;
+        addCount(currentShard->metrics->connections, -1UL);
+        printConnectionStats(conn);
+        releaseSenders(conn);
+    }
+    
+    // Dropped clients are freed once the drop is finished
+    if(!conn->sendInFlight && !conn->recvArmed && !conn->dropPending) freeConnection(conn);
+}
+
+
+// Starts receiving from a client accepted by the ring. The client logs in
+// once its LOGIN packet arrives.
+void uringAcceptClient(int newfd)
+{
+    char remoteIP[INET6_ADDRSTRLEN];
+    struct sockaddr_storage remoteaddr; // client address
+    socklen_t addrlen = sizeof(remoteaddr);
+    getpeername(newfd, (struct sockaddr *)&remoteaddr, &addrlen);
+    
+    struct connection *conn = newConnection(newfd);
+    if(conn == NULL)
+    {
+        close(newfd);
+        return;
+    }
+    uringArmRecv(&ring, conn);
+    
+    logEvent(LEVEL_INFO, "server: new connection from %s on socket %d",
+                      inet_ntop(remoteaddr.ss_family,
+                          get_in_addr((struct sockaddr*)&remoteaddr),
+                          remoteIP, INET6_ADDRSTRLEN),
+                          newfd);
+}
+
+
+// Handles a completed receive on a client's socket
+void uringHandleRecv(struct connection *conn, struct io_uring_cqe *cqe)
+{
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    
+    if(cqe->res > 0)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = ring.bufBase + bid * URING_BUF_SIZE;
+        
+        // Bytes arriving after the server dropped the client are discarded,
+        // and bytes arriving before a pause took effect wait for the resume
+        if(conn->pauseCount > 0 && !isClosing(conn)) conn->inBuf.append(buf, cqe->res);
+        else if(!isClosing(conn)) processInput(conn, buf, cqe->res);
+        uringProvideBuffer(&ring, bid);
+        
+        // The kernel stops a multishot receive when it can't post more completions
+        if(!more)
+        {
+            if(conn->pauseCount == 0) uringArmRecv(&ring, conn);
+            else conn->recvArmed = false;
+        }
+        return;
+    }
+    
+    // Cancelled because reads were paused, rearmed once they resume
+    if(cqe->res == -ECANCELED)
+    {
+        conn->recvArmed = false;
+        if(conn->closed) uringCloseConnection(conn);
+        else if(conn->pauseCount == 0 && !isClosing(conn)) uringArmRecv(&ring, conn);
+        return;
+    }
+    
+    // Ran out of provided buffers, or the kernel predates multishot receives
+    if(cqe->res == -ENOBUFS || (cqe->res == -EINVAL && ring.multishotRecv))
+    {
+        if(cqe->res == -EINVAL) ring.multishotRecv = false;
+        if(!more)
+        {
+            if(conn->pauseCount == 0) uringArmRecv(&ring, conn);
+            else conn->recvArmed = false;
+        }
+        return;
+    }
+    
+    // Got error or connection closed by client
+    if(conn->state != CLOSING)
+    {
+        if(cqe->res == 0) logEvent(LEVEL_INFO, "server: socket %d hung up", conn->sockfd);
+        else logEvent(LEVEL_WARN, "recv: %s", strerror(-cqe->res));
+    }
+    
+    conn->recvArmed = false;
+    uringCloseConnection(conn);
+}
+
+
+// Handles a completed send, resubmitting short writes and queued frames
+void uringHandleSend(struct connection *conn, struct io_uring_cqe *cqe)
+{
+    if(conn->closed)
+    {
+        conn->sendInFlight = false;
+        uringCloseConnection(conn);
+        return;
+    }
+    
+    conn->sendInFlight = false;
+    
+    if(cqe->res < 0)
+    {
+        logEvent(LEVEL_WARN, "send: %s", strerror(-cqe->res));
+        discardOutput(conn);
+        if(conn->state == CLOSING) shutdown(conn->sockfd, SHUT_RDWR);
+        else dropConnection(conn);
+        return;
+    }
+    
+    // A short write means the socket is full, so a queue that is still too
+    // long belongs to a slow client
+    consumeOutput(conn, cqe->res);
+    if((size_t) cqe->res < conn->sendBytes && conn->outBytes > highWatermark) handleSlowConsumer(conn);
+    
+    // Short writes are resent along with the frames queued since
+    uringFlush(conn);
+    if(conn->outBytes <= lowWatermark) releaseSenders(conn);
+    
+    // Everything was sent, a dropped connection can be shut down now
+    if(!conn->sendInFlight && conn->state == CLOSING) shutdown(conn->sockfd, SHUT_RDWR);
+}
+
+
+// Sets up the io_uring backend
+// Returns false if the running kernel lacks a required feature
+bool uringInit()
+{
+    if(!uringSetup(&ring)) return false;
+    if(!uringProbe(&ring) || !uringSetupBuffers(&ring))
+    {
+        close(ring.ringfd);
+        return false;
+    }
+    return true;
+}
+
+
+// Main loop of the io_uring backend. Every send and receive queued while
+// handling a batch of completions is submitted with one io_uring_enter().
+void runUringLoop(struct shard *s)
+{
+    struct connection listenerConn, wakeConn, timerConn;
+    listenerConn.sockfd = s->listener;
+    wakeConn.sockfd = s->wakefd;
+    timerConn.sockfd = s->timerfd;
+    uringArmAccept(&ring, &listenerConn);
+    uringArmPoll(&ring, &wakeConn);
+    uringArmPoll(&ring, &timerConn);
+    
+    while(1)
+    {
+        s->loopIteration++;
+        uringSubmit(&ring, s->resumedConns.empty() ? 1 : 0);
+        resumeConnections(s);
+        
+        unsigned head = *ring.cqHead;
+        while(head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            struct connection *conn = (struct connection*) (cqe->user_data & ~7UL);
+            
+            switch(cqe->user_data & 7)
+            {
+                case URING_ACCEPT:
+                    if(cqe->res >= 0) uringAcceptClient(cqe->res);
+                    else logEvent(LEVEL_WARN, "accept: %s", strerror(-cqe->res));
+                    if(!(cqe->flags & IORING_CQE_F_MORE)) uringArmAccept(&ring, conn);
+                    break;
+                case URING_RECV:
+                    uringHandleRecv(conn, cqe);
+                    break;
+                case URING_SEND:
+                    uringHandleSend(conn, cqe);
+                    break;
+                case URING_POLL:
+                    if(conn == &wakeConn) TRACED(TRACE_MAILBOX, 0, drainMailbox(s));
+                    else expireLogins(s);
+                    if(!(cqe->flags & IORING_CQE_F_MORE)) uringArmPoll(&ring, conn);
+                    break;
+                case URING_CANCEL:
+                    break;
+            }
+            
+            head++;
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        }
+        
+        flushDirty(s);
+        finishDrops(s);
+        arenaReset(s);
+    }
+}
+
+#endif // USE_IO_URING
+
+
+// Continues reading from the clients whose pause ended or whose reads ran
+// out during the previous loop iteration, starting with the frames they sent
+// before being paused
+void resumeConnections(struct shard *s)
+{
+    // Processing the frames can pause and resume clients again
+    vector<pair<int, unsigned long>> resumed;
+    resumed.swap(s->resumedConns);
+    
+    for(auto const & ref : resumed)
+    {
+        // A client closed since may have had its socket reused by another worker
+        pthread_rwlock_rdlock(&stateLock);
+        struct connection *conn = connTable[ref.first];
+        pthread_rwlock_unlock(&stateLock);
+        if(conn == NULL || conn->id != ref.second || isClosing(conn) || conn->pauseCount > 0) continue;
+        
+        if(!conn->inBuf.empty()) processInput(conn, NULL, 0);
+        if(isClosing(conn) || conn->pauseCount > 0) continue;
+        
+#ifdef USE_IO_URING
+        if(uringActive)
+        {
+            if(!conn->recvArmed) uringArmRecv(&ring, conn);
+            continue;
+        }
+#endif
+        readFromClient(conn);
+    }
+}
+
+
+// Main loop of the portable epoll backend
+void runEpollLoop(struct shard *s)
+{
+    struct epoll_event events[MAXEVENTS];
+    
+    int epfd = epoll_create1(0);
+    if(epfd == -1)
+    {
+        perror("epoll_create1");
+        exit(4);
+    }
+    
+    // Add the listener, the mailbox eventfd and the login timer to the epoll set
+    struct connection listenerConn, wakeConn, timerConn;
+    listenerConn.sockfd = s->listener;
+    wakeConn.sockfd = s->wakefd;
+    timerConn.sockfd = s->timerfd;
+    if(!setNonBlocking(s->listener) || !watchConnection(epfd, &listenerConn, EPOLLIN) ||
+       !watchConnection(epfd, &wakeConn, EPOLLIN) || !watchConnection(epfd, &timerConn, EPOLLIN))
+    {
+        exit(4);
+    }
+
+    // Main loop
+    while(1)
+    {
+        // Don't block while clients are waiting to be read from
+        int numEvents = epoll_wait(epfd, events, MAXEVENTS, s->resumedConns.empty() ? -1 : 0);
+        if (numEvents == -1)
+        {
+            if(errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(4);
+        }
+        
+        resumeConnections(s);
+
+        // Only run through the connections that have something to read or
+        // became writable
+        for(int i = 0; i < numEvents; i++)
+        {
+            struct connection *conn = (struct connection*) events[i].data.ptr;
+            
+            if (conn == &listenerConn) acceptClients(epfd, s->listener); // Handle new connections
+            else if (conn == &wakeConn) TRACED(TRACE_MAILBOX, 0, drainMailbox(s)); // Handle packets from other workers
+            else if (conn == &timerConn) expireLogins(s); // Handle logins that took too long
+            else
+            {
+                if (events[i].events & EPOLLOUT) flushConnection(conn); // Send queued frames
+                if (events[i].events & ~EPOLLOUT) readFromClient(conn); // Handle commands from client
+            }
+        }
+        
+        flushDirty(s);
+        finishDrops(s);
+        arenaReset(s);
+        
+        // No event of this batch refers to the closed connections anymore
+        for(auto const & conn : s->closedConns) freeConnection(conn);
+        s->closedConns.clear();
+    } // END while
+}
+
+
+// Creates a shard with its own listener and an empty mailbox
+struct shard *createShard(int id, const char* portNum, bool reusePort)
+{
+    struct shard *s = new shard;
+    s->id = id;
+    s->listener = createListenerSocket(portNum, reusePort);
+    s->wakefd = eventfd(0, EFD_NONBLOCK);
+    s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(s->wakefd == -1 || s->timerfd == -1)
+    {
+        perror("eventfd");
+        exit(4);
     }
     
-    string sessionID, sessionPassword;
-    stringstream ss(sessionData);
+    s->wakePending.store(false);
+    s->loopIteration = 0;
+    s->statsRequested.store(false);
+    s->metrics = new metrics();
+    pthread_mutex_init(&s->jobLock, NULL);
+    s->flushes = 0;
+    s->framesFlushed = 0;
+    s->writeCalls = 0;
+    s->framesReused = 0;
+    s->itemsReused = 0;
+    for(auto & returned : s->returnedFrames) returned.store(NULL);
+    s->returnedItems.store(NULL);
+    s->mailStub.next.store(NULL);
+    s->mailHead.store(&s->mailStub);
+    s->mailTail = &s->mailStub;
+    return s;
+}
+
+
+// Asks every worker thread to print its output counters
+void requestFlushStats(int signum)
+{
+    for(auto const & s : shards)
+    {
+        uint64_t one = 1;
+        s->statsRequested.store(true);
+        if(write(s->wakefd, &one, sizeof one) == -1) {} // Nothing to do about it here
+    }
+}
+
+
+// Data connections of file transfers by socket, ready transfers and finished
+// ones waiting to be freed. Only touched by the transfer thread.
+unordered_map<int, struct dataConnection> dataConns;
+vector<struct transfer*> readyTransfers;
+vector<struct transfer*> closedTransfers;
+int transferEpfd = -1;
+int devNull = -1;
+
+
+// Closes a data connection of a file transfer
+void closeDataConnection(int fd)
+{
+    dataConns.erase(fd);
+    close(fd);
+}
+
+
+// Ends a transfer, closing the data connections of everyone in it. Clients
+// tell a finished transfer from an aborted one by the number of bytes.
+void closeTransfer(struct transfer *t)
+{
+    if(t->closed) return;
+    t->closed = true;
     
-    ss >> sessionID >> sessionPassword;
+    if(!t->started)
+    {
+        pthread_mutex_lock(&transferLock);
+        transferTokens.erase(t->sendToken);
+        transferTokens.erase(t->recvToken);
+        pthread_mutex_unlock(&transferLock);
+    }
     
-    // Insert returns a pair describing if the insertion was successful
-    auto res = sessionList.insert(make_pair(sessionID, unordered_set<int>({sockfd})));
-    if(res.second == false)
+    if(t->sender != -1) closeDataConnection(t->sender);
+    for(auto const & sink : t->sinks)
     {
-        ack.type = NS_NAK;
-        ack.data = "Session already exists!";
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
+        if(sink.sockfd != -1) closeDataConnection(sink.sockfd);
+        close(sink.pipefd[0]);
+        close(sink.pipefd[1]);
+    }
+    if(t->pipefd[0] != -1)
+    {
+        close(t->pipefd[0]);
+        close(t->pipefd[1]);
+    }
+    closedTransfers.push_back(t);
+}
+
+
+// Stops sending a transfer to a recipient whose connection failed
+void dropSink(struct transferSink& sink)
+{
+    closeDataConnection(sink.sockfd);
+    sink.sockfd = -1;
+    sink.pending = 0;
+}
+
+
+// Moves the next chunk of a transfer along. What the recipients' pipes hold
+// goes out to their sockets, and once all of them took it, the next chunk
+// is taken from the sender and teed into their pipes. The slowest recipient
+// paces the transfer, and TCP the sender. A single chunk per call keeps one
+// transfer from holding up the others.
+// Returns true if the transfer can go on without waiting for its sockets
+bool pumpTransfer(struct transfer *t)
+{
+    bool pending = false, live = false;
+    for(auto & sink : t->sinks)
+    {
+        if(sink.sockfd == -1) continue;
+        if(sink.pending > 0)
+        {
+            ssize_t n = splice(sink.pipefd[0], NULL, sink.sockfd, NULL, sink.pending,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n == -1 && errno != EAGAIN)
+            {
+                dropSink(sink);
+                continue;
+            }
+            if(n > 0) sink.pending -= n;
+        }
+        live = true;
+        pending |= sink.pending > 0;
+    }
+    
+    if(!live)
+    {
+        logEvent(LEVEL_INFO, "server: every recipient of '%s' is gone", t->name.c_str());
+        closeTransfer(t);
         return false;
     }
-    else if (sessionID == ACK_DATA)
+    if(pending) return false;
+    
+    if(t->moved == t->size)
     {
-        ack.type = NS_NAK;
-        ack.data = "No session ID was provided!";
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;  
+        logEvent(LEVEL_INFO, "server: sent '%s' (%lu bytes)", t->name.c_str(), (unsigned long) t->size);
+        closeTransfer(t);
+        return false;
+    }
+    
+    size_t len = min((uint64_t) TRANSFER_CHUNK, t->size - t->moved);
+    ssize_t n = splice(t->sender, NULL, t->pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n == -1 && errno == EAGAIN) return false;
+    if(n <= 0)
+    {
+        logEvent(LEVEL_INFO, "server: sender of '%s' stopped after %lu bytes", t->name.c_str(),
+                             (unsigned long) t->moved);
+        closeTransfer(t);
+        return false;
     }
+    t->moved += n;
     
+    // Every recipient's pipe is empty, so each one takes the whole chunk. The
+    // last one moves it out of the sender's pipe, the others get copies.
+    struct transferSink *last = NULL;
+    for(auto & sink : t->sinks)
+    {
+        if(sink.sockfd == -1) continue;
+        if(last != NULL)
+        {
+            if(tee(t->pipefd[0], last->pipefd[1], n, SPLICE_F_NONBLOCK) == n) last->pending = n;
+            else dropSink(*last);
+        }
+        last = &sink;
+    }
+    ssize_t moved = splice(t->pipefd[0], NULL, last->pipefd[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(moved == n) last->pending = n;
     else
     {
-        // Recording password of the created session list
-        sessionPasswordList.insert(make_pair(sessionID, sessionPassword));
-        
-        ack.type = NS_ACK;
-        ack.data = sessionID;
-        ack.size = ack.data.length() + 1;
+        dropSink(*last);
         
-        sendToClient(&ack, sockfd);
-        return true;
+        // What the pipe still holds would end up in the next chunk
+        while(splice(t->pipefd[0], NULL, devNull, NULL, TRANSFER_CHUNK, SPLICE_F_NONBLOCK) > 0);
     }
+    return true;
 }
 
 
-// Send an acknowledge to a client for requesting a list
-void acknowledgeList(int sockfd, string buffer)
+// Queues a transfer to be pumped in the next loop iteration
+void readyTransfer(struct transfer *t)
 {
-    struct message listAck;
-    listAck.type = QU_ACK;
-    listAck.size = buffer.length() + 1;
-    listAck.source = "SERVER";
-    listAck.data = buffer;
+    if(t->closed || t->ready) return;
+    t->ready = true;
+    readyTransfers.push_back(t);
+}
+
+
+// Starts relaying a file once its sender and recipients are connected.
+// Recipients that connect later are turned away.
+void startTransfer(struct transfer *t)
+{
+    pthread_mutex_lock(&transferLock);
+    transferTokens.erase(t->sendToken);
+    transferTokens.erase(t->recvToken);
+    pthread_mutex_unlock(&transferLock);
     
-    sendToClient(&listAck, sockfd);
+    t->started = true;
+    logEvent(LEVEL_INFO, "server: sending '%s' (%lu bytes) to %zu clients", t->name.c_str(),
+                         (unsigned long) t->size, t->sinks.size());
+    readyTransfer(t);
 }
 
 
-void createList(int sockfd)
+// Reads the token a data connection starts with, exactly 8 bytes so whatever
+// the sender sends after it stays in the socket, and adds the connection to
+// the transfer the token belongs to
+void readToken(int fd)
 {
-    string buffer = "\nClients Online: ";
+    struct dataConnection& conn = dataConns[fd];
+    ssize_t n = recv(fd, conn.token + conn.tokenBytes, sizeof conn.token - conn.tokenBytes, 0);
+    if(n == -1 && errno == EAGAIN) return;
+    if(n <= 0)
+    {
+        closeDataConnection(fd);
+        return;
+    }
+    conn.tokenBytes += n;
+    if(conn.tokenBytes < sizeof conn.token) return;
+    
+    uint64_t token;
+    memcpy(&token, conn.token, sizeof token);
+    token = be64toh(token);
+    
+    pthread_mutex_lock(&transferLock);
+    auto it = transferTokens.find(token);
+    struct transfer *t = it != transferTokens.end() ? it->second : NULL;
+    pthread_mutex_unlock(&transferLock);
+    
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    if(t != NULL && token == t->sendToken && t->sender == -1)
+    {
+        if(pipe2(t->pipefd, O_NONBLOCK) == -1)
+        {
+            perror("pipe2");
+            closeDataConnection(fd);
+            return;
+        }
+        t->sender = fd;
+        conn.sink = -1;
+        ev.events = EPOLLIN | EPOLLET;
+    }
+    else if(t != NULL && token == t->recvToken && t->sinks.size() < t->expected)
+    {
+        struct transferSink sink;
+        if(pipe2(sink.pipefd, O_NONBLOCK) == -1)
+        {
+            perror("pipe2");
+            closeDataConnection(fd);
+            return;
+        }
+        sink.sockfd = fd;
+        sink.pending = 0;
+        conn.sink = t->sinks.size();
+        t->sinks.push_back(sink);
+        ev.events = EPOLLOUT | EPOLLET;
+    }
+    else
+    {
+        closeDataConnection(fd);
+        return;
+    }
     
-    for(auto it : clientList){
-        buffer += it.second.first + " ";
+    conn.t = t;
+    epoll_ctl(transferEpfd, EPOLL_CTL_MOD, fd, &ev);
+    if(t->sender != -1 && t->sinks.size() == t->expected) startTransfer(t);
+}
+
+
+// Accepts every pending data connection
+void acceptDataConnections(int listener)
+{
+    while(1)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if(fd == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        if(!setNonBlocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+        
+        struct dataConnection conn;
+        conn.t = NULL;
+        conn.sink = -1;
+        conn.tokenBytes = 0;
+        conn.deadline = monotonicMillis() + TRANSFER_TIMEOUT * 1000UL;
+        dataConns[fd] = conn;
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        epoll_ctl(transferEpfd, EPOLL_CTL_ADD, fd, &ev);
+        readToken(fd);
     }
+}
+
+
+// Closes data connections that didn't send their token in time, and starts
+// the transfers whose deadline passed with their sender and at least one
+// recipient connected. The others are dropped.
+void expireTransfers()
+{
+    unsigned long now = monotonicMillis();
     
+    vector<int> expired;
+    for(auto const & it : dataConns)
+    {
+        if(it.second.t == NULL && it.second.deadline <= now) expired.push_back(it.first);
+    }
+    for(auto const & fd : expired) closeDataConnection(fd);
     
-    buffer += "\nAvailable Sessions: ";
-    for(auto it : sessionList){
-        buffer += it.first + " ";
+    vector<struct transfer*> due;
+    pthread_mutex_lock(&transferLock);
+    for(auto const & it : transferTokens)
+    {
+        if(it.first == it.second->sendToken && it.second->deadline <= now) due.push_back(it.second);
     }
+    pthread_mutex_unlock(&transferLock);
     
-    acknowledgeList(sockfd, buffer);
+    for(auto const & t : due)
+    {
+        if(t->sender != -1 && !t->sinks.empty()) startTransfer(t);
+        else
+        {
+            logEvent(LEVEL_INFO, "server: nobody connected to receive '%s'", t->name.c_str());
+            closeTransfer(t);
+        }
+    }
 }
 
 
-// Sends a direct message to a client specified in the data of the given packet
-// If the client doesn't exist, inform sender
-// Returns true if message sent successfully
-bool sendDirectMessage(struct message packet, int senderfd)
+// Runs the file transfers on a thread of their own, at a lower priority than
+// the workers so chat stays responsive while files are relayed
+void runTransfers(int listener)
 {
-    struct message dirMessAck;
-    dirMessAck.source = "SERVER";
+    if(setpriority(PRIO_PROCESS, syscall(SYS_gettid), TRANSFER_NICE) == -1) perror("setpriority");
     
-    stringstream ss(packet.data);
-    string receiverID, message;
-    ss >> receiverID;
+    transferEpfd = epoll_create1(0);
+    devNull = open("/dev/null", O_WRONLY);
+    if(transferEpfd == -1 || devNull == -1)
+    {
+        perror("transfers");
+        return;
+    }
     
-    for(auto const & client : clientList)
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listener;
+    epoll_ctl(transferEpfd, EPOLL_CTL_ADD, listener, &ev);
+    
+    struct epoll_event events[MAXEVENTS];
+    unsigned long nextExpiry = monotonicMillis() + 1000;
+    while(1)
     {
-        if(client.second.first == receiverID)
+        int n = epoll_wait(transferEpfd, events, MAXEVENTS, readyTransfers.empty() ? 1000 : 0);
+        if(n == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            return;
+        }
+        
+        // Transfers that went on in the last iteration come first, the ones
+        // their sockets woke up after them
+        vector<struct transfer*> ready;
+        ready.swap(readyTransfers);
+        
+        for(int i = 0; i < n; i++)
         {
-            // Don't send to yourself
-            if(client.first == senderfd)
+            int fd = events[i].data.fd;
+            if(fd == listener)
             {
-                dirMessAck.type = DMESS_NAK;
-                dirMessAck.data = "Can't send message to yourself!";
-                dirMessAck.size = dirMessAck.data.length() + 1;
-                sendToClient(&dirMessAck, senderfd);
-                
-                return false;
+                acceptDataConnections(listener);
+                continue;
             }
             
-            // Send message to receiver
-            getline(ss, message);
-            message.erase(0, 1); // Remove extra space
-            packet.data = message;
-            sendToClient(&packet, client.first);
-            
-            // Tell sender the message was delivered
-            dirMessAck.type = DMESS_ACK;
-            dirMessAck.data = receiverID;
-            dirMessAck.size = dirMessAck.data.length() + 1;
-            sendToClient(&dirMessAck, senderfd);
-            
-            return true;
+            auto it = dataConns.find(fd);
+            if(it == dataConns.end()) continue;
+            if(it->second.t == NULL) readToken(fd);
+            else if(it->second.t->started && !it->second.t->ready)
+            {
+                it->second.t->ready = true;
+                ready.push_back(it->second.t);
+            }
         }
+        
+        for(auto const & t : ready)
+        {
+            t->ready = false;
+            if(!t->closed && pumpTransfer(t)) readyTransfer(t);
+        }
+        
+        if(monotonicMillis() >= nextExpiry)
+        {
+            expireTransfers();
+            nextExpiry = monotonicMillis() + 1000;
+        }
+        
+        for(auto const & t : closedTransfers) delete t;
+        closedTransfers.clear();
+        fflush(stdout);
     }
+}
+
+
+// Runs the event loop of a worker thread on the requested backend
+void runShard(struct shard *s, string ioEngine)
+{
+    currentShard = s;
     
-    // Inform sender the user does not exist
-    dirMessAck.type = DMESS_NAK;
-    dirMessAck.data = "User '" + receiverID + "' does not exist!";
-    dirMessAck.size = dirMessAck.data.length() + 1;
-    sendToClient(&dirMessAck, senderfd);
+#ifdef USE_IO_URING
+    if(ioEngine == "uring")
+    {
+        if(uringInit())
+        {
+            uringActive = true;
+            if(s->id == 0) cout << "Using io_uring backend" << endl;
+            runUringLoop(s);
+        }
+        if(s->id == 0) cout << "io_uring not supported by the kernel, using epoll backend" << endl;
+    }
+#endif
     
-    return false;
+    runEpollLoop(s);
 }
 
+
 int main(int argc, char** argv)
 {
-    fd_set master;    // Master file descriptor list
-    fd_set read_fds;  // Temp file descriptor list for select()
-    int fdmax;        // Maximum file descriptor number
-
-    char remoteIP[INET6_ADDRSTRLEN];
+    string ioEngine = "uring"; // Falls back to epoll when io_uring isn't available
+    string transferPortNum; // File transfers are off unless given, 0 for any free port
+    int numThreads = 1;
+    int opt;
+    
+    unsigned long benchSessions = 0;
+    string userList;
+    string chromeTrace;
+    serverStart = monotonicMillis();
+    
+    while((opt = getopt(argc, argv, "e:t:d:w:p:m:f:l:r:i:s:b:u:g:k:v:a:T:c:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'e':
+                ioEngine = optarg;
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'd':
+                loginTimeout = atoi(optarg);
+                break;
+            case 'w':
+            {
+                // <high>[:<low>], the low watermark defaults to a quarter of the high one
+                char *low = strchr(optarg, ':');
+                highWatermark = strtoul(optarg, NULL, 10);
+                lowWatermark = low != NULL ? strtoul(low + 1, NULL, 10) : highWatermark / 4;
+                break;
+            }
+            case 'p':
+                if(strcmp(optarg, "drop") == 0) slowPolicy = POLICY_DROP_OLDEST;
+                else if(strcmp(optarg, "disconnect") == 0) slowPolicy = POLICY_DISCONNECT;
+                else if(strcmp(optarg, "pause") == 0) slowPolicy = POLICY_PAUSE;
+                else
+                {
+                    cout << "Choose drop, disconnect or pause as the slow consumer policy!" << endl;
+                    return 0;
+                }
+                break;
+            case 'm':
+                maxMessageSize = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                transferPortNum = optarg;
+                break;
+            case 'l':
+                logDirectory = optarg;
+                break;
+            case 'r':
+                replayCount = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                inboxDirectory = optarg;
+                break;
+            case 's':
+                stateDirectory = optarg;
+                break;
+            case 'b':
+                benchSessions = strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                credentialPath = optarg;
+                break;
+            case 'g':
+                userList = optarg;
+                break;
+            case 'k':
+                hashThreads = atoi(optarg);
+                break;
+            case 'v':
+                if(strcmp(optarg, "error") == 0) configuredLevel = LEVEL_ERROR;
+                else if(strcmp(optarg, "warn") == 0) configuredLevel = LEVEL_WARN;
+                else if(strcmp(optarg, "info") == 0) configuredLevel = LEVEL_INFO;
+                else
+                {
+                    cout << "Choose error, warn or info as the log level!" << endl;
+                    return 0;
+                }
+                logLevel.store(configuredLevel);
+                break;
+            case 'a':
+                adminPath = optarg;
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            case 'c':
+                chromeTrace = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: server <server_port_number> [-e epoll|uring] [-t threads] "
+                                "[-d login_timeout] [-w high[:low]] [-p drop|disconnect|pause] "
+                                "[-m max_message_size] [-f file_transfer_port] "
+                                "[-l log_directory] [-r replay_count] [-i inbox_directory] "
+                                "[-s state_directory] [-b bench_sessions] [-u credential_file] "
+                                "[-k hash_threads] [-v error|warn|info] [-a admin_socket] "
+                                "[-T trace_file]\n"
+                                "       server -u credential_file -g user_list\n"
+                                "       server -T trace_file -c chrome_json\n");
+                exit(1);
+        }
+    }
 
-    if(atoi(argv[1]) > 65535)
+    if(!userList.empty())
+    {
+        if(credentialPath.empty())
+        {
+            cout << "Choose the credential file to write with -u!" << endl;
+            return 1;
+        }
+        return writeCredentials(userList, credentialPath);
+    }
+    
+    if(!chromeTrace.empty())
+    {
+        if(tracePath.empty())
+        {
+            cout << "Choose the trace file to convert with -T!" << endl;
+            return 1;
+        }
+        return convertTrace(tracePath, chromeTrace) ? 0 : 3;
+    }
+    
+    if(optind >= argc || atoi(argv[optind]) > 65535)
     {
         cout << "Choose a valid port!" << endl;
         return 0;
     }
-    int listener = createListenerSocket(argv[1]);
+    if(numThreads < 1 || hashThreads < 1)
+    {
+        cout << "Choose at least one thread!" << endl;
+        return 0;
+    }
+    if(highWatermark == 0 || lowWatermark > highWatermark)
+    {
+        cout << "Choose a low watermark no higher than the high watermark!" << endl;
+        return 0;
+    }
     
-    cout << "Waiting for connections..." << endl;
+    // Allow as many connections as the hard limit permits and size the
+    // connection table to match
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    connTable.assign(limit.rlim_cur < (1 << 22) ? limit.rlim_cur : (1 << 22), NULL);
     
-    // Clear master and temp sets and add the listener socket to master
-    FD_ZERO(&master);
-    FD_ZERO(&read_fds);
-    FD_SET(listener, &master);
-
-    // Keep track of the biggest file descriptor
-    fdmax = listener;
-
-    // Main loop
-    while(1)
-    {        
-        read_fds = master; // copy master list
-        if (select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1)
+    if(benchSessions > 0)
+    {
+        benchRestore(benchSessions);
+        return 0;
+    }
+    
+    if(!credentialPath.empty())
+    {
+        unsigned long start = monotonicMillis();
+        credentials = mapCredentials(credentialPath);
+        if(credentials == NULL || getrandom(verifiedKey, sizeof verifiedKey, 0) != sizeof verifiedKey)
         {
-            perror("select");
-            exit(4);
+            exit(3);
         }
-
-        // Run through the existing connections looking for data to read
-        for(int i = 0; i <= fdmax; i++)
+        printf("server: %u users in %s, mapped in %lu ms\n",
+               credentials->userCount, credentialPath.c_str(), monotonicMillis() - start);
+    }
+    
+    if(!logDirectory.empty() && mkdir(logDirectory.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        perror("mkdir");
+        exit(3);
+    }
+    
+    // The sessions that were up when the server went down are back before
+    // anyone can connect
+    if(!stateDirectory.empty())
+    {
+        if(mkdir(stateDirectory.c_str(), 0700) == -1 && errno != EEXIST)
         {
-            if (FD_ISSET(i, &read_fds)) // Part of the tracked file descriptors
-            { 
-                if (i == listener) // Handle new connections
-                {
-                    struct sockaddr_storage remoteaddr; // client address
-                    socklen_t addrlen = sizeof(remoteaddr);
-                    int newfd = accept(listener, (struct sockaddr *)&remoteaddr, &addrlen);
-
-                    if (newfd == -1) perror("accept");
-                    else
-                    {   
-                        if(loginClient(newfd) == true)
-                        {
-                            FD_SET(newfd, &master); // add to master set
-                            if (newfd > fdmax) fdmax = newfd;
-
-                            printf("server: new connection from %s on socket %d\n",
-                                inet_ntop(remoteaddr.ss_family,
-                                    get_in_addr((struct sockaddr*)&remoteaddr),
-                                    remoteIP, INET6_ADDRSTRLEN),
-                                    newfd);
-                        }
-                        else
-                        {
-                            cout << "Attempted connection failed" << endl;
-                            close(newfd);
-                        }
-                    }             
-                }
-                
-                else // Handle other commands from client
-                {
-                    int nbytes;
-                    char buf[MAXDATASIZE];
-
-                    if ((nbytes = recv(i, buf, MAXDATASIZE, 0)) <= 0)
-                    {
-                        // Got error or connection closed by client
-                        if (nbytes == 0) // Connection closed
-                        {
-                            printf("server: socket %d hung up\n", i);
-                            clientList.erase(i); // Remove client
-                            
-                            // Remove client from a session
-                            string sessionID = clientSockfdToSessionID(i);
-                            if(sessionID != SESSION_NOT_FOUND)
-                            {
-                                auto session = sessionList.find(sessionID);
-                                session->second.erase(i);
-                                if(session->second.empty())
-                                {
-                                    sessionList.erase(session);
-                                }
-                            }
-                        }
-                        else perror("recv");
-                        
-                        close(i);
-                        FD_CLR(i, &master); // remove from master set
-                    }
-                    
-                    else // We got some data from a client
-                    {
-
-                        struct message packet = messageFromPacket(buf);
-                        string sessionID;
-                        stringstream ss(packet.data);
-                        
-                        switch(packet.type)
-                        {
-                            case JOIN:
-                                
-                                ss >> sessionID;
-                                
-                                if(joinSession(i, packet.data))
-                                {
-                                    cout << "Client '" << packet.source << "' joined session '" 
-                                         << sessionID  << "'" << endl;
-                                }
-                                else
-                                {
-                                    cout << "Client '" << packet.source << "' could not join session '" 
-                                         << sessionID << "'" << endl;
-                                }
-                                break;
-                                
-                                
-                            case LEAVE_SESS:
-                                if (leaveSession(i))
-                                {
-                                    cout << "Client '" << packet.source << "' has left session" << endl;
-                                         
-                                }
-                                else
-                                {
-                                    cout << "Client '" << packet.source << "' is not in a session" 
-                                         << endl;
-                                }
-                                break;
-                                
-                            case NEW_SESS:
-                                
-                                ss >> sessionID;
-                                
-                                if(createSession(i, packet.data))
-                                {
-                                    cout << "New session '" << sessionID << "' created for client "
-                                         << packet.source << endl;
-                                }
-                                else
-                                {
-                                    cout << "Session '" << sessionID << "' cannot be created" 
-                                         << endl;
-                                }     
-                                break;
-                            case MESSAGE:
-                            {
-                                // Get list of clients connected in the session with the sender
-                                string sessionID = clientSockfdToSessionID(i);
-                                unordered_set<int> session;
-                                if(sessionID != SESSION_NOT_FOUND)
-                                {
-                                    session = sessionList.find(sessionID)->second;
-                                }
-                                
-                                packet.data.erase(0, 1); // Remove extra space
-                                
-                                // Send message to all clients in the session (excluding the sender)
-                                for(auto const & clientSockfd : session)
-                                {
-                                    if(clientSockfd != i) sendToClient(&packet, clientSockfd);
-                                }
-                                
-                                cout << "Message sent to session '" << sessionID << "'" << endl;
-                                break;
-                            }
-                            case DIRMESSAGE:
-                            {
-                                if(!sendDirectMessage(packet, i))
-                                {
-                                    cout << "Direct message not sent" << endl;
-                                }
-                                else
-                                {
-                                    cout << "Direct message sent" << endl;
-                                }
-                            }
-                            case QUERY:
-                                createList(i);
-                                break;
-                            default:
-                                break;
-                        }
-                    }
-                } // END handle data from client
-            } // END got new incoming connection
-        } // END looping through file descriptors
-    } // END while
-
+            perror("mkdir");
+            exit(3);
+        }
+        restoreState();
+    }
+    
+    // One listener per worker, the kernel balances new connections among them
+    for(int i = 0; i < numThreads; i++)
+    {
+        shards.push_back(createShard(i, argv[optind], numThreads > 1));
+    }
+    
+    // A client resetting its connection must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, requestFlushStats);
+    signal(SIGUSR2, lowerLogLevel);
+    if(credentials != NULL) signal(SIGHUP, requestReload);
+    
+    // File transfers get a listener and a thread of their own, if asked for.
+    // Without one, transferPort stays 0 and offers are refused.
+    int transferListener = -1;
+    if(!transferPortNum.empty())
+    {
+        transferListener = createListenerSocket(transferPortNum.c_str(), false);
+        struct sockaddr_storage transferAddr;
+        socklen_t addrLen = sizeof transferAddr;
+        if(!setNonBlocking(transferListener) ||
+           getsockname(transferListener, (struct sockaddr*) &transferAddr, &addrLen) == -1)
+        {
+            perror("transfers");
+            exit(3);
+        }
+        transferPort = ntohs(transferAddr.ss_family == AF_INET6 ?
+                             ((struct sockaddr_in6*) &transferAddr)->sin6_port :
+                             ((struct sockaddr_in*) &transferAddr)->sin_port);
+    }
+    
+    // Inboxes are opened as users need them
+    if(!inboxDirectory.empty() && mkdir(inboxDirectory.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        perror("mkdir");
+        exit(3);
+    }
+    
+    cout << "Waiting for connections..." << endl;
+    if(transferListener != -1) cout << "File transfers on port " << transferPort << endl;
+    
+    // Events are logged through the writer thread from now on
+    eventWakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(eventWakefd == -1)
+    {
+        perror("eventfd");
+        exit(3);
+    }
+    
+    vector<thread> workers;
+    workers.push_back(thread(runEventWriter));
+    if(!tracePath.empty())
+    {
+        startTrace();
+        workers.push_back(thread(runTraceWriter));
+    }
+    if(!adminPath.empty()) workers.push_back(thread(runAdmin, createAdminSocket(adminPath)));
+    if(transferListener != -1) workers.push_back(thread(runTransfers, transferListener));
+    if(!logDirectory.empty() || !inboxDirectory.empty() || !stateDirectory.empty()) workers.push_back(thread(runLogCommitter));
+    for(int i = 0; i < hashThreads; i++) workers.push_back(thread(runHasher));
+    for(int i = 1; i < numThreads; i++)
+    {
+        workers.push_back(thread(runShard, shards[i], ioEngine));
+    }
+    runShard(shards[0], ioEngine);
+    
     return 0;
 }